@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "token.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // bump arena
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Hands out slots for trivial values in fixed-size blocks, addressed by
+    // a 32-bit index. Blocks never move, growing costs one allocation per
+    // block and no copy, and clear() only forgets the slots, so the blocks
+    // are reused by the next tree.
+    template <typename T, std::size_t BlockBits = 12>
+    struct bump_arena {
+        static_assert(std::is_trivially_copyable<T>::value, "arena values are never destroyed");
+        static constexpr std::size_t block_size = std::size_t(1) << BlockBits;
+
+    private:
+        std::vector<std::unique_ptr<T[]>> _blocks;
+        std::uint32_t _size = 0;
+
+    public:
+        std::uint32_t push(const T &value) {
+            if (_size == std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("arena index overflow");
+            }
+            if (_size == _blocks.size() * block_size) {
+                _blocks.emplace_back(new T[block_size]);
+            }
+            std::uint32_t index = _size++;
+            (*this)[index] = value;
+            return index;
+        }
+
+        T &operator[](std::uint32_t index) {
+            return _blocks[index >> BlockBits][index & (block_size - 1)];
+        }
+
+        const T &operator[](std::uint32_t index) const {
+            return _blocks[index >> BlockBits][index & (block_size - 1)];
+        }
+
+        std::uint32_t size() const {
+            return _size;
+        }
+
+        std::size_t blocks() const {
+            return _blocks.size();
+        }
+
+        void clear() {
+            _size = 0;
+        }
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // syntax tree
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // index of a node in its ast, 0 for no node
+    using ast_index = std::uint32_t;
+
+    constexpr ast_index no_node = 0;
+
+    // Children are _a, _b and _c as listed, "list" means the first node
+    // of a list linked by _next. _token is the token that made the node.
+    enum class ast_kind : std::uint8_t {
+        NONE,
+
+        // expressions
+        NAME,           // the identifier is _token
+        LITERAL,        // a literal token, custom literals included
+        CONSTANT,       // true, false or null
+        UNARY,          // _op _a, _op is UNDEFINED for new, gcnew and typeid
+        POSTFIX,        // _a _op
+        BINARY,         // _a _op _b, and/or/: included
+        ASSIGN,         // _a _op _b
+        TERNARY,        // _a ? _b : _c
+        CALL,           // _a(list _b)
+        INDEX,          // _a[_b]
+        MEMBER,         // _a _op _b, _op is DOT or ARROW and _b a NAME
+        ARRAY,          // {list _a}
+        LAMBDA,         // [](list _a) -> _b
+
+        // statements
+        MODULE,         // list _a
+        EXPRESSION,     // _a
+        PREPROCESSOR,   // _token
+        IMPORT,         // list _a of NAME/MEMBER paths
+        PACKAGE,        // _a
+        USING,          // _a
+        VAR,            // _token name = _a (or no_node), CONST flag
+        FUNCTION,       // _token name (list _a params) list _b, OVERRIDE flag
+        RETURN,         // _a or no_node
+        BREAK,
+        CONTINUE,
+        THROW,          // _a
+        BLOCK,          // list _a
+        IF,             // if _a list _b else list _c
+        WHILE,          // while _a list _b
+        LOOP,           // loop list _a until _b (or no_node)
+        FOR,            // list _a of init, condition, step, then list _b
+        FOR_IN,         // for _token in _a list _b
+        TRY,            // try list _a catch NAME _b list _c
+        SWITCH,         // switch _a list _b of CASE
+        CASE,           // case _a (no_node for default) list _b
+        NAMESPACE,      // _token name list _b
+        STRUCT,         // _token name extends _a (or no_node) list _b, CLASS flag
+    };
+
+    enum ast_flag : std::uint16_t {
+        AST_CONST = 1U << 0U,
+        AST_OVERRIDE = 1U << 1U,
+        AST_CLASS = 1U << 2U,
+    };
+
+    struct ast_node {
+        ast_kind _kind;
+        operator_type _op;
+        std::uint16_t _flags;
+        std::uint32_t _token;
+        ast_index _a;
+        ast_index _b;
+        ast_index _c;
+        // next node of the list this one is in
+        ast_index _next;
+    };
+
+    // A module's tree. Nodes refer to each other and to the token_stream
+    // they were parsed from by index, so the tree is a few blocks of
+    // plain data that go away at once.
+    struct ast {
+    private:
+        bump_arena<ast_node> _nodes;
+        ast_index _root = no_node;
+
+    public:
+        ast() {
+            // index 0 is no_node
+            _nodes.push(ast_node{});
+        }
+
+        ast_index make(ast_kind kind, std::uint32_t token, ast_index a = no_node,
+                       ast_index b = no_node, ast_index c = no_node) {
+            return _nodes.push(ast_node{kind, operator_type::UNDEFINED, 0, token, a, b, c, no_node});
+        }
+
+        ast_node &operator[](ast_index index) {
+            return _nodes[index];
+        }
+
+        const ast_node &operator[](ast_index index) const {
+            return _nodes[index];
+        }
+
+        // nodes made so far, no_node included
+        std::uint32_t size() const {
+            return _nodes.size();
+        }
+
+        std::size_t blocks() const {
+            return _nodes.blocks();
+        }
+
+        ast_index root() const {
+            return _root;
+        }
+
+        void root(ast_index index) {
+            _root = index;
+        }
+
+        // drop the tree, keeping the blocks for the next one
+        void clear() {
+            _nodes.clear();
+            _nodes.push(ast_node{});
+            _root = no_node;
+        }
+
+        std::size_t list_size(ast_index first) const {
+            std::size_t n = 0;
+            for (ast_index i = first; i != no_node; i = _nodes[i]._next) {
+                ++n;
+            }
+            return n;
+        }
+    };
+
+    // appends nodes to a list, keeping its end
+    struct ast_list {
+        ast_index _first = no_node;
+        ast_index _last = no_node;
+
+        void push(ast &tree, ast_index node) {
+            if (_first == no_node) {
+                _first = node;
+            } else {
+                tree[_last]._next = node;
+            }
+            _last = node;
+        }
+    };
+}
+
+namespace cs {
+    using cs_impl::ast;
+    using cs_impl::ast_index;
+    using cs_impl::ast_kind;
+    using cs_impl::ast_node;
+}
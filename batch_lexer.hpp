@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lexer.hpp"
+#include "thread_pool.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // batch lexing
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // what lexing one file of a batch gave
+    struct batch_result {
+        std::string _path;
+        // tokens before an error are kept, symbols are the batch's
+        token_stream _tokens;
+        // code units of the source and time its worker spent on it
+        std::size_t _length = 0;
+        double _seconds = 0;
+        std::unique_ptr<lexer_error> _error;
+        // e.g. the file could not be read
+        std::exception_ptr _other_error;
+
+        bool ok() const {
+            return !_error && !_other_error;
+        }
+    };
+
+    // One worker thread's lexer, kept for every file the thread gets so
+    // its symbol table and buffers are reused.
+    template <typename Charset, typename OperatorTable>
+    struct batch_worker {
+        std::unique_ptr<basic_lexer<Charset, OperatorTable>> _lexer;
+        std::unique_ptr<token_cache> _cache;
+        // the lexer's symbols in the batch's table, 0 when not seen yet
+        std::vector<symbol_t> _renamed;
+
+        // errors are kept in result, _lexer must be made first
+        void lex_file(batch_result &result) {
+            auto start = std::chrono::steady_clock::now();
+            try {
+                _lexer->source_file(result._path);
+                if (_cache) {
+                    _lexer->lex(result._tokens, *_cache);
+                } else {
+                    _lexer->lex(result._tokens);
+                }
+            } catch (const lexer_error &e) {
+                result._error.reset(new lexer_error(e));
+            } catch (...) {
+                result._other_error = std::current_exception();
+            }
+            if (result._tokens.source()) {
+                result._length = result._tokens.source()->length();
+            }
+            result._seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        // move tokens from the lexer's symbols to symbols
+        void rename(symbol_table &symbols, batch_result &result) {
+            const symbol_table &own = _lexer->symbols();
+            _renamed.resize(own.size(), 0);
+            bool renamed = false;
+            for (const auto &r : result._tokens) {
+                if (r._type != token_type::ID_OR_KW) {
+                    continue;
+                }
+                symbol_t &to = _renamed[r._payload];
+                if (to == 0) {
+                    std::string name = own.name(r._payload);
+                    to = symbols.intern(name.data(), name.size());
+                }
+                renamed |= to != r._payload;
+            }
+            if (!renamed) {
+                return;
+            }
+            token_stream tokens;
+            tokens.source(result._tokens.source());
+            tokens.append(result._tokens, 0, result._tokens.size(), token_shift{}, &_renamed);
+            result._tokens = std::move(tokens);
+        }
+    };
+
+    // Lexes many files on a work-stealing pool, each worker thread with
+    // its own batch_worker. Results come back in the order of the paths
+    // and their symbols are renumbered into the batch's own table in that
+    // order, so a batch gives the same tokens however it was scheduled.
+    template <typename Charset, typename OperatorTable>
+    struct basic_batch_lexer {
+        using lexer_type = basic_lexer<Charset, OperatorTable>;
+
+    private:
+        using worker = batch_worker<Charset, OperatorTable>;
+
+        std::function<std::unique_ptr<lexer_type>()> _make_lexer;
+        std::size_t _threads;
+        std::vector<worker> _workers;
+        symbol_table _symbols;
+        std::string _cache_directory;
+        std::uint64_t _cache_max_bytes = 0;
+
+        void lex_file(worker &w, batch_result &result) {
+            if (!w._lexer) {
+                w._lexer = _make_lexer();
+                if (!_cache_directory.empty()) {
+                    w._cache.reset(new token_cache(_cache_directory, _cache_max_bytes));
+                }
+            }
+            w.lex_file(result);
+        }
+
+    public:
+        // threads is the number of workers, 0 for one per core
+        explicit basic_batch_lexer(std::function<std::unique_ptr<lexer_type>()> make_lexer,
+                                   std::size_t threads = 0)
+            : _make_lexer(std::move(make_lexer)),
+              _threads(threads != 0 ? threads : std::max(1U, std::thread::hardware_concurrency())),
+              _workers(_threads) {}
+
+        // let every worker keep a token_cache in directory
+        void cache(std::string directory, std::uint64_t max_bytes = 256ULL * 1024 * 1024) {
+            _cache_directory = std::move(directory);
+            _cache_max_bytes = max_bytes;
+            for (auto &w : _workers) {
+                w._cache.reset();
+                if (w._lexer && !_cache_directory.empty()) {
+                    w._cache.reset(new token_cache(_cache_directory, _cache_max_bytes));
+                }
+            }
+        }
+
+        // names of the symbols in ID_OR_KW tokens of every batch so far
+        const symbol_table &symbols() const {
+            return _symbols;
+        }
+
+        // the workers' lexer_stats added up, see basic_lexer::stats(),
+        // phase times are summed over the workers
+        lexer_stats stats() const {
+            lexer_stats total;
+            for (const auto &w : _workers) {
+                if (w._lexer) {
+                    total.merge(w._lexer->stats());
+                }
+            }
+            return total;
+        }
+
+        std::vector<batch_result> lex(const std::vector<std::string> &paths) {
+            std::vector<batch_result> results(paths.size());
+            std::vector<std::size_t> lexed_by(paths.size());
+            for (std::size_t i = 0; i < paths.size(); ++i) {
+                results[i]._path = paths[i];
+            }
+
+            work_stealing_pool::run(paths.size(), _threads, [&](std::size_t self, std::size_t job) {
+                lex_file(_workers[self], results[job]);
+                lexed_by[job] = self;
+            });
+
+            for (std::size_t i = 0; i < results.size(); ++i) {
+                _workers[lexed_by[i]].rename(_symbols, results[i]);
+            }
+            return results;
+        }
+    };
+
+    using batch_lexer = basic_batch_lexer<mpp::codecvt::charset, operator_trie>;
+    using utf8_batch_lexer = basic_batch_lexer<mpp::codecvt::utf8, default_operator_set>;
+}
+
+namespace cs {
+    using cs_impl::basic_batch_lexer;
+    using cs_impl::batch_lexer;
+    using cs_impl::utf8_batch_lexer;
+}
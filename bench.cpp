@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "lexer.hpp"
+
+// covscript-bench: lexer throughput on reproducible synthetic corpora
+//
+//   covscript-bench [--size MB] [--repeat N] [--seed N] [--filter TEXT]
+//                   [--save FILE] [--baseline FILE] [--tolerance PERCENT]
+//
+// every case is lexed `repeat` times and the best run is reported.
+// with --baseline, cases slower than the baseline by more than the
+// tolerance, or doing more allocations, are reported and the exit code is 1.
+
+////////////////////////////////////////////////////////////////////////////////
+// allocation counting
+////////////////////////////////////////////////////////////////////////////////
+
+// every allocation of the process, counted in bench_alloc.cpp
+extern std::atomic<std::size_t> allocations;
+
+////////////////////////////////////////////////////////////////////////////////
+// peak RSS
+////////////////////////////////////////////////////////////////////////////////
+
+// the process high-water mark is reset before every case, so a case
+// reports its own peak. linux only, elsewhere peak RSS is 0.
+static bool reset_peak_rss() {
+    std::ofstream out("/proc/self/clear_refs");
+    out << "5";
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+static std::size_t peak_rss_kb() {
+    std::ifstream in("/proc/self/status");
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::strtoul(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// corpus generators
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+    using rng_t = std::mt19937;
+
+    template <typename T>
+    const T &pick(rng_t &rng, const std::vector<T> &items) {
+        return items[rng() % items.size()];
+    }
+
+    std::string identifier(rng_t &rng) {
+        static const std::vector<std::string> words = {
+            "value", "count", "index", "node", "buffer", "result", "text", "size",
+            "item", "list", "map", "key", "data", "next", "prev", "total", "i", "j",
+        };
+        std::string id = pick(rng, words);
+        if (rng() % 2) {
+            id += "_" + pick(rng, words);
+        }
+        if (rng() % 4 == 0) {
+            id += std::to_string(rng() % 100);
+        }
+        return id;
+    }
+
+    std::string string_body(rng_t &rng) {
+        static const std::vector<std::string> parts = {
+            "hello", " ", "world", "\\n", "\\t", "\\\"", "\\\\", "lorem ipsum dolor", ", ", "%d", "{}",
+        };
+        std::string body;
+        for (auto n = rng() % 8 + 1; n > 0; --n) {
+            body += pick(rng, parts);
+        }
+        return body;
+    }
+
+    std::string number(rng_t &rng) {
+        switch (rng() % 4) {
+            case 0:
+                return std::to_string(rng() % 1000000);
+            case 1:
+                return std::to_string(rng() % 1000) + "." + std::to_string(rng() % 100000);
+            case 2: {
+                std::ostringstream os;
+                os << "0x" << std::hex << (rng() % 0xFFFFFF);
+                return os.str();
+            }
+            default:
+                return "0b" + std::to_string(rng() % 2) + std::to_string(rng() % 2)
+                       + std::to_string(rng() % 2) + std::to_string(rng() % 2);
+        }
+    }
+
+    void identifier_line(rng_t &rng, std::string &out) {
+        out += "var " + identifier(rng) + " = " + identifier(rng) + "." + identifier(rng)
+               + "(" + identifier(rng) + ", " + identifier(rng) + ")\n";
+    }
+
+    void operator_line(rng_t &rng, std::string &out) {
+        static const std::vector<std::string> operands = {"a", "b", "c", "x", "y", "1", "(", ")"};
+        for (auto n = rng() % 12 + 4; n > 0; --n) {
+            out += pick(rng, operands);
+            out += cs_impl::default_operators[rng() % (sizeof(cs_impl::default_operators)
+                                                       / sizeof(cs_impl::default_operators[0]))]._text;
+        }
+        out += "z\n";
+    }
+
+    void string_line(rng_t &rng, std::string &out) {
+        out += "var " + identifier(rng) + " = \"" + string_body(rng) + "\" + \"" + string_body(rng) + "\"\n";
+    }
+
+    void number_line(rng_t &rng, std::string &out) {
+        out += "var " + identifier(rng) + " = [";
+        for (auto n = rng() % 8 + 1; n > 0; --n) {
+            out += number(rng) + ", ";
+        }
+        out += number(rng) + "]\n";
+    }
+
+    void unicode_line(rng_t &rng, std::string &out) {
+        static const std::vector<std::string> names = {
+            "变量", "我爱你", "打印", "淦tmd", "名字", "数组", "计数器", "🐎", "🔨",
+        };
+        switch (rng() % 3) {
+            case 0:
+                out += "var " + pick(rng, names) + " = \"草你" + pick(rng, names) + "的大🔨\"\n";
+                break;
+            case 1:
+                out += "while(" + pick(rng, names) + " != " + pick(rng, names) + "){ "
+                       + pick(rng, names) + "(" + pick(rng, names) + ") }\n";
+                break;
+            default:
+                out += pick(rng, names) + "." + pick(rng, names) + "(" + identifier(rng) + ")\n";
+                break;
+        }
+    }
+
+    void suffix_line(rng_t &rng, std::string &out) {
+        static const std::vector<std::string> suffixes = {"_km", "_ms", "_str", "_lit2", "_li$", "_"};
+        switch (rng() % 4) {
+            case 0:
+                out += "var " + identifier(rng) + " = " + number(rng) + pick(rng, suffixes) + "\n";
+                break;
+            case 1:
+                out += "var " + identifier(rng) + " = \"" + string_body(rng) + "\"" + pick(rng, suffixes) + "\n";
+                break;
+            case 2:
+                out += "var " + identifier(rng) + " = 'z'" + pick(rng, suffixes) + "\n";
+                break;
+            default:
+                out += identifier(rng) + "(1.5" + pick(rng, suffixes) + ", 3" + pick(rng, suffixes) + ")\n";
+                break;
+        }
+    }
+
+    void mixed_line(rng_t &rng, std::string &out) {
+        static const std::vector<void (*)(rng_t &, std::string &)> lines = {
+            identifier_line, identifier_line, identifier_line, operator_line,
+            string_line, number_line, unicode_line, suffix_line,
+        };
+        if (rng() % 16 == 0) {
+            out += "# " + string_body(rng) + "\n";
+        }
+        pick(rng, lines)(rng, out);
+    }
+
+    struct corpus_kind {
+        const char *_name;
+        void (*_line)(rng_t &, std::string &);
+    };
+
+    const corpus_kind corpus_kinds[] = {
+        {"identifiers", identifier_line},
+        {"operators",   operator_line},
+        {"strings",     string_line},
+        {"numbers",     number_line},
+        {"unicode",     unicode_line},
+        {"suffixes",    suffix_line},
+        {"mixed",       mixed_line},
+    };
+
+    std::string make_corpus(const corpus_kind &kind, std::size_t size, unsigned seed) {
+        rng_t rng(seed);
+        std::string text;
+        text.reserve(size + 256);
+        while (text.size() < size) {
+            kind._line(rng, text);
+        }
+        return text;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // results
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct result {
+        double _mb_per_s = 0;
+        double _tokens_per_s = 0;
+        std::size_t _allocations = 0;
+        std::size_t _peak_rss_kb = 0;
+    };
+
+    // one case per line, so reading it back needs no JSON library
+    void save_results(const std::string &path, const std::map<std::string, result> &results) {
+        std::ofstream out(path);
+        out << "{\n";
+        std::size_t i = 0;
+        for (const auto &r : results) {
+            out << "  \"" << r.first << "\": {\"mb_per_s\": " << r.second._mb_per_s
+                << ", \"tokens_per_s\": " << r.second._tokens_per_s
+                << ", \"allocations\": " << r.second._allocations
+                << ", \"peak_rss_kb\": " << r.second._peak_rss_kb << "}"
+                << (++i == results.size() ? "\n" : ",\n");
+        }
+        out << "}\n";
+    }
+
+    double field(const std::string &line, const std::string &name) {
+        auto pos = line.find("\"" + name + "\":");
+        if (pos == std::string::npos) {
+            return 0;
+        }
+        return std::strtod(line.c_str() + pos + name.size() + 3, nullptr);
+    }
+
+    std::map<std::string, result> load_results(const std::string &path) {
+        std::map<std::string, result> results;
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("cannot open baseline: " + path);
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            auto begin = line.find('"');
+            auto end = begin == std::string::npos ? begin : line.find('"', begin + 1);
+            if (end == std::string::npos || line.find('{', end) == std::string::npos) {
+                continue;
+            }
+            result &r = results[line.substr(begin + 1, end - begin - 1)];
+            r._mb_per_s = field(line, "mb_per_s");
+            r._tokens_per_s = field(line, "tokens_per_s");
+            r._allocations = static_cast<std::size_t>(field(line, "allocations"));
+            r._peak_rss_kb = static_cast<std::size_t>(field(line, "peak_rss_kb"));
+        }
+        return results;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // engines
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct engine_case {
+        const char *_name;
+        std::function<result(const std::string &, std::size_t)> _run;
+    };
+
+    // every run lexes the whole text, decoding the source is
+    // part of the work for the WIDE engine
+    template <typename LexerT>
+    std::size_t lex_once(LexerT &lexer, bool parallel, const std::string &text) {
+        cs_impl::token_stream tokens;
+        lexer.source(text);
+        if (parallel) {
+            lexer.lex_parallel(tokens);
+        } else {
+            lexer.lex(tokens);
+        }
+        return tokens.size();
+    }
+
+    // A first run is not measured, it allocates what the lexer keeps for
+    // later runs. Speed is the fastest run's, allocations the fewest of
+    // any run, so neither depends on which run was fastest.
+    template <typename LexerT>
+    result run_case(LexerT lexer, bool parallel, const std::string &text, std::size_t repeat) {
+        result best;
+        double best_seconds = 0;
+        bool measured = reset_peak_rss();
+        lex_once(lexer, parallel, text);
+        for (std::size_t i = 0; i < repeat; ++i) {
+            std::size_t allocations_before = allocations;
+            auto start = std::chrono::steady_clock::now();
+            std::size_t tokens = lex_once(lexer, parallel, text);
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            std::size_t allocated = allocations - allocations_before;
+
+            if (i == 0 || seconds.count() < best_seconds) {
+                best_seconds = seconds.count();
+                best._mb_per_s = static_cast<double>(text.size()) / (1024 * 1024) / best_seconds;
+                best._tokens_per_s = static_cast<double>(tokens) / best_seconds;
+            }
+            if (i == 0 || allocated < best._allocations) {
+                best._allocations = allocated;
+            }
+        }
+        best._peak_rss_kb = measured ? peak_rss_kb() : 0;
+        return best;
+    }
+
+    cs::lexer runtime_lexer(cs_impl::lexer_engine engine) {
+        cs::lexer lexer{std::make_unique<mpp::codecvt::utf8>(), engine};
+        std::unordered_map<std::string, cs_impl::operator_type> operators;
+        for (const auto &op : cs_impl::default_operators) {
+            operators.emplace(op._text, op._type);
+        }
+        lexer.add_operators(operators);
+        return lexer;
+    }
+
+    const std::vector<engine_case> &engine_cases() {
+        using cs_impl::lexer_engine;
+        static const std::vector<engine_case> cases = {
+            {"wide", [](const std::string &text, std::size_t repeat) {
+                return run_case(runtime_lexer(lexer_engine::WIDE), false, text, repeat);
+            }},
+            {"utf8", [](const std::string &text, std::size_t repeat) {
+                return run_case(runtime_lexer(lexer_engine::UTF8), false, text, repeat);
+            }},
+            {"utf8-parallel", [](const std::string &text, std::size_t repeat) {
+                return run_case(runtime_lexer(lexer_engine::UTF8), true, text, repeat);
+            }},
+            {"utf8-static", [](const std::string &text, std::size_t repeat) {
+                return run_case(cs::utf8_lexer{std::make_unique<mpp::codecvt::utf8>(), lexer_engine::UTF8},
+                                false, text, repeat);
+            }},
+        };
+        return cases;
+    }
+}
+
+int main(int argc, char **argv) {
+    std::size_t size_mb = 8;
+    std::size_t repeat = 5;
+    unsigned seed = 20200310;
+    double tolerance = 10;
+    std::string filter, save_path, baseline_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return 2;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--size") {
+                size_mb = std::stoul(value);
+            } else if (arg == "--repeat") {
+                repeat = std::max<std::size_t>(1, std::stoul(value));
+            } else if (arg == "--seed") {
+                seed = static_cast<unsigned>(std::stoul(value));
+            } else if (arg == "--filter") {
+                filter = value;
+            } else if (arg == "--save") {
+                save_path = value;
+            } else if (arg == "--baseline") {
+                baseline_path = value;
+            } else if (arg == "--tolerance") {
+                tolerance = std::stod(value);
+            } else {
+                std::cerr << "unknown option " << arg << "\n";
+                return 2;
+            }
+        } catch (const std::logic_error &) {
+            // std::invalid_argument or std::out_of_range from stoul/stod
+            std::cerr << "invalid value for " << arg << ": " << value << "\n";
+            return 2;
+        }
+    }
+
+    // read before the run, so a bad path does not waste it
+    std::map<std::string, result> baseline;
+    if (!baseline_path.empty()) {
+        try {
+            baseline = load_results(baseline_path);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << "\n";
+            return 2;
+        }
+    }
+
+    std::map<std::string, result> results;
+    printf("%-28s %10s %14s %12s %12s\n", "case", "MB/s", "tokens/s", "allocations", "peak RSS KB");
+
+    for (const auto &kind : corpus_kinds) {
+        std::string text = make_corpus(kind, size_mb * 1024 * 1024, seed);
+        for (const auto &engine : engine_cases()) {
+            std::string name = std::string(kind._name) + "/" + engine._name;
+            if (name.find(filter) == std::string::npos) {
+                continue;
+            }
+            try {
+                result r = engine._run(text, repeat);
+                results[name] = r;
+                printf("%-28s %10.1f %14.0f %12zu %12zu\n",
+                       name.c_str(), r._mb_per_s, r._tokens_per_s, r._allocations, r._peak_rss_kb);
+            } catch (const cs_impl::lexer_error &e) {
+                mpp::format(std::cerr, "{}: lexer error at line {} column {}-{}: {}\n",
+                    name, e._line, e._start_column, e._end_column, e.what());
+                return 1;
+            }
+        }
+    }
+
+    if (!save_path.empty()) {
+        save_results(save_path, results);
+    }
+
+    if (baseline_path.empty()) {
+        return 0;
+    }
+
+    bool regressed = false;
+    for (const auto &r : results) {
+        auto iter = baseline.find(r.first);
+        if (iter == baseline.end()) {
+            continue;
+        }
+        const result &base = iter->second;
+        if (r.second._mb_per_s < base._mb_per_s * (1 - tolerance / 100)) {
+            printf("REGRESSION %s: %.1f MB/s, baseline %.1f MB/s\n",
+                   r.first.c_str(), r.second._mb_per_s, base._mb_per_s);
+            regressed = true;
+        }
+        if (r.second._allocations > base._allocations) {
+            printf("REGRESSION %s: %zu allocations, baseline %zu\n",
+                   r.first.c_str(), r.second._allocations, base._allocations);
+            regressed = true;
+        }
+    }
+    return regressed ? 1 : 0;
+}
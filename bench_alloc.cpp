@@ -0,0 +1,44 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// allocation counting for covscript-bench, and for covscript-exp
+// built with COVSCRIPT_LEXER_STATS
+//
+// the replacements live apart from their callers, so they are never
+// inlined into them and the compiler sees every new matched by the
+// library's delete.
+
+std::atomic<std::size_t> allocations{0};
+
+static void *counted_alloc(std::size_t size) {
+    ++allocations;
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size) {
+    return counted_alloc(size);
+}
+
+void *operator new[](std::size_t size) {
+    return counted_alloc(size);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+    std::free(p);
+}
@@ -0,0 +1,467 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // instructions
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // A stack machine. An instruction is its opcode byte and its operands:
+    //   i  an index (slot, constant, function or count), 1 byte
+    //   s  a signed value, 1 byte
+    //   j  a jump, 4 bytes signed, relative to the end of the instruction
+    // After EXTENDED, the i and s operands of the next instruction are
+    // 4 bytes. Everything is little endian. Stack effects are given as
+    // before -> after, top on the right.
+    enum class opcode : std::uint8_t {
+        NOP,
+        EXTENDED,
+
+        POP,                    // a ->
+        DUP,                    // a -> a a
+        DUP2,                   // a b -> a b a b
+
+        PUSH_NULL,
+        PUSH_TRUE,
+        PUSH_FALSE,
+        PUSH_INT,               // s: -> s
+        PUSH_CONST,             // i: -> constant i
+
+        // variables, stores pop the value
+        LOAD_LOCAL,             // i: -> slot i
+        STORE_LOCAL,            // i: a ->
+        INC_LOCAL,              // i: slot i += 1
+        DEC_LOCAL,              // i: slot i -= 1
+        LOAD_CAPTURE,           // i: -> capture i of the running function
+        STORE_CAPTURE,          // i: a ->
+        LOAD_GLOBAL,            // i: -> global i of the module
+        STORE_GLOBAL,           // i: a ->
+        LOAD_NAME,              // i: -> what name constant i means where the code runs
+        STORE_NAME,             // i: a ->
+        LOAD_MEMBER,            // i: object -> object.name
+        STORE_MEMBER,           // i: object a ->
+        LOAD_ARROW,             // i: object -> object->name
+        STORE_ARROW,            // i: object a ->
+        LOAD_INDEX,             // object index -> object[index]
+        STORE_INDEX,            // object index a ->
+
+        // operators
+        ADD,                    // a b -> a + b
+        SUB,
+        MUL,
+        DIV,
+        MOD,
+        BITAND,
+        BITOR,
+        BITXOR,
+        EQ,
+        NE,
+        LT,
+        LE,
+        GT,
+        GE,
+        NEG,                    // a -> -a
+        NOT,
+        BITNOT,
+        INC,                    // a -> a + 1
+        DEC,
+        PAIR,                   // key value -> key: value
+        NEW,                    // type -> instance
+        GCNEW,
+        TYPEID,
+
+        // values made of code or of other values
+        MAKE_ARRAY,             // i: i values -> array
+        MAKE_FUNCTION,          // i: -> function i of the module
+        MAKE_CLOSURE,           // i: -> same, taking its captures from the running function
+        MAKE_NAMESPACE,         // i: -> namespace made by running function i
+        MAKE_STRUCT,            // i: -> type whose instances run function i
+        MAKE_DERIVED_STRUCT,    // i: base -> same, extending base
+        CUSTOM_LITERAL,         // i: literal -> literal passed to the suffix named by constant i
+        SPREAD,                 // array -> its elements as arguments of the next CALL
+
+        // calls and control
+        CALL,                   // i: callee i arguments -> result
+        RETURN,                 // a ->
+        JUMP,                   // j
+        JUMP_IF_FALSE,          // j: a ->
+        JUMP_IF_TRUE,           // j: a ->
+        JUMP_IF_FALSE_KEEP,     // j: a -> a when jumping, a -> otherwise
+        JUMP_IF_TRUE_KEEP,      // j: same
+        ITER_BEGIN,             // range -> iterator
+        ITER_NEXT,              // i j: iterator -> iterator, the next element into slot i or jump when done
+        TRY_BEGIN,              // j: handler at j, the stack is cut back to here and the exception pushed
+        TRY_END,                // drop the innermost handler
+        THROW,                  // a ->
+        IMPORT,                 // i: -> module named by constant i
+        USING,                  // namespace ->
+    };
+
+    enum class operand_layout : std::uint8_t {
+        NONE,
+        INDEX,
+        SIGNED,
+        JUMP,
+        INDEX_JUMP,
+    };
+
+    struct opcode_info {
+        const char *_name;
+        operand_layout _operands;
+    };
+
+    // by opcode
+    constexpr opcode_info opcode_infos[] = {
+        {"NOP",                 operand_layout::NONE},
+        {"EXTENDED",            operand_layout::NONE},
+        {"POP",                 operand_layout::NONE},
+        {"DUP",                 operand_layout::NONE},
+        {"DUP2",                operand_layout::NONE},
+        {"PUSH_NULL",           operand_layout::NONE},
+        {"PUSH_TRUE",           operand_layout::NONE},
+        {"PUSH_FALSE",          operand_layout::NONE},
+        {"PUSH_INT",            operand_layout::SIGNED},
+        {"PUSH_CONST",          operand_layout::INDEX},
+        {"LOAD_LOCAL",          operand_layout::INDEX},
+        {"STORE_LOCAL",         operand_layout::INDEX},
+        {"INC_LOCAL",           operand_layout::INDEX},
+        {"DEC_LOCAL",           operand_layout::INDEX},
+        {"LOAD_CAPTURE",        operand_layout::INDEX},
+        {"STORE_CAPTURE",       operand_layout::INDEX},
+        {"LOAD_GLOBAL",         operand_layout::INDEX},
+        {"STORE_GLOBAL",        operand_layout::INDEX},
+        {"LOAD_NAME",           operand_layout::INDEX},
+        {"STORE_NAME",          operand_layout::INDEX},
+        {"LOAD_MEMBER",         operand_layout::INDEX},
+        {"STORE_MEMBER",        operand_layout::INDEX},
+        {"LOAD_ARROW",          operand_layout::INDEX},
+        {"STORE_ARROW",         operand_layout::INDEX},
+        {"LOAD_INDEX",          operand_layout::NONE},
+        {"STORE_INDEX",         operand_layout::NONE},
+        {"ADD",                 operand_layout::NONE},
+        {"SUB",                 operand_layout::NONE},
+        {"MUL",                 operand_layout::NONE},
+        {"DIV",                 operand_layout::NONE},
+        {"MOD",                 operand_layout::NONE},
+        {"BITAND",              operand_layout::NONE},
+        {"BITOR",               operand_layout::NONE},
+        {"BITXOR",              operand_layout::NONE},
+        {"EQ",                  operand_layout::NONE},
+        {"NE",                  operand_layout::NONE},
+        {"LT",                  operand_layout::NONE},
+        {"LE",                  operand_layout::NONE},
+        {"GT",                  operand_layout::NONE},
+        {"GE",                  operand_layout::NONE},
+        {"NEG",                 operand_layout::NONE},
+        {"NOT",                 operand_layout::NONE},
+        {"BITNOT",              operand_layout::NONE},
+        {"INC",                 operand_layout::NONE},
+        {"DEC",                 operand_layout::NONE},
+        {"PAIR",                operand_layout::NONE},
+        {"NEW",                 operand_layout::NONE},
+        {"GCNEW",               operand_layout::NONE},
+        {"TYPEID",              operand_layout::NONE},
+        {"MAKE_ARRAY",          operand_layout::INDEX},
+        {"MAKE_FUNCTION",       operand_layout::INDEX},
+        {"MAKE_CLOSURE",        operand_layout::INDEX},
+        {"MAKE_NAMESPACE",      operand_layout::INDEX},
+        {"MAKE_STRUCT",         operand_layout::INDEX},
+        {"MAKE_DERIVED_STRUCT", operand_layout::INDEX},
+        {"CUSTOM_LITERAL",      operand_layout::INDEX},
+        {"SPREAD",              operand_layout::NONE},
+        {"CALL",                operand_layout::INDEX},
+        {"RETURN",              operand_layout::NONE},
+        {"JUMP",                operand_layout::JUMP},
+        {"JUMP_IF_FALSE",       operand_layout::JUMP},
+        {"JUMP_IF_TRUE",        operand_layout::JUMP},
+        {"JUMP_IF_FALSE_KEEP",  operand_layout::JUMP},
+        {"JUMP_IF_TRUE_KEEP",   operand_layout::JUMP},
+        {"ITER_BEGIN",          operand_layout::NONE},
+        {"ITER_NEXT",           operand_layout::INDEX_JUMP},
+        {"TRY_BEGIN",           operand_layout::JUMP},
+        {"TRY_END",             operand_layout::NONE},
+        {"THROW",               operand_layout::NONE},
+        {"IMPORT",              operand_layout::INDEX},
+        {"USING",               operand_layout::NONE},
+    };
+
+    static_assert(sizeof(opcode_infos) / sizeof(opcode_info) == static_cast<std::size_t>(opcode::USING) + 1,
+                  "opcode_infos must list every opcode");
+
+    constexpr const opcode_info &info_of(opcode op) {
+        return opcode_infos[static_cast<std::size_t>(op)];
+    }
+
+    // one decoded instruction
+    struct instruction {
+        opcode _op;
+        // operand i, or s as its two's complement
+        std::uint32_t _operand;
+        // where j points
+        std::uint32_t _target;
+        // where the instruction starts, EXTENDED included, and its size
+        std::uint32_t _pc;
+        std::uint32_t _size;
+
+        std::int32_t signed_operand() const {
+            std::int32_t value;
+            std::memcpy(&value, &_operand, sizeof(value));
+            return value;
+        }
+    };
+
+    inline std::uint32_t read_u32(const std::uint8_t *p) {
+        return static_cast<std::uint32_t>(p[0]) | static_cast<std::uint32_t>(p[1]) << 8U
+               | static_cast<std::uint32_t>(p[2]) << 16U | static_cast<std::uint32_t>(p[3]) << 24U;
+    }
+
+    // decode the instruction at pc of code, which must be well formed
+    inline instruction decode(const std::uint8_t *code, std::uint32_t pc) {
+        instruction ins{};
+        ins._pc = pc;
+        const std::uint8_t *p = code + pc;
+        bool extended = static_cast<opcode>(*p) == opcode::EXTENDED;
+        if (extended) {
+            ++p;
+        }
+        ins._op = static_cast<opcode>(*p++);
+        operand_layout layout = info_of(ins._op)._operands;
+        if (layout == operand_layout::INDEX || layout == operand_layout::INDEX_JUMP) {
+            ins._operand = extended ? read_u32(p) : *p;
+            p += extended ? 4 : 1;
+        } else if (layout == operand_layout::SIGNED) {
+            ins._operand = extended ? read_u32(p) : static_cast<std::uint32_t>(static_cast<std::int8_t>(*p));
+            p += extended ? 4 : 1;
+        }
+        if (layout == operand_layout::JUMP || layout == operand_layout::INDEX_JUMP) {
+            std::uint32_t offset = read_u32(p);
+            p += 4;
+            ins._target = static_cast<std::uint32_t>(p - code) + offset;
+        }
+        ins._size = static_cast<std::uint32_t>(p - code) - pc;
+        return ins;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // compiled modules
+    ////////////////////////////////////////////////////////////////////////////////
+
+    constexpr std::uint32_t no_constant = std::numeric_limits<std::uint32_t>::max();
+
+    enum class constant_kind : std::uint8_t {
+        INT,
+        FLOAT,
+        STRING,
+        CHAR,
+        // a name looked up at run time, e.g. of a member
+        NAME,
+    };
+
+    // _index is into the module's _ints, _floats or _strings (for STRING
+    // and NAME), for CHAR it is the char itself
+    struct bytecode_constant {
+        constant_kind _kind;
+        std::uint32_t _index;
+    };
+
+    // where the instructions from _pc on came from
+    struct line_entry {
+        std::uint32_t _pc;
+        std::uint32_t _line;
+        std::uint32_t _column;
+    };
+
+    enum class function_kind : std::uint8_t {
+        MODULE,
+        FUNCTION,
+        LAMBDA,
+        NAMESPACE,
+        STRUCT,
+        CLASS,
+    };
+
+    // A variable of an enclosing function that a function uses. It is
+    // the variable itself, not a copy, and outlives its block when a
+    // function has it.
+    struct bytecode_capture {
+        // NAME constant
+        std::uint32_t _name;
+        // a slot of the function making this one, or else one of its captures
+        bool _local;
+        std::uint32_t _index;
+    };
+
+    struct bytecode_function {
+        function_kind _kind = function_kind::FUNCTION;
+        // a NAME constant, no_constant for the module and lambdas
+        std::uint32_t _name = no_constant;
+        // parameters are the first slots, the last one takes the rest
+        // of the arguments when _vararg
+        std::uint32_t _params = 0;
+        bool _vararg = false;
+        std::uint32_t _slots = 0;
+        std::vector<std::uint8_t> _code;
+        // sorted by _pc, an entry only where the location changes
+        std::vector<line_entry> _lines;
+        // for namespaces and structs, NAME constant and slot of each member
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> _members;
+        // taken by MAKE_CLOSURE, and by the MAKE_ instruction of a
+        // namespace or struct, from the function running it
+        std::vector<bytecode_capture> _captures;
+
+        // location of the instruction at pc, {0, 0} when unknown
+        line_entry location(std::uint32_t pc) const {
+            auto it = std::upper_bound(_lines.begin(), _lines.end(), pc, [](std::uint32_t at, const line_entry &e) {
+                return at < e._pc;
+            });
+            if (it == _lines.begin()) {
+                return line_entry{pc, 0, 0};
+            }
+            return *(it - 1);
+        }
+    };
+
+    // What bytecode_compiler makes of one module. Names declared by the
+    // module's top level statements are global slots, names declared in
+    // functions and blocks are slots of their function and captures of
+    // the nested functions using them, and only names that nothing
+    // declares are looked up by name when the code runs.
+    struct bytecode_module {
+        // function 0 runs the module
+        std::vector<bytecode_function> _functions;
+        std::vector<bytecode_constant> _constants;
+        std::vector<std::int64_t> _ints;
+        std::vector<double> _floats;
+        // local-encoded
+        std::vector<std::string> _strings;
+        // NAME constant of each global slot
+        std::vector<std::uint32_t> _globals;
+        // NAME constant of the package statement
+        std::uint32_t _package = no_constant;
+
+        void clear() {
+            _functions.clear();
+            _constants.clear();
+            _ints.clear();
+            _floats.clear();
+            _strings.clear();
+            _globals.clear();
+            _package = no_constant;
+        }
+
+        // bytes of instructions in all functions
+        std::size_t code_size() const {
+            std::size_t size = 0;
+            for (const auto &f : _functions) {
+                size += f._code.size();
+            }
+            return size;
+        }
+
+        std::string constant_text(std::uint32_t index) const {
+            const bytecode_constant &c = _constants[index];
+            char buffer[32];
+            switch (c._kind) {
+                case constant_kind::INT:
+                    std::snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(_ints[c._index]));
+                    return buffer;
+                case constant_kind::FLOAT:
+                    std::snprintf(buffer, sizeof(buffer), "%.17g", _floats[c._index]);
+                    return buffer;
+                case constant_kind::STRING:
+                    return "\"" + _strings[c._index] + "\"";
+                case constant_kind::CHAR:
+                    std::snprintf(buffer, sizeof(buffer), "char U+%04X", static_cast<unsigned>(c._index));
+                    return buffer;
+                case constant_kind::NAME:
+                    return _strings[c._index];
+            }
+            return std::string{};
+        }
+
+        // one instruction per line, with its location and what constants
+        // and functions its operand refers to
+        std::string disassemble() const {
+            std::string out;
+            char buffer[64];
+            for (std::size_t f = 0; f < _functions.size(); ++f) {
+                const bytecode_function &fn = _functions[f];
+                std::snprintf(buffer, sizeof(buffer), "function %zu ", f);
+                out += buffer;
+                out += fn._name == no_constant ? "<anonymous>" : constant_text(fn._name);
+                std::snprintf(buffer, sizeof(buffer), " params=%u%s slots=%u\n", fn._params,
+                              fn._vararg ? "..." : "", fn._slots);
+                out += buffer;
+                for (std::size_t c = 0; c < fn._captures.size(); ++c) {
+                    const bytecode_capture &capture = fn._captures[c];
+                    std::snprintf(buffer, sizeof(buffer), "  capture %zu %s %u ", c,
+                                  capture._local ? "slot" : "capture", capture._index);
+                    out += buffer + constant_text(capture._name) + "\n";
+                }
+                for (std::uint32_t pc = 0; pc < fn._code.size();) {
+                    instruction ins = decode(fn._code.data(), pc);
+                    line_entry at = fn.location(pc);
+                    std::snprintf(buffer, sizeof(buffer), "  %5u %4u:%-3u %s", pc, at._line, at._column,
+                                  info_of(ins._op)._name);
+                    out += buffer;
+                    switch (info_of(ins._op)._operands) {
+                        case operand_layout::NONE:
+                            break;
+                        case operand_layout::SIGNED:
+                            out += " " + std::to_string(ins.signed_operand());
+                            break;
+                        case operand_layout::INDEX:
+                            out += " " + std::to_string(ins._operand);
+                            break;
+                        case operand_layout::JUMP:
+                            out += " -> " + std::to_string(ins._target);
+                            break;
+                        case operand_layout::INDEX_JUMP:
+                            out += " " + std::to_string(ins._operand) + " -> " + std::to_string(ins._target);
+                            break;
+                    }
+                    switch (ins._op) {
+                        case opcode::PUSH_CONST:
+                        case opcode::LOAD_NAME:
+                        case opcode::STORE_NAME:
+                        case opcode::LOAD_MEMBER:
+                        case opcode::STORE_MEMBER:
+                        case opcode::LOAD_ARROW:
+                        case opcode::STORE_ARROW:
+                        case opcode::CUSTOM_LITERAL:
+                        case opcode::IMPORT:
+                            out += "    ; " + constant_text(ins._operand);
+                            break;
+                        case opcode::LOAD_GLOBAL:
+                        case opcode::STORE_GLOBAL:
+                            out += "    ; " + constant_text(_globals[ins._operand]);
+                            break;
+                        case opcode::LOAD_CAPTURE:
+                        case opcode::STORE_CAPTURE:
+                            out += "    ; " + constant_text(fn._captures[ins._operand]._name);
+                            break;
+                        default:
+                            break;
+                    }
+                    out += "\n";
+                    pc += ins._size;
+                }
+            }
+            return out;
+        }
+    };
+}
+
+namespace cs {
+    using cs_impl::bytecode_function;
+    using cs_impl::bytecode_module;
+    using cs_impl::opcode;
+}
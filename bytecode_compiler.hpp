@@ -0,0 +1,1329 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "symbol_table.hpp"
+#include "token_stream.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // bytecode compiler
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct compiler_error : public std::runtime_error {
+        std::size_t _line;
+        std::size_t _start_column;
+        std::size_t _end_column;
+        std::string _error_text;
+
+        explicit compiler_error(std::size_t line, std::size_t start_column, std::size_t end_column,
+                                std::string error_text, const std::string &message)
+            : std::runtime_error(message), _line(line),
+              _start_column(start_column), _end_column(end_column),
+              _error_text(std::move(error_text)) {
+        }
+
+        ~compiler_error() override = default;
+    };
+
+    // Compiles a parsed module into a bytecode_module. Names are resolved
+    // here: a variable of a function or block is a slot of its function,
+    // slots of a block are reused after it, and a name declared by the
+    // module's top level is a global slot, also inside functions declared
+    // before it. A name declared by an enclosing function is a capture of
+    // each function between them, and names nothing declares (e.g. of the
+    // runtime) are left to LOAD_NAME. The first error is thrown as a
+    // compiler_error.
+    struct bytecode_compiler {
+    private:
+        struct variable {
+            symbol_t _name;
+            std::uint32_t _slot;
+            bool _const;
+        };
+
+        struct scope {
+            std::size_t _variables;
+            std::uint32_t _next_slot;
+        };
+
+        struct loop {
+            std::vector<std::uint32_t> _breaks;
+            std::vector<std::uint32_t> _continues;
+            // handlers open outside the loop
+            std::size_t _tries;
+        };
+
+        // a function being compiled
+        struct function_state {
+            std::uint32_t _function;
+            function_kind _kind;
+            std::vector<variable> _variables;
+            // variables of enclosing functions, _slot is the capture
+            std::vector<variable> _captures;
+            std::vector<scope> _scopes;
+            std::uint32_t _next_slot = 0;
+            std::vector<loop> _loops;
+            std::size_t _tries = 0;
+            // the token the last line entry is for
+            std::uint32_t _located = std::numeric_limits<std::uint32_t>::max();
+        };
+
+        struct global {
+            std::uint32_t _slot;
+            bool _const;
+        };
+
+        enum class target_kind : std::uint8_t {
+            LOCAL,
+            CAPTURE,
+            GLOBAL,
+            NAME,
+            MEMBER,
+            ARROW,
+            INDEX,
+        };
+
+        // something assigned to, its object and index are on the stack
+        struct target {
+            target_kind _kind;
+            std::uint32_t _operand;
+            bool _const;
+        };
+
+        const token_stream *_tokens = nullptr;
+        const symbol_table *_symbols = nullptr;
+        const ast *_tree = nullptr;
+        bytecode_module *_module = nullptr;
+        std::vector<function_state> _states;
+        std::unordered_map<symbol_t, global> _globals;
+        // the code comes from this token
+        std::uint32_t _token = 0;
+        std::size_t _depth = 0;
+
+        // The parser builds chains like a + b + c or a.b.c in a loop, so
+        // their depth is not bounded by its max_depth. Deeper expressions
+        // are refused instead of running out of stack.
+        static constexpr std::size_t max_depth = 4096;
+
+        struct depth_guard {
+            bytecode_compiler &_compiler;
+
+            depth_guard(bytecode_compiler &c, std::uint32_t token) : _compiler(c) {
+                if (++_compiler._depth > max_depth) {
+                    _compiler.fail(token, "too deeply nested expression");
+                }
+            }
+
+            ~depth_guard() {
+                --_compiler._depth;
+            }
+        };
+
+        // constants are made once each
+        std::unordered_map<std::int64_t, std::uint32_t> _int_constants;
+        std::unordered_map<std::uint64_t, std::uint32_t> _float_constants;
+        std::unordered_map<char32_t, std::uint32_t> _char_constants;
+        // by string pool index, equal literals have the same one
+        std::vector<std::uint32_t> _string_constants;
+        std::unordered_map<std::string, std::uint32_t> _name_constants;
+        std::unordered_map<symbol_t, std::uint32_t> _symbol_constants;
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // errors
+        ////////////////////////////////////////////////////////////////////////////////
+
+        [[noreturn]] void fail(std::uint32_t token, const std::string &message) const {
+            const source_buffer *source = _tokens->source().get();
+            if (source == nullptr || token >= _tokens->size()) {
+                throw compiler_error(0, 0, 0, std::string{}, message);
+            }
+            const token_record &r = (*_tokens)[token];
+            auto at = source->location(r._offset);
+            throw compiler_error(at._line, at._column, at._column + source->count_chars(r._offset, r._length),
+                                 source->local(r._offset, r._length), message);
+        }
+
+        std::string name_of(std::uint32_t token) const {
+            return _symbols->name(_tokens->symbol((*_tokens)[token]));
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // constants
+        ////////////////////////////////////////////////////////////////////////////////
+
+        std::uint32_t add_constant(constant_kind kind, std::size_t index) {
+            if (_module->_constants.size() >= no_constant) {
+                throw std::length_error("too many constants");
+            }
+            _module->_constants.push_back(bytecode_constant{kind, static_cast<std::uint32_t>(index)});
+            return static_cast<std::uint32_t>(_module->_constants.size() - 1);
+        }
+
+        std::uint32_t int_constant(std::int64_t value) {
+            auto it = _int_constants.find(value);
+            if (it != _int_constants.end()) {
+                return it->second;
+            }
+            _module->_ints.push_back(value);
+            std::uint32_t index = add_constant(constant_kind::INT, _module->_ints.size() - 1);
+            _int_constants.emplace(value, index);
+            return index;
+        }
+
+        // by bits, so 0.0 and -0.0 stay apart
+        std::uint32_t float_constant(double value) {
+            std::uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            auto it = _float_constants.find(bits);
+            if (it != _float_constants.end()) {
+                return it->second;
+            }
+            _module->_floats.push_back(value);
+            std::uint32_t index = add_constant(constant_kind::FLOAT, _module->_floats.size() - 1);
+            _float_constants.emplace(bits, index);
+            return index;
+        }
+
+        std::uint32_t char_constant(char32_t value) {
+            auto it = _char_constants.find(value);
+            if (it != _char_constants.end()) {
+                return it->second;
+            }
+            std::uint32_t index = add_constant(constant_kind::CHAR, value);
+            _char_constants.emplace(value, index);
+            return index;
+        }
+
+        std::uint32_t string_constant(const token_record &r) {
+            std::uint32_t &index = _string_constants[_tokens->string_constant(r)];
+            if (index == no_constant) {
+                _module->_strings.push_back(_tokens->string_value(r));
+                index = add_constant(constant_kind::STRING, _module->_strings.size() - 1);
+            }
+            return index;
+        }
+
+        std::uint32_t name_constant(const std::string &name) {
+            auto it = _name_constants.find(name);
+            if (it != _name_constants.end()) {
+                return it->second;
+            }
+            _module->_strings.push_back(name);
+            std::uint32_t index = add_constant(constant_kind::NAME, _module->_strings.size() - 1);
+            _name_constants.emplace(name, index);
+            return index;
+        }
+
+        std::uint32_t symbol_constant(symbol_t symbol) {
+            auto it = _symbol_constants.find(symbol);
+            if (it != _symbol_constants.end()) {
+                return it->second;
+            }
+            std::uint32_t index = name_constant(_symbols->name(symbol));
+            _symbol_constants.emplace(symbol, index);
+            return index;
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // emitting
+        ////////////////////////////////////////////////////////////////////////////////
+
+        function_state &state() {
+            return _states.back();
+        }
+
+        bytecode_function &function() {
+            return _module->_functions[state()._function];
+        }
+
+        std::vector<std::uint8_t> &code() {
+            return function()._code;
+        }
+
+        std::uint32_t here() {
+            if (code().size() > static_cast<std::size_t>(std::numeric_limits<std::int32_t>::max())) {
+                throw std::length_error("function too large");
+            }
+            return static_cast<std::uint32_t>(code().size());
+        }
+
+        // a line entry for what is emitted next, when _token is somewhere else
+        void locate() {
+            function_state &s = state();
+            if (s._located == _token || _token >= _tokens->size()) {
+                return;
+            }
+            s._located = _token;
+            source_location at = _tokens->location((*_tokens)[_token]);
+            std::vector<line_entry> &lines = function()._lines;
+            std::uint32_t pc = here();
+            if (!lines.empty() && lines.back()._line == at._line && lines.back()._column == at._column) {
+                return;
+            }
+            if (!lines.empty() && lines.back()._pc == pc) {
+                // nothing was emitted for the last one
+                lines.pop_back();
+                if (!lines.empty() && lines.back()._line == at._line && lines.back()._column == at._column) {
+                    return;
+                }
+            }
+            lines.push_back(line_entry{pc, at._line, at._column});
+        }
+
+        void put_u32(std::uint32_t value) {
+            std::vector<std::uint8_t> &c = code();
+            for (unsigned shift = 0; shift < 32; shift += 8) {
+                c.push_back(static_cast<std::uint8_t>(value >> shift));
+            }
+        }
+
+        void emit(opcode op) {
+            locate();
+            code().push_back(static_cast<std::uint8_t>(op));
+        }
+
+        void emit(opcode op, std::uint32_t operand) {
+            locate();
+            if (operand > 0xFFU) {
+                code().push_back(static_cast<std::uint8_t>(opcode::EXTENDED));
+                code().push_back(static_cast<std::uint8_t>(op));
+                put_u32(operand);
+            } else {
+                code().push_back(static_cast<std::uint8_t>(op));
+                code().push_back(static_cast<std::uint8_t>(operand));
+            }
+        }
+
+        void emit_int(std::int64_t value) {
+            if (value >= -128 && value <= 127) {
+                locate();
+                code().push_back(static_cast<std::uint8_t>(opcode::PUSH_INT));
+                code().push_back(static_cast<std::uint8_t>(static_cast<std::int8_t>(value)));
+            } else if (value >= std::numeric_limits<std::int32_t>::min()
+                       && value <= std::numeric_limits<std::int32_t>::max()) {
+                locate();
+                code().push_back(static_cast<std::uint8_t>(opcode::EXTENDED));
+                code().push_back(static_cast<std::uint8_t>(opcode::PUSH_INT));
+                put_u32(static_cast<std::uint32_t>(static_cast<std::int32_t>(value)));
+            } else {
+                emit(opcode::PUSH_CONST, int_constant(value));
+            }
+        }
+
+        // a jump to be patched, returns where its offset is
+        std::uint32_t emit_jump(opcode op) {
+            emit(op);
+            std::uint32_t at = here();
+            put_u32(0);
+            return at;
+        }
+
+        void patch(std::uint32_t at, std::uint32_t target) {
+            std::uint32_t offset = target - (at + 4);
+            for (unsigned i = 0; i < 4; ++i) {
+                code()[at + i] = static_cast<std::uint8_t>(offset >> (8U * i));
+            }
+        }
+
+        // jump from at to here
+        void patch(std::uint32_t at) {
+            patch(at, here());
+        }
+
+        void emit_jump(opcode op, std::uint32_t target) {
+            patch(emit_jump(op), target);
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // names
+        ////////////////////////////////////////////////////////////////////////////////
+
+        void open_scope() {
+            function_state &s = state();
+            s._scopes.push_back(scope{s._variables.size(), s._next_slot});
+        }
+
+        void close_scope() {
+            function_state &s = state();
+            s._variables.resize(s._scopes.back()._variables);
+            s._next_slot = s._scopes.back()._next_slot;
+            s._scopes.pop_back();
+        }
+
+        std::uint32_t new_slot() {
+            function_state &s = state();
+            if (s._next_slot == std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("too many variables");
+            }
+            std::uint32_t slot = s._next_slot++;
+            function()._slots = std::max(function()._slots, s._next_slot);
+            return slot;
+        }
+
+        bool module_scope() {
+            return state()._kind == function_kind::MODULE && state()._scopes.size() == 1;
+        }
+
+        // the variable a declaration at token makes, not visible before
+        // the code that stores its first value
+        target declare(std::uint32_t token, bool constant) {
+            symbol_t name = _tokens->symbol((*_tokens)[token]);
+            if (module_scope()) {
+                // see declare_globals()
+                const global &g = _globals.at(name);
+                return target{target_kind::GLOBAL, g._slot, g._const};
+            }
+            function_state &s = state();
+            for (std::size_t i = s._scopes.back()._variables; i < s._variables.size(); ++i) {
+                if (s._variables[i]._name == name) {
+                    fail(token, "redefinition of '" + name_of(token) + "'");
+                }
+            }
+            std::uint32_t slot = new_slot();
+            state()._variables.push_back(variable{name, slot, constant});
+            return target{target_kind::LOCAL, slot, constant};
+        }
+
+        void declare_global(std::uint32_t token, bool constant) {
+            symbol_t name = _tokens->symbol((*_tokens)[token]);
+            if (_globals.count(name) != 0) {
+                fail(token, "redefinition of '" + name_of(token) + "'");
+            }
+            auto slot = static_cast<std::uint32_t>(_module->_globals.size());
+            _module->_globals.push_back(symbol_constant(name));
+            _globals.emplace(name, global{slot, constant});
+        }
+
+        // every name the top level declares is a global from the start,
+        // so functions can use the ones declared after them
+        void declare_globals(ast_index first) {
+            for (ast_index i = first; i != no_node; i = (*_tree)[i]._next) {
+                const ast_node &node = (*_tree)[i];
+                switch (node._kind) {
+                    case ast_kind::VAR:
+                        declare_global(node._token, (node._flags & AST_CONST) != 0);
+                        break;
+                    case ast_kind::FUNCTION:
+                    case ast_kind::NAMESPACE:
+                    case ast_kind::STRUCT:
+                        declare_global(node._token, false);
+                        break;
+                    case ast_kind::IMPORT:
+                        for (ast_index path = node._a; path != no_node; path = (*_tree)[path]._next) {
+                            declare_global(last_name(path), false);
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        target resolve(symbol_t name) {
+            target t{};
+            if (find_variable(_states.size() - 1, name, t)) {
+                return t;
+            }
+            return resolve_global(name);
+        }
+
+        // name as a variable of the function at level, capturing it
+        // through each function below level that declares it
+        bool find_variable(std::size_t level, symbol_t name, target &out) {
+            function_state &s = _states[level];
+            for (std::size_t i = s._variables.size(); i-- > 0;) {
+                if (s._variables[i]._name == name) {
+                    out = target{target_kind::LOCAL, s._variables[i]._slot, s._variables[i]._const};
+                    return true;
+                }
+            }
+            for (const auto &c : s._captures) {
+                if (c._name == name) {
+                    out = target{target_kind::CAPTURE, c._slot, c._const};
+                    return true;
+                }
+            }
+            if (level == 0 || !find_variable(level - 1, name, out)) {
+                return false;
+            }
+            bytecode_function &f = _module->_functions[s._function];
+            if (f._captures.size() >= std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("too many captures");
+            }
+            auto index = static_cast<std::uint32_t>(f._captures.size());
+            f._captures.push_back(bytecode_capture{symbol_constant(name), out._kind == target_kind::LOCAL,
+                                                   out._operand});
+            s._captures.push_back(variable{name, index, out._const});
+            out = target{target_kind::CAPTURE, index, out._const};
+            return true;
+        }
+
+        target resolve_global(symbol_t name) {
+            auto it = _globals.find(name);
+            if (it != _globals.end()) {
+                return target{target_kind::GLOBAL, it->second._slot, it->second._const};
+            }
+            return target{target_kind::NAME, symbol_constant(name), false};
+        }
+
+        // `local.x` and `global.x` name a variable of one kind of scope
+        bool scoped_name(const ast_node &member, target &out) {
+            const ast_node &object = (*_tree)[member._a];
+            if (member._op != operator_type::OPERATOR_DOT || object._kind != ast_kind::NAME) {
+                return false;
+            }
+            keyword_type kw = _tokens->keyword((*_tokens)[object._token]);
+            if (kw != keyword_type::KEYWORD_LOCAL && kw != keyword_type::KEYWORD_GLOBAL) {
+                return false;
+            }
+            std::uint32_t token = (*_tree)[member._b]._token;
+            symbol_t name = _tokens->symbol((*_tokens)[token]);
+            if (kw == keyword_type::KEYWORD_GLOBAL) {
+                out = resolve_global(name);
+                return true;
+            }
+            out = resolve(name);
+            bool module_global = out._kind == target_kind::GLOBAL && state()._kind == function_kind::MODULE;
+            if (out._kind != target_kind::LOCAL && !module_global) {
+                fail(token, "'" + name_of(token) + "' is not a local variable");
+            }
+            return true;
+        }
+
+        // token of the last name of a.b.c
+        std::uint32_t last_name(ast_index path) const {
+            const ast_node &node = (*_tree)[path];
+            return node._kind == ast_kind::MEMBER ? (*_tree)[node._b]._token : node._token;
+        }
+
+        std::string path_text(ast_index path) const {
+            // the names from last to first, a path can be arbitrarily long
+            std::vector<std::uint32_t> names;
+            for (; (*_tree)[path]._kind == ast_kind::MEMBER; path = (*_tree)[path]._a) {
+                names.push_back((*_tree)[(*_tree)[path]._b]._token);
+            }
+            std::string text = name_of((*_tree)[path]._token);
+            for (auto it = names.rbegin(); it != names.rend(); ++it) {
+                text += ".";
+                text += name_of(*it);
+            }
+            return text;
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // assignment
+        ////////////////////////////////////////////////////////////////////////////////
+
+        // push what the target needs on the stack
+        target assignable(ast_index index) {
+            const ast_node &node = (*_tree)[index];
+            _token = node._token;
+            target t{};
+            switch (node._kind) {
+                case ast_kind::NAME:
+                    if (_tokens->keyword((*_tokens)[node._token]) != keyword_type::UNDEFINED) {
+                        fail(node._token, "cannot assign to '" + _tokens->text((*_tokens)[node._token]) + "'");
+                    }
+                    t = resolve(_tokens->symbol((*_tokens)[node._token]));
+                    break;
+                case ast_kind::MEMBER:
+                    if (!scoped_name(node, t)) {
+                        expression(node._a);
+                        t = target{node._op == operator_type::OPERATOR_ARROW ? target_kind::ARROW : target_kind::MEMBER,
+                                   symbol_constant(_tokens->symbol((*_tokens)[(*_tree)[node._b]._token])), false};
+                    }
+                    break;
+                case ast_kind::INDEX:
+                    expression(node._a);
+                    expression(node._b);
+                    t = target{target_kind::INDEX, 0, false};
+                    break;
+                default:
+                    fail(node._token, "cannot assign to this expression");
+            }
+            if (t._const) {
+                fail(node._token, "cannot assign to a constant");
+            }
+            _token = node._token;
+            return t;
+        }
+
+        // the target's value, keeping what the store needs
+        void load(const target &t) {
+            switch (t._kind) {
+                case target_kind::LOCAL:
+                    emit(opcode::LOAD_LOCAL, t._operand);
+                    break;
+                case target_kind::CAPTURE:
+                    emit(opcode::LOAD_CAPTURE, t._operand);
+                    break;
+                case target_kind::GLOBAL:
+                    emit(opcode::LOAD_GLOBAL, t._operand);
+                    break;
+                case target_kind::NAME:
+                    emit(opcode::LOAD_NAME, t._operand);
+                    break;
+                case target_kind::MEMBER:
+                    emit(opcode::DUP);
+                    emit(opcode::LOAD_MEMBER, t._operand);
+                    break;
+                case target_kind::ARROW:
+                    emit(opcode::DUP);
+                    emit(opcode::LOAD_ARROW, t._operand);
+                    break;
+                case target_kind::INDEX:
+                    emit(opcode::DUP2);
+                    emit(opcode::LOAD_INDEX);
+                    break;
+            }
+        }
+
+        void store(const target &t) {
+            switch (t._kind) {
+                case target_kind::LOCAL:
+                    emit(opcode::STORE_LOCAL, t._operand);
+                    break;
+                case target_kind::CAPTURE:
+                    emit(opcode::STORE_CAPTURE, t._operand);
+                    break;
+                case target_kind::GLOBAL:
+                    emit(opcode::STORE_GLOBAL, t._operand);
+                    break;
+                case target_kind::NAME:
+                    emit(opcode::STORE_NAME, t._operand);
+                    break;
+                case target_kind::MEMBER:
+                    emit(opcode::STORE_MEMBER, t._operand);
+                    break;
+                case target_kind::ARROW:
+                    emit(opcode::STORE_ARROW, t._operand);
+                    break;
+                case target_kind::INDEX:
+                    emit(opcode::STORE_INDEX);
+                    break;
+            }
+        }
+
+        // store the value on top, leaving it there when value is wanted
+        void store(const target &t, bool value) {
+            if (!value) {
+                store(t);
+            } else if (t._kind == target_kind::LOCAL || t._kind == target_kind::CAPTURE
+                       || t._kind == target_kind::GLOBAL || t._kind == target_kind::NAME) {
+                emit(opcode::DUP);
+                store(t);
+            } else {
+                // the object is under the value, so it goes around a slot
+                open_scope();
+                std::uint32_t slot = new_slot();
+                emit(opcode::DUP);
+                emit(opcode::STORE_LOCAL, slot);
+                store(t);
+                emit(opcode::LOAD_LOCAL, slot);
+                close_scope();
+            }
+        }
+
+        static opcode binary_opcode(operator_type op) {
+            switch (op) {
+                case operator_type::OPERATOR_ADD:
+                case operator_type::OPERATOR_ADD_ASSIGN:
+                    return opcode::ADD;
+                case operator_type::OPERATOR_SUB:
+                case operator_type::OPERATOR_SUB_ASSIGN:
+                    return opcode::SUB;
+                case operator_type::OPERATOR_MUL:
+                case operator_type::OPERATOR_MUL_ASSIGN:
+                    return opcode::MUL;
+                case operator_type::OPERATOR_DIV:
+                case operator_type::OPERATOR_DIV_ASSIGN:
+                    return opcode::DIV;
+                case operator_type::OPERATOR_MOD:
+                case operator_type::OPERATOR_MOD_ASSIGN:
+                    return opcode::MOD;
+                case operator_type::OPERATOR_BITAND:
+                case operator_type::OPERATOR_AND_ASSIGN:
+                    return opcode::BITAND;
+                case operator_type::OPERATOR_BITOR:
+                case operator_type::OPERATOR_OR_ASSIGN:
+                    return opcode::BITOR;
+                case operator_type::OPERATOR_BITXOR:
+                case operator_type::OPERATOR_XOR_ASSIGN:
+                    return opcode::BITXOR;
+                case operator_type::OPERATOR_EQ:
+                    return opcode::EQ;
+                case operator_type::OPERATOR_NE:
+                    return opcode::NE;
+                case operator_type::OPERATOR_LT:
+                    return opcode::LT;
+                case operator_type::OPERATOR_LE:
+                    return opcode::LE;
+                case operator_type::OPERATOR_GT:
+                    return opcode::GT;
+                case operator_type::OPERATOR_GE:
+                    return opcode::GE;
+                case operator_type::OPERATOR_COLON:
+                    return opcode::PAIR;
+                default:
+                    return opcode::NOP;
+            }
+        }
+
+        void assign(const ast_node &node, bool value) {
+            target t = assignable(node._a);
+            if (node._op == operator_type::OPERATOR_ASSIGN) {
+                expression(node._b);
+            } else {
+                load(t);
+                expression(node._b);
+                _token = node._token;
+                emit(binary_opcode(node._op));
+            }
+            _token = node._token;
+            store(t, value);
+        }
+
+        // ++ and --
+        void step(const ast_node &node, bool postfix, bool value) {
+            bool inc = node._op == operator_type::OPERATOR_INC;
+            target t = assignable(node._a);
+            if (!value && t._kind == target_kind::LOCAL) {
+                emit(inc ? opcode::INC_LOCAL : opcode::DEC_LOCAL, t._operand);
+                return;
+            }
+            load(t);
+            emit(inc ? opcode::INC : opcode::DEC);
+            store(t, value);
+            if (value && postfix) {
+                emit(inc ? opcode::DEC : opcode::INC);
+            }
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // expressions
+        ////////////////////////////////////////////////////////////////////////////////
+
+        void literal(const token_record &r) {
+            switch (r._type) {
+                case token_type::INT_LITERAL:
+                    emit_int(_tokens->int_value(r));
+                    break;
+                case token_type::FLOATING_LITERAL:
+                    emit(opcode::PUSH_CONST, float_constant(_tokens->float_value(r)));
+                    break;
+                case token_type::STRING_LITERAL:
+                    emit(opcode::PUSH_CONST, string_constant(r));
+                    break;
+                case token_type::CHAR_LITERAL:
+                    emit(opcode::PUSH_CONST, char_constant(_tokens->char_value(r)));
+                    break;
+                case token_type::CUSTOM_LITERAL:
+                    literal(_tokens->custom_literal(r));
+                    emit(opcode::CUSTOM_LITERAL, name_constant(_tokens->suffix(r)));
+                    break;
+                default:
+                    fail(_token, "not a literal");
+            }
+        }
+
+        // -1 and -1.5 are constants
+        bool negative_literal(const ast_node &operand) {
+            if (operand._kind != ast_kind::LITERAL) {
+                return false;
+            }
+            const token_record &r = (*_tokens)[operand._token];
+            if (r._type == token_type::INT_LITERAL && _tokens->int_value(r) != std::numeric_limits<std::int64_t>::min()) {
+                emit_int(-_tokens->int_value(r));
+                return true;
+            }
+            if (r._type == token_type::FLOATING_LITERAL) {
+                emit(opcode::PUSH_CONST, float_constant(-_tokens->float_value(r)));
+                return true;
+            }
+            return false;
+        }
+
+        void unary(const ast_node &node) {
+            switch (node._op) {
+                case operator_type::OPERATOR_ADD:
+                    expression(node._a);
+                    return;
+                case operator_type::OPERATOR_SUB:
+                    if (!negative_literal((*_tree)[node._a])) {
+                        expression(node._a);
+                        _token = node._token;
+                        emit(opcode::NEG);
+                    }
+                    return;
+                case operator_type::OPERATOR_NOT:
+                    expression(node._a);
+                    _token = node._token;
+                    emit(opcode::NOT);
+                    return;
+                case operator_type::OPERATOR_BITNOT:
+                    expression(node._a);
+                    _token = node._token;
+                    emit(opcode::BITNOT);
+                    return;
+                case operator_type::OPERATOR_VARARG:
+                    expression(node._a);
+                    _token = node._token;
+                    emit(opcode::SPREAD);
+                    return;
+                default:
+                    break;
+            }
+            // new, gcnew and typeid
+            expression(node._a);
+            _token = node._token;
+            switch (_tokens->keyword((*_tokens)[node._token])) {
+                case keyword_type::KEYWORD_NEW:
+                    emit(opcode::NEW);
+                    break;
+                case keyword_type::KEYWORD_GCNEW:
+                    emit(opcode::GCNEW);
+                    break;
+                default:
+                    emit(opcode::TYPEID);
+                    break;
+            }
+        }
+
+        void binary(const ast_node &node) {
+            if (node._op == operator_type::OPERATOR_AND || node._op == operator_type::OPERATOR_OR) {
+                expression(node._a);
+                _token = node._token;
+                std::uint32_t skip = emit_jump(node._op == operator_type::OPERATOR_AND
+                                               ? opcode::JUMP_IF_FALSE_KEEP : opcode::JUMP_IF_TRUE_KEEP);
+                expression(node._b);
+                patch(skip);
+                return;
+            }
+            opcode op = binary_opcode(node._op);
+            if (op == opcode::NOP) {
+                fail(node._token, "unsupported operator");
+            }
+            expression(node._a);
+            expression(node._b);
+            _token = node._token;
+            emit(op);
+        }
+
+        std::uint32_t list(ast_index first) {
+            std::uint32_t count = 0;
+            for (ast_index i = first; i != no_node; i = (*_tree)[i]._next) {
+                expression(i);
+                ++count;
+            }
+            return count;
+        }
+
+        void expression(ast_index index, bool value = true) {
+            const ast_node &node = (*_tree)[index];
+            depth_guard depth(*this, node._token);
+            _token = node._token;
+            switch (node._kind) {
+                case ast_kind::ASSIGN:
+                    assign(node, value);
+                    return;
+                case ast_kind::UNARY:
+                    if (node._op == operator_type::OPERATOR_INC || node._op == operator_type::OPERATOR_DEC) {
+                        step(node, false, value);
+                        return;
+                    }
+                    unary(node);
+                    break;
+                case ast_kind::POSTFIX:
+                    step(node, true, value);
+                    return;
+                case ast_kind::NAME: {
+                    const token_record &r = (*_tokens)[node._token];
+                    if (_tokens->keyword(r) != keyword_type::UNDEFINED) {
+                        fail(node._token, "expected '.' after '" + _tokens->text(r) + "'");
+                    }
+                    target t = resolve(_tokens->symbol(r));
+                    load(t);
+                    break;
+                }
+                case ast_kind::LITERAL:
+                    literal((*_tokens)[node._token]);
+                    break;
+                case ast_kind::CONSTANT:
+                    switch (_tokens->keyword((*_tokens)[node._token])) {
+                        case keyword_type::KEYWORD_TRUE:
+                            emit(opcode::PUSH_TRUE);
+                            break;
+                        case keyword_type::KEYWORD_FALSE:
+                            emit(opcode::PUSH_FALSE);
+                            break;
+                        default:
+                            emit(opcode::PUSH_NULL);
+                            break;
+                    }
+                    break;
+                case ast_kind::BINARY:
+                    binary(node);
+                    break;
+                case ast_kind::TERNARY: {
+                    expression(node._a);
+                    _token = node._token;
+                    std::uint32_t otherwise = emit_jump(opcode::JUMP_IF_FALSE);
+                    expression(node._b);
+                    std::uint32_t end = emit_jump(opcode::JUMP);
+                    patch(otherwise);
+                    expression(node._c);
+                    patch(end);
+                    break;
+                }
+                case ast_kind::CALL: {
+                    expression(node._a);
+                    std::uint32_t count = list(node._b);
+                    _token = node._token;
+                    emit(opcode::CALL, count);
+                    break;
+                }
+                case ast_kind::INDEX:
+                    expression(node._a);
+                    expression(node._b);
+                    _token = node._token;
+                    emit(opcode::LOAD_INDEX);
+                    break;
+                case ast_kind::MEMBER: {
+                    target t{};
+                    if (scoped_name(node, t)) {
+                        load(t);
+                        break;
+                    }
+                    expression(node._a);
+                    _token = node._token;
+                    emit(node._op == operator_type::OPERATOR_ARROW ? opcode::LOAD_ARROW : opcode::LOAD_MEMBER,
+                         symbol_constant(_tokens->symbol((*_tokens)[(*_tree)[node._b]._token])));
+                    break;
+                }
+                case ast_kind::ARRAY: {
+                    std::uint32_t count = list(node._a);
+                    _token = node._token;
+                    emit(opcode::MAKE_ARRAY, count);
+                    break;
+                }
+                case ast_kind::LAMBDA: {
+                    std::uint32_t f = function_body(function_kind::LAMBDA, no_constant, node._a, node._b);
+                    _token = node._token;
+                    make_function(f);
+                    break;
+                }
+                default:
+                    fail(node._token, "expected an expression");
+            }
+            if (!value) {
+                emit(opcode::POP);
+            }
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // statements
+        ////////////////////////////////////////////////////////////////////////////////
+
+        void statements(ast_index first) {
+            for (ast_index i = first; i != no_node; i = (*_tree)[i]._next) {
+                statement(i);
+            }
+        }
+
+        void block(ast_index first) {
+            open_scope();
+            statements(first);
+            close_scope();
+        }
+
+        // a function for a lambda's expression, or for statements of the
+        // other kinds; params is a list of NAME or `...` UNARY nodes
+        std::uint32_t function_body(function_kind kind, std::uint32_t name, ast_index params, ast_index body) {
+            if (_module->_functions.size() >= std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("too many functions");
+            }
+            auto index = static_cast<std::uint32_t>(_module->_functions.size());
+            _module->_functions.emplace_back();
+            _module->_functions.back()._kind = kind;
+            _module->_functions.back()._name = name;
+            _states.emplace_back();
+            state()._function = index;
+            state()._kind = kind;
+            open_scope();
+
+            for (ast_index p = params; p != no_node; p = (*_tree)[p]._next) {
+                const ast_node &param = (*_tree)[p];
+                bool vararg = param._kind == ast_kind::UNARY;
+                if (function()._vararg) {
+                    fail(param._token, "a '...' parameter must be the last one");
+                }
+                declare(vararg ? (*_tree)[param._a]._token : param._token, false);
+                ++function()._params;
+                function()._vararg = vararg;
+            }
+            if (kind == function_kind::LAMBDA) {
+                expression(body);
+                emit(opcode::RETURN);
+            } else {
+                statements(body);
+                if (kind == function_kind::NAMESPACE || kind == function_kind::STRUCT
+                    || kind == function_kind::CLASS) {
+                    for (const auto &v : state()._variables) {
+                        function()._members.emplace_back(symbol_constant(v._name), v._slot);
+                    }
+                }
+                emit(opcode::PUSH_NULL);
+                emit(opcode::RETURN);
+            }
+
+            close_scope();
+            _states.pop_back();
+            return index;
+        }
+
+        // MAKE_CLOSURE when function f uses variables of this one
+        void make_function(std::uint32_t f) {
+            emit(_module->_functions[f]._captures.empty() ? opcode::MAKE_FUNCTION : opcode::MAKE_CLOSURE, f);
+        }
+
+        void jump_out(std::uint32_t token, bool is_break) {
+            function_state &s = state();
+            if (s._loops.empty()) {
+                fail(token, is_break ? "'break' outside a loop" : "'continue' outside a loop");
+            }
+            for (std::size_t i = s._loops.back()._tries; i < s._tries; ++i) {
+                emit(opcode::TRY_END);
+            }
+            std::uint32_t at = emit_jump(opcode::JUMP);
+            loop &l = state()._loops.back();
+            (is_break ? l._breaks : l._continues).push_back(at);
+        }
+
+        void begin_loop() {
+            state()._loops.push_back(loop{{}, {}, state()._tries});
+        }
+
+        void end_loop(std::uint32_t continue_at, std::uint32_t break_at) {
+            loop l = std::move(state()._loops.back());
+            state()._loops.pop_back();
+            for (std::uint32_t at : l._continues) {
+                patch(at, continue_at);
+            }
+            for (std::uint32_t at : l._breaks) {
+                patch(at, break_at);
+            }
+        }
+
+        void switch_statement(const ast_node &node) {
+            expression(node._a);
+            open_scope();
+            std::uint32_t value = new_slot();
+            emit(opcode::STORE_LOCAL, value);
+
+            // the tests, then the bodies in the same order
+            std::vector<std::uint32_t> entries;
+            ast_index fallback = no_node;
+            for (ast_index c = node._b; c != no_node; c = (*_tree)[c]._next) {
+                const ast_node &label = (*_tree)[c];
+                if (label._a == no_node) {
+                    if (fallback != no_node) {
+                        fail(label._token, "more than one 'default'");
+                    }
+                    fallback = c;
+                    entries.push_back(0);
+                    continue;
+                }
+                _token = label._token;
+                emit(opcode::LOAD_LOCAL, value);
+                expression(label._a);
+                _token = label._token;
+                emit(opcode::EQ);
+                entries.push_back(emit_jump(opcode::JUMP_IF_TRUE));
+            }
+            _token = node._token;
+            std::uint32_t no_match = emit_jump(opcode::JUMP);
+
+            std::vector<std::uint32_t> ends;
+            std::size_t i = 0;
+            for (ast_index c = node._b; c != no_node; c = (*_tree)[c]._next, ++i) {
+                if (c == fallback) {
+                    patch(no_match);
+                } else {
+                    patch(entries[i]);
+                }
+                block((*_tree)[c]._b);
+                ends.push_back(emit_jump(opcode::JUMP));
+            }
+            if (fallback == no_node) {
+                patch(no_match);
+            }
+            for (std::uint32_t at : ends) {
+                patch(at);
+            }
+            close_scope();
+        }
+
+        void statement(ast_index index) {
+            const ast_node &node = (*_tree)[index];
+            _token = node._token;
+            switch (node._kind) {
+                case ast_kind::EXPRESSION:
+                    expression(node._a, false);
+                    break;
+                case ast_kind::PREPROCESSOR:
+                    // imports are the module loader's
+                    break;
+                case ast_kind::IMPORT:
+                    for (ast_index path = node._a; path != no_node; path = (*_tree)[path]._next) {
+                        emit(opcode::IMPORT, name_constant(path_text(path)));
+                        store(declare(last_name(path), false));
+                    }
+                    break;
+                case ast_kind::PACKAGE:
+                    if (!module_scope()) {
+                        fail(node._token, "'package' must be at the top level");
+                    }
+                    _module->_package = name_constant(path_text(node._a));
+                    break;
+                case ast_kind::USING:
+                    expression(node._a);
+                    _token = node._token;
+                    emit(opcode::USING);
+                    break;
+                case ast_kind::VAR:
+                    if (node._a != no_node) {
+                        expression(node._a);
+                    } else {
+                        emit(opcode::PUSH_NULL);
+                    }
+                    _token = node._token;
+                    store(declare(node._token, (node._flags & AST_CONST) != 0));
+                    break;
+                case ast_kind::FUNCTION: {
+                    // visible in its own body when it is a local
+                    target t = declare(node._token, false);
+                    std::uint32_t f = function_body(function_kind::FUNCTION,
+                                                    symbol_constant(_tokens->symbol((*_tokens)[node._token])),
+                                                    node._a, node._b);
+                    _token = node._token;
+                    make_function(f);
+                    store(t);
+                    break;
+                }
+                case ast_kind::NAMESPACE:
+                case ast_kind::STRUCT: {
+                    function_kind kind = node._kind == ast_kind::NAMESPACE ? function_kind::NAMESPACE
+                                         : (node._flags & AST_CLASS) != 0 ? function_kind::CLASS
+                                         : function_kind::STRUCT;
+                    if (node._a != no_node) {
+                        expression(node._a);
+                    }
+                    target t = declare(node._token, false);
+                    std::uint32_t f = function_body(kind, symbol_constant(_tokens->symbol((*_tokens)[node._token])),
+                                                    no_node, node._b);
+                    _token = node._token;
+                    emit(kind == function_kind::NAMESPACE ? opcode::MAKE_NAMESPACE
+                         : node._a != no_node ? opcode::MAKE_DERIVED_STRUCT
+                         : opcode::MAKE_STRUCT, f);
+                    store(t);
+                    break;
+                }
+                case ast_kind::RETURN:
+                    if (state()._kind != function_kind::FUNCTION && state()._kind != function_kind::LAMBDA) {
+                        fail(node._token, "'return' outside a function");
+                    }
+                    if (node._a != no_node) {
+                        expression(node._a);
+                        _token = node._token;
+                    } else {
+                        emit(opcode::PUSH_NULL);
+                    }
+                    emit(opcode::RETURN);
+                    break;
+                case ast_kind::BREAK:
+                case ast_kind::CONTINUE:
+                    jump_out(node._token, node._kind == ast_kind::BREAK);
+                    break;
+                case ast_kind::THROW:
+                    expression(node._a);
+                    _token = node._token;
+                    emit(opcode::THROW);
+                    break;
+                case ast_kind::BLOCK:
+                    block(node._a);
+                    break;
+                case ast_kind::IF: {
+                    expression(node._a);
+                    _token = node._token;
+                    std::uint32_t otherwise = emit_jump(opcode::JUMP_IF_FALSE);
+                    block(node._b);
+                    if (node._c != no_node) {
+                        std::uint32_t end = emit_jump(opcode::JUMP);
+                        patch(otherwise);
+                        block(node._c);
+                        patch(end);
+                    } else {
+                        patch(otherwise);
+                    }
+                    break;
+                }
+                case ast_kind::WHILE: {
+                    std::uint32_t top = here();
+                    expression(node._a);
+                    _token = node._token;
+                    std::uint32_t exit = emit_jump(opcode::JUMP_IF_FALSE);
+                    begin_loop();
+                    block(node._b);
+                    _token = node._token;
+                    emit_jump(opcode::JUMP, top);
+                    patch(exit);
+                    end_loop(top, here());
+                    break;
+                }
+                case ast_kind::LOOP: {
+                    // until sees the variables of the body
+                    std::uint32_t top = here();
+                    begin_loop();
+                    open_scope();
+                    statements(node._a);
+                    std::uint32_t condition = here();
+                    _token = node._token;
+                    if (node._b != no_node) {
+                        expression(node._b);
+                        _token = node._token;
+                        emit_jump(opcode::JUMP_IF_FALSE, top);
+                    } else {
+                        emit_jump(opcode::JUMP, top);
+                    }
+                    close_scope();
+                    end_loop(condition, here());
+                    break;
+                }
+                case ast_kind::FOR: {
+                    // for i = 0, i < n, ++i declares i for the loop
+                    open_scope();
+                    ast_index init = node._a;
+                    ast_index condition = (*_tree)[init]._next;
+                    ast_index next = (*_tree)[condition]._next;
+                    const ast_node &first = (*_tree)[init];
+                    if (first._kind == ast_kind::ASSIGN && first._op == operator_type::OPERATOR_ASSIGN
+                        && (*_tree)[first._a]._kind == ast_kind::NAME
+                        && _tokens->keyword((*_tokens)[(*_tree)[first._a]._token]) == keyword_type::UNDEFINED) {
+                        expression(first._b);
+                        _token = first._token;
+                        emit(opcode::STORE_LOCAL, declare((*_tree)[first._a]._token, false)._operand);
+                    } else {
+                        expression(init, false);
+                    }
+                    std::uint32_t top = here();
+                    expression(condition);
+                    _token = node._token;
+                    std::uint32_t exit = emit_jump(opcode::JUMP_IF_FALSE);
+                    begin_loop();
+                    block(node._b);
+                    std::uint32_t step = here();
+                    expression(next, false);
+                    _token = node._token;
+                    emit_jump(opcode::JUMP, top);
+                    patch(exit);
+                    end_loop(step, here());
+                    close_scope();
+                    break;
+                }
+                case ast_kind::FOR_IN: {
+                    open_scope();
+                    expression(node._a);
+                    _token = node._token;
+                    emit(opcode::ITER_BEGIN);
+                    std::uint32_t slot = declare(node._token, false)._operand;
+                    std::uint32_t top = here();
+                    emit(opcode::ITER_NEXT, slot);
+                    std::uint32_t exit = here();
+                    put_u32(0);
+                    begin_loop();
+                    block(node._b);
+                    _token = node._token;
+                    emit_jump(opcode::JUMP, top);
+                    // the iterator is dropped when done and on break
+                    patch(exit);
+                    end_loop(top, here());
+                    emit(opcode::POP);
+                    close_scope();
+                    break;
+                }
+                case ast_kind::TRY: {
+                    std::uint32_t handler = emit_jump(opcode::TRY_BEGIN);
+                    ++state()._tries;
+                    block(node._a);
+                    --state()._tries;
+                    _token = node._token;
+                    emit(opcode::TRY_END);
+                    std::uint32_t end = emit_jump(opcode::JUMP);
+                    patch(handler);
+                    open_scope();
+                    _token = (*_tree)[node._b]._token;
+                    emit(opcode::STORE_LOCAL, declare(_token, false)._operand);
+                    statements(node._c);
+                    close_scope();
+                    patch(end);
+                    break;
+                }
+                case ast_kind::SWITCH:
+                    switch_statement(node);
+                    break;
+                default:
+                    fail(node._token, "expected a statement");
+            }
+        }
+
+    public:
+        // compile the module tree was parsed into from tokens, whose names
+        // are in symbols, into module. what module held is dropped.
+        void compile(const token_stream &tokens, const symbol_table &symbols, const ast &tree,
+                     bytecode_module &module) {
+            _tokens = &tokens;
+            _symbols = &symbols;
+            _tree = &tree;
+            _module = &module;
+            _token = 0;
+            _depth = 0;
+            module.clear();
+            _states.clear();
+            _globals.clear();
+            _int_constants.clear();
+            _float_constants.clear();
+            _char_constants.clear();
+            _string_constants.assign(tokens.strings().size(), no_constant);
+            _name_constants.clear();
+            _symbol_constants.clear();
+
+            module._functions.emplace_back();
+            module._functions.back()._kind = function_kind::MODULE;
+            _states.emplace_back();
+            state()._function = 0;
+            state()._kind = function_kind::MODULE;
+            open_scope();
+            ast_index first = tree[tree.root()]._a;
+            declare_globals(first);
+            statements(first);
+            emit(opcode::PUSH_NULL);
+            emit(opcode::RETURN);
+            close_scope();
+            _states.pop_back();
+        }
+    };
+}
+
+namespace cs {
+    using cs_impl::bytecode_compiler;
+    using cs_impl::compiler_error;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+#include <mozart++/codecvt>
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // char classes
+    ////////////////////////////////////////////////////////////////////////////////
+
+    enum char_class : std::uint8_t {
+        CLASS_ID_START = 1U << 0U,
+        CLASS_ID_PART = 1U << 1U,
+        CLASS_SEPARATOR = 1U << 2U,
+    };
+
+    // What the lexer needs to know about a char, asked from the charset
+    // once at construction, so lexing never makes a virtual call.
+    // The first 256 chars are looked up directly, the rest of Unicode in a
+    // two-level table: the high bits pick a 256-bit block of identifier
+    // flags, and equal blocks (most of them are all 0 or all 1) are shared.
+    struct char_class_table {
+    private:
+        static constexpr char32_t max_char = 0x10FFFF;
+
+        using block_t = std::array<std::uint64_t, 4>;
+
+        std::uint8_t _latin[256];
+        std::vector<std::uint16_t> _index;
+        std::vector<block_t> _blocks;
+        // for broken input decoded past max_char
+        bool _beyond;
+
+        static bool is_ascii_id(char32_t c) {
+            return (c >= U'a' && c <= U'z')
+                   || (c >= U'A' && c <= U'Z')
+                   || c == U'$'
+                   || c == U'_';
+        }
+
+    public:
+        explicit char_class_table(mpp::codecvt::charset &charset) {
+            for (char32_t c = 0; c < 256; ++c) {
+                std::uint8_t cls = 0;
+                if (is_ascii_id(c) || charset.is_identifier(c)) {
+                    cls |= CLASS_ID_START | CLASS_ID_PART;
+                }
+                if (c >= U'0' && c <= U'9') {
+                    cls |= CLASS_ID_PART;
+                }
+                switch (c) {
+                    case U' ':
+                    case U'\n':
+                    case U'\r':
+                    case U'\t':
+                    case U'\f':
+                    case U'\v':
+                    case U';':
+                        cls |= CLASS_SEPARATOR;
+                        break;
+                    default:
+                        break;
+                }
+                _latin[c] = cls;
+            }
+
+            std::map<block_t, std::uint16_t> unique;
+            _index.reserve((max_char >> 8U) + 1);
+            for (char32_t high = 0; high <= (max_char >> 8U); ++high) {
+                block_t block{};
+                for (char32_t low = 0; low < 256; ++low) {
+                    char32_t c = (high << 8U) | low;
+                    if (c < 256 ? (_latin[c] & CLASS_ID_START) != 0 : charset.is_identifier(c)) {
+                        block[low >> 6U] |= std::uint64_t(1) << (low & 63U);
+                    }
+                }
+                auto iter = unique.find(block);
+                if (iter == unique.end()) {
+                    iter = unique.emplace(block, static_cast<std::uint16_t>(_blocks.size())).first;
+                    _blocks.push_back(block);
+                }
+                _index.push_back(iter->second);
+            }
+            _beyond = charset.is_identifier(max_char + 1);
+        }
+
+        // digits are ASCII, so past the first 256 chars
+        // every identifier char can also start one
+        bool is_identifier(char32_t c, bool first) const {
+            if (c < 256) {
+                return (_latin[c] & (first ? CLASS_ID_START : CLASS_ID_PART)) != 0;
+            }
+            if (c > max_char) {
+                return _beyond;
+            }
+            const block_t &block = _blocks[_index[c >> 8U]];
+            return ((block[(c & 0xFFU) >> 6U] >> (c & 63U)) & 1U) != 0;
+        }
+
+        bool is_separator(char32_t c) const {
+            return c < 256 && (_latin[c] & CLASS_SEPARATOR) != 0;
+        }
+
+        // Tables are shared by charsets of the same type, a charset has
+        // no state that changes what an identifier is.
+        static std::shared_ptr<const char_class_table> of(mpp::codecvt::charset &charset) {
+            static std::mutex lock;
+            static std::unordered_map<std::type_index, std::shared_ptr<const char_class_table>> tables;
+
+            std::lock_guard<std::mutex> guard(lock);
+            auto &table = tables[typeid(charset)];
+            if (!table) {
+                table = std::make_shared<char_class_table>(charset);
+            }
+            return table;
+        }
+    };
+}
@@ -3,3 +3,7 @@
 //
 
 #include "lexer.hpp"
+
+namespace cs_impl {
+    template struct basic_lexer<mpp::codecvt::charset, operator_trie>;
+}
@@ -3,350 +3,512 @@
 //
 #pragma once
 
-#include <stack>
+#include <algorithm>
+#include <cmath>
 #include <deque>
+#include <exception>
+#include <limits>
 #include <memory>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #include <mozart++/codecvt>
 #include <mozart++/format>
+#include "char_class.hpp"
+#include "lexer_dfa.hpp"
+#include "lexer_simd.hpp"
+#include "lexer_stats.hpp"
+#include "number_literal.hpp"
+#include "operator_table.hpp"
+#include "source.hpp"
+#include "source_file.hpp"
+#include "symbol_table.hpp"
+#include "thread_pool.hpp"
+#include "token.hpp"
+#include "token_cache.hpp"
+#include "token_stream.hpp"
 
 namespace cs_impl {
-    enum class token_type {
-        UNDEFINED,
-        ID_OR_KW,
-        INT_LITERAL,
-        FLOATING_LITERAL,
-        STRING_LITERAL,
-        CHAR_LITERAL,
-        PREPROCESSOR,
-        OPERATOR,
-        CUSTOM_LITERAL,
-    };
-
-    enum class operator_type {
-        UNDEFINED,             //
-        OPERATOR_ADD,          // +
-        OPERATOR_SUB,          // -
-        OPERATOR_MUL,          // *
-        OPERATOR_DIV,          // /
-        OPERATOR_MOD,          // *
-        OPERATOR_ASSIGN,       // =
-        OPERATOR_ADD_ASSIGN,   // +=
-        OPERATOR_SUB_ASSIGN,   // -=
-        OPERATOR_MUL_ASSIGN,   // *=
-        OPERATOR_DIV_ASSIGN,   // /=
-        OPERATOR_MOD_ASSIGN,   // %=
-        OPERATOR_AND_ASSIGN,   // &=
-        OPERATOR_OR_ASSIGN,    // |=
-        OPERATOR_XOR_ASSIGN,   // ^=
-        OPERATOR_EQ,           // ==
-        OPERATOR_NE,           // !=
-        OPERATOR_GT,           // >
-        OPERATOR_GE,           // >=
-        OPERATOR_LT,           // <
-        OPERATOR_LE,           // <=
-        OPERATOR_COLON,        // :
-        OPERATOR_COMMA,        // ,
-        OPERATOR_QUESTION,     // ?
-        OPERATOR_INC,          // ++
-        OPERATOR_DEC,          // --
-        OPERATOR_ARROW,        // ->
-        OPERATOR_DOT,          // .
-        OPERATOR_AND,          // &&
-        OPERATOR_OR,           // ||
-        OPERATOR_NOT,          // !
-        OPERATOR_BITAND,       // &
-        OPERATOR_BITOR,        // |
-        OPERATOR_BITXOR,       // ^
-        OPERATOR_BITNOT,       // ~
-        OPERATOR_VARARG,       // ...
-        OPERATOR_LPAREN,       // (
-        OPERATOR_RPAREN,       // )
-        OPERATOR_LBRACKET,     // [
-        OPERATOR_RBRACKET,     // ]
-        OPERATOR_LBRACE,       // {
-        OPERATOR_RBRACE,       // }
-
-        OPERATOR_SEMI,
-    };
-
     ////////////////////////////////////////////////////////////////////////////////
-    // tokens
+    // code units
     ////////////////////////////////////////////////////////////////////////////////
 
-    struct token {
-        std::size_t _line;
-        std::size_t _column;
-        std::string _token_text;
-        token_type _type;
-
-        explicit token(std::size_t line, std::size_t column,
-                       std::string text, token_type type)
-            : _line(line), _column(column),
-              _token_text(std::move(text)), _type(type) {}
-
-        virtual ~token() = default;
+    enum class lexer_engine {
+        // decode the whole source into char32_t before lexing
+        WIDE,
+        // scan UTF-8 bytes directly, decode only non-ASCII chars
+        UTF8,
     };
 
-    struct token_operator : public token {
-        std::string _value;
-        operator_type _op_type;
+    template <typename UnitT>
+    struct unit_traits;
 
-        explicit token_operator(std::size_t line, std::size_t column,
-                                std::string text, std::string value,
-                                operator_type type)
-            : token(line, column, std::move(text), token_type::OPERATOR),
-              _value(std::move(value)), _op_type(type) {}
+    template <>
+    struct unit_traits<char32_t> {
+        using iter_t = const char32_t *;
+        // decoded text in these units
+        using string_t = std::u32string;
 
-        ~token_operator() override = default;
-    };
+        static char32_t peek(iter_t current, iter_t) {
+            return *current;
+        }
 
-    struct token_preprocessor : public token {
-        std::string _value;
+        static char32_t next(iter_t &current, iter_t) {
+            return *current++;
+        }
 
-        explicit token_preprocessor(std::size_t line, std::size_t column,
-                                    std::string text, std::string value)
-            : token(line, column, std::move(text), token_type::PREPROCESSOR),
-              _value(std::move(value)) {}
+        static void put(string_t &out, char32_t c) {
+            out.push_back(c);
+        }
 
-        ~token_preprocessor() override = default;
+        static void append(string_t &out, iter_t begin, iter_t end) {
+            out.append(begin, end);
+        }
     };
 
-    struct token_id_or_kw : public token {
-        std::string _value;
-
-        explicit token_id_or_kw(std::size_t line, std::size_t column,
-                                std::string text, std::string value)
-            : token(line, column, std::move(text), token_type::ID_OR_KW),
-              _value(std::move(value)) {}
+    template <>
+    struct unit_traits<unsigned char> {
+        using iter_t = const unsigned char *;
+        using string_t = std::string;
 
-        ~token_id_or_kw() override = default;
-    };
-
-    struct token_int_literal : public token {
-        int64_t _value;
+        static char32_t peek(iter_t current, iter_t end) {
+            return next(current, end);
+        }
 
-        explicit token_int_literal(std::size_t line, std::size_t column,
-                                   std::string text, int64_t value)
-            : token(line, column, std::move(text), token_type::INT_LITERAL),
-              _value(value) {}
+        // invalid or truncated sequences are returned byte by byte
+        static char32_t next(iter_t &current, iter_t end) {
+            unsigned char lead = *current++;
+            if (lead < 0x80) {
+                return lead;
+            }
 
-        ~token_int_literal() override = default;
-    };
+            std::size_t extra = 0;
+            char32_t c = 0;
+            if ((lead & 0xE0U) == 0xC0) {
+                extra = 1;
+                c = lead & 0x1FU;
+            } else if ((lead & 0xF0U) == 0xE0) {
+                extra = 2;
+                c = lead & 0x0FU;
+            } else if ((lead & 0xF8U) == 0xF0) {
+                extra = 3;
+                c = lead & 0x07U;
+            } else {
+                return lead;
+            }
 
-    struct token_float_literal : public token {
-        double _value;
+            if (static_cast<std::size_t>(end - current) < extra) {
+                return lead;
+            }
+            for (std::size_t i = 0; i < extra; ++i) {
+                if ((current[i] & 0xC0U) != 0x80) {
+                    return lead;
+                }
+                c = (c << 6U) | (current[i] & 0x3FU);
+            }
+            current += extra;
+            return c;
+        }
 
-        explicit token_float_literal(std::size_t line, std::size_t column,
-                                     std::string text, double value)
-            : token(line, column, std::move(text), token_type::FLOATING_LITERAL),
-              _value(value) {}
+        static void put(string_t &out, char32_t c) {
+            if (c < 0x80) {
+                out.push_back(static_cast<char>(c));
+            } else if (c < 0x800) {
+                out.push_back(static_cast<char>(0xC0U | (c >> 6U)));
+                out.push_back(static_cast<char>(0x80U | (c & 0x3FU)));
+            } else if (c < 0x10000) {
+                out.push_back(static_cast<char>(0xE0U | (c >> 12U)));
+                out.push_back(static_cast<char>(0x80U | ((c >> 6U) & 0x3FU)));
+                out.push_back(static_cast<char>(0x80U | (c & 0x3FU)));
+            } else {
+                out.push_back(static_cast<char>(0xF0U | (c >> 18U)));
+                out.push_back(static_cast<char>(0x80U | ((c >> 12U) & 0x3FU)));
+                out.push_back(static_cast<char>(0x80U | ((c >> 6U) & 0x3FU)));
+                out.push_back(static_cast<char>(0x80U | (c & 0x3FU)));
+            }
+        }
 
-        ~token_float_literal() override = default;
+        static void append(string_t &out, iter_t begin, iter_t end) {
+            out.append(reinterpret_cast<const char *>(begin), static_cast<std::size_t>(end - begin));
+        }
     };
 
-    struct token_string_literal : public token {
-        std::string _value;
+    // where the lexer stopped, in code units from the source start
+    struct lexer_position {
+        std::size_t _offset = 0;
+    };
 
-        explicit token_string_literal(std::size_t line, std::size_t column,
-                                      std::string text, std::string value)
-            : token(line, column, std::move(text), token_type::STRING_LITERAL),
-              _value(std::move(value)) {}
+    struct lexer_input {
+    private:
+        std::shared_ptr<const source_buffer> _source;
 
-        ~token_string_literal() override = default;
-    };
+    public:
+        void source(std::shared_ptr<const source_buffer> data) {
+            std::swap(_source, data);
+        }
 
-    struct token_char_literal : public token {
-        char32_t _value;
+        const std::shared_ptr<const source_buffer> &buffer() const {
+            return _source;
+        }
 
-        explicit token_char_literal(std::size_t line, std::size_t column,
-                                    std::string text, char32_t value)
-            : token(line, column, std::move(text), token_type::CHAR_LITERAL),
-              _value(value) {}
+        template <typename UnitT>
+        const UnitT *begin() const {
+            return _source->data<UnitT>();
+        }
 
-        ~token_char_literal() override = default;
+        template <typename UnitT>
+        const UnitT *end() const {
+            return _source->data<UnitT>() + _source->length();
+        }
     };
 
-    struct token_custom_literal : public token {
-        std::unique_ptr<token> _literal;
-        std::string _suffix;
+    struct lexer_error : public std::runtime_error {
+        std::size_t _line;
+        std::size_t _start_column;
+        std::size_t _end_column;
+        std::string _error_text;
 
-        explicit token_custom_literal(std::size_t line, std::size_t column,
-                                      std::string text, std::unique_ptr<token> literal,
-                                      std::string value)
-            : token(line, column, std::move(text), token_type::CUSTOM_LITERAL),
-              _literal(std::move(literal)),
-              _suffix(std::move(value)) {}
+        explicit lexer_error(std::size_t line, std::size_t start_column, std::size_t end_column,
+                             std::string error_text, const std::string &message)
+            : std::runtime_error(message), _line(line),
+              _start_column(start_column), _end_column(end_column),
+              _error_text(std::move(error_text)) {
+        }
 
-        ~token_custom_literal() override = default;
+        ~lexer_error() override = default;
     };
 
-    ////////////////////////////////////////////////////////////////////////////////
-    // lexer state / lexer input
-    ////////////////////////////////////////////////////////////////////////////////
-
-    enum class lexer_state {
-        GLOBAL,
-        INT_LIT,
-        FLOATING_LIT,
-        STRING_LIT,
-        CHAR_LIT,
-        PREPROCESSOR,
-        OPERATOR,
-        LITERAL_SUFFIX,
-
-        PARSING_STRING,
-        TRYING_LITERAL_SUFFIX,
-
-        ERROR_EOF,
-        ERROR_ENCLOSING,
-        ERROR_ESCAPE,
-        ERROR_OPERATOR,
-        ERROR_EMPTY,
+    enum class lexer_error_code : std::uint8_t {
+        UNEXPECTED_EOF,
+        STRING_ESCAPE,
+        UNICODE_ESCAPE,
+        CHAR_ESCAPE,
+        EMPTY_CHAR,
+        UNCLOSED_CHAR,
+        INT_TOO_LARGE,
+        FLOAT_OUT_OF_RANGE,
+        UNEXPECTED_TOKEN,
+        SUFFIX_AFTER_NON_LITERAL,
+        INTERNAL_SUFFIX_STATE,
     };
 
-    struct state_manager {
-    private:
-        lexer_state _state = lexer_state::GLOBAL;
-        std::stack<lexer_state> _previous;
+    // an error kept by the recovering lexer, the message and
+    // the line are only looked up when asked
+    struct lexer_diagnostic {
+        lexer_error_code _code;
+        // the reported text and the text the message quotes, in code units
+        std::uint32_t _offset;
+        std::uint32_t _length;
+        std::uint32_t _subject_offset;
+        std::uint32_t _subject_length;
+    };
 
-        lexer_state last_state() {
-            if (_previous.empty()) {
-                return lexer_state::GLOBAL;
+    // the same message lexer_error::what() has for this error
+    inline std::string diagnostic_message(const source_buffer &source, const lexer_diagnostic &d) {
+        auto subject = [&]() {
+            return source.local(d._subject_offset, d._subject_length);
+        };
+        auto subject_char = [&]() -> char32_t {
+            if (source.encoding() == source_encoding::WIDE) {
+                return source.data<char32_t>()[d._subject_offset];
             }
-            lexer_state state = _previous.top();
-            _previous.pop();
-            return state;
+            const unsigned char *p = source.data<unsigned char>() + d._subject_offset;
+            return unit_traits<unsigned char>::next(p, p + d._subject_length);
+        };
+
+        switch (d._code) {
+            case lexer_error_code::UNEXPECTED_EOF:
+                return "unexpected EOF";
+            case lexer_error_code::STRING_ESCAPE:
+                return mpp::format("unsupported escape char: \\{}", subject_char());
+            case lexer_error_code::UNICODE_ESCAPE:
+                return mpp::format("unsupported unicode escape: {}", subject());
+            case lexer_error_code::CHAR_ESCAPE:
+                return mpp::format("unsupported escape char: `\\{}`", subject_char());
+            case lexer_error_code::EMPTY_CHAR:
+                return "empty char is not allowed";
+            case lexer_error_code::UNCLOSED_CHAR:
+                return "unclosed char literal, expected `'`";
+            case lexer_error_code::INT_TOO_LARGE:
+                return mpp::format("integer literal {} is too large", subject());
+            case lexer_error_code::FLOAT_OUT_OF_RANGE:
+                return mpp::format("floating literal {} is out of range", subject());
+            case lexer_error_code::UNEXPECTED_TOKEN:
+                return mpp::format("unexpected token '{}'", subject());
+            case lexer_error_code::SUFFIX_AFTER_NON_LITERAL:
+                return mpp::format("unsupported literal suffix {} after non-literal", subject());
+            case lexer_error_code::INTERNAL_SUFFIX_STATE:
+                return "<internal error>: illegal state in literal suffix";
         }
+        return "<internal error>: unknown error";
+    }
+
+    inline lexer_error diagnostic_error(const source_buffer &source, const lexer_diagnostic &d) {
+        source_location at = source.location(d._offset);
+        return lexer_error(at._line, at._column, at._column + source.count_chars(d._offset, d._length),
+                           source.local(d._offset, d._length), diagnostic_message(source, d));
+    }
+
+    // diagnostics of one source, like tokens of a token_stream they only
+    // keep offsets and make their text when asked
+    struct lexer_diagnostics {
+    private:
+        std::shared_ptr<const source_buffer> _source;
+        std::vector<lexer_diagnostic> _records;
 
     public:
-        void new_state(lexer_state state) {
-            _previous.push(_state);
-            _state = state;
+        void source(std::shared_ptr<const source_buffer> source) {
+            _source = std::move(source);
         }
 
-        void end(lexer_state expected) {
-            if (_state == expected) {
-                _state = last_state();
-            }
+        const std::shared_ptr<const source_buffer> &source() const {
+            return _source;
         }
 
-        void replace(lexer_state state) {
-            _state = state;
+        void push_back(const lexer_diagnostic &d) {
+            _records.push_back(d);
         }
 
-        lexer_state pop() {
-            lexer_state state = current();
-            end(state);
-            return state;
+        void clear() {
+            _records.clear();
         }
 
-        lexer_state current() const {
-            return _state;
+        bool empty() const {
+            return _records.empty();
         }
-    };
 
-    struct lexer_input {
-        using CharT = char32_t;
-    private:
-        std::u32string _source;
-        const CharT *_begin = nullptr;
-        std::size_t _length = 0;
+        std::size_t size() const {
+            return _records.size();
+        }
 
-    public:
-        void source(std::u32string data) {
-            std::swap(_source, data);
-            this->_begin = _source.c_str();
-            this->_length = _source.length();
+        const lexer_diagnostic &operator[](std::size_t index) const {
+            return _records[index];
         }
 
-        const CharT *begin() const {
-            return _begin;
+        const lexer_diagnostic *begin() const {
+            return _records.data();
         }
 
-        const CharT *end() const {
-            return _begin + _length;
+        const lexer_diagnostic *end() const {
+            return _records.data() + _records.size();
         }
-    };
 
-    struct lexer_error : public std::runtime_error {
-        std::size_t _line;
-        std::size_t _start_column;
-        std::size_t _end_column;
-        std::string _error_text;
+        std::string message(const lexer_diagnostic &d) const {
+            return diagnostic_message(*_source, d);
+        }
 
-        explicit lexer_error(std::size_t line, std::size_t start_column, std::size_t end_column,
-                             std::string error_text, const std::string &message)
-            : std::runtime_error(message), _line(line),
-              _start_column(start_column), _end_column(end_column),
-              _error_text(std::move(error_text)) {
+        // local-encoded text of the reported span
+        std::string text(const lexer_diagnostic &d) const {
+            return _source->local(d._offset, d._length);
         }
 
-        ~lexer_error() override = default;
+        // what the throwing lexer would have thrown
+        lexer_error to_error(const lexer_diagnostic &d) const {
+            return diagnostic_error(*_source, d);
+        }
+
+        source_location location(const lexer_diagnostic &d) const {
+            return _source->location(d._offset);
+        }
+    };
+
+    // tokens [_first, _first + _removed) of the stream before an edit
+    // were replaced by [_first, _first + _inserted) after it
+    struct token_change {
+        std::size_t _first;
+        std::size_t _removed;
+        std::size_t _inserted;
     };
 
     ////////////////////////////////////////////////////////////////////////////////
     // lexer
     ////////////////////////////////////////////////////////////////////////////////
 
-    struct lexer {
+    // Charset is the charset type, with mpp::codecvt::utf8 transcoding and
+    // name encoding take the UTF-8 path without asking the charset at run
+    // time. OperatorTable matches operators, either
+    // operator_trie filled by add_operators or a fixed set like
+    // default_operator_set.
+    template <typename Charset, typename OperatorTable>
+    struct basic_lexer {
         using CharT = char32_t;
-        using iter_t = const CharT *;
     private:
-        state_manager _state;
+        // the last token is a literal, a suffix may follow
+        bool _trying_suffix = false;
         lexer_input _input;
-        std::unique_ptr<mpp::codecvt::charset> _charset;
-        std::unordered_map<std::string, operator_type> _op_maps;
-
-        template <typename T, typename ...Args>
-        std::unique_ptr<token> make_token(std::size_t line, iter_t line_start,
-                                          iter_t token_start, iter_t token_end,
-                                          Args &&...args) {
-            return std::unique_ptr<token>(
-                new T{line, static_cast<std::size_t>(token_start - line_start),
-                      _charset->wide2local({token_start, static_cast<std::size_t>(token_end - token_start)}),
-                      std::forward<Args>(args)...}
-            );
-        }
-
-        template <typename ...Args>
-        __attribute__((noreturn))
-        void error(std::size_t line, iter_t line_start,
-                   iter_t token_start, iter_t token_end,
-                   const std::string &fmt, Args &&...args) {
-            auto message = mpp::format(fmt, std::forward<Args>(args)...);
-            mpp::throw_ex<lexer_error>(
-                line, static_cast<std::size_t>(token_start - line_start),
-                static_cast<std::size_t>(token_end - line_start),
-                _charset->wide2local({token_start, static_cast<std::size_t>(token_end - token_start)}),
-                message
-            );
-            std::terminate();
+        lexer_engine _engine;
+        std::shared_ptr<Charset> _charset;
+        basic_transcoder<Charset> _transcoder;
+        std::shared_ptr<const char_class_table> _classes;
+        OperatorTable _operators;
+
+        // identifiers of every source lexed so far
+        symbol_table _symbols;
+        // reused for names that need to be encoded
+        std::string _name;
+        // reused for chunks that need to be decoded
+        std::u32string _decoded;
+        // reused for string literals with escapes, by engine
+        std::u32string _literal_wide;
+        std::string _literal_bytes;
+        // names can be encoded without asking the charset
+        bool _utf8_names = false;
+
+        // recovery mode when set, errors are kept here instead of thrown
+        lexer_diagnostics *_diagnostics = nullptr;
+
+        // only counted with COVSCRIPT_LEXER_STATS
+        lexer_stats _stats;
+
+        // chunked input, the buffer grows as chunks are read
+        std::unique_ptr<chunk_reader> _reader;
+        std::shared_ptr<source_buffer> _growing;
+        // offset just after the last '\n' read so far
+        std::size_t _complete_lines = 0;
+
+        // resumable scan, used by the pull API
+        lexer_position _position;
+        token_stream _window;
+        std::size_t _window_pos = 0;
+
+        // consumed tokens are dropped from the window after this many
+        static constexpr std::size_t window_compact_threshold = 32;
+
+        // smaller sources are not worth splitting, in code units
+        static constexpr std::size_t parallel_min_length = 256 * 1024;
+
+        // chunks per thread, more chunks balance the load better
+        static constexpr std::size_t parallel_chunks_per_thread = 4;
+
+        struct worker_tag {};
+
+        // what a worker got from lexing one chunk on its own
+        struct chunk_result {
+            token_stream _tokens;
+            lexer_position _end;
+            bool _trying_suffix = false;
+            std::unique_ptr<lexer_error> _error;
+            std::exception_ptr _other_error;
+            // symbols of the tokens, merged into the lexer's table later
+            symbol_table _symbols;
+            lexer_stats _stats;
+        };
+
+        // a worker of lex_parallel, shares source, charset and operators
+        // but interns into a table of its own
+        basic_lexer(const basic_lexer &parent, worker_tag)
+            : _input(parent._input), _engine(parent._engine),
+              _charset(parent._charset), _transcoder(parent._transcoder), _classes(parent._classes),
+              _operators(parent._operators), _utf8_names(parent._utf8_names) {
+        }
+
+        // known at compile time for the utf8 charset
+        bool utf8_names() const {
+            return std::is_same<Charset, mpp::codecvt::utf8>::value || _utf8_names;
+        }
+
+        symbol_t intern(const char32_t *begin, const char32_t *end) {
+            auto kw = default_keyword_table.find(begin, end);
+            if (kw != keyword_type::UNDEFINED) {
+                return static_cast<symbol_t>(kw);
+            }
+            // ASCII names are encoded the same in every charset
+            _name.clear();
+            for (const char32_t *p = begin; p < end; ++p) {
+                char32_t c = *p;
+                if (c < 0x80) {
+                    _name.push_back(static_cast<char>(c));
+                } else if (!utf8_names()) {
+                    _name.clear();
+                    _transcoder.encode(begin, static_cast<std::size_t>(end - begin), _name);
+                    COVSCRIPT_LEXER_STAT(++_stats._wide2local_calls;
+                                         _stats._wide2local_units += static_cast<std::uint64_t>(end - begin);)
+                    break;
+                } else if (c < 0x800) {
+                    _name.push_back(static_cast<char>(0xC0U | (c >> 6U)));
+                    _name.push_back(static_cast<char>(0x80U | (c & 0x3FU)));
+                } else if (c < 0x10000) {
+                    _name.push_back(static_cast<char>(0xE0U | (c >> 12U)));
+                    _name.push_back(static_cast<char>(0x80U | ((c >> 6U) & 0x3FU)));
+                    _name.push_back(static_cast<char>(0x80U | (c & 0x3FU)));
+                } else {
+                    _name.push_back(static_cast<char>(0xF0U | (c >> 18U)));
+                    _name.push_back(static_cast<char>(0x80U | ((c >> 12U) & 0x3FU)));
+                    _name.push_back(static_cast<char>(0x80U | ((c >> 6U) & 0x3FU)));
+                    _name.push_back(static_cast<char>(0x80U | (c & 0x3FU)));
+                }
+            }
+            return _symbols.intern(_name.data(), _name.size());
+        }
+
+        symbol_t intern(const unsigned char *begin, const unsigned char *end) {
+            auto kw = default_keyword_table.find(begin, end);
+            if (kw != keyword_type::UNDEFINED) {
+                return static_cast<symbol_t>(kw);
+            }
+            return _symbols.intern(reinterpret_cast<const char *>(begin),
+                                   static_cast<std::size_t>(end - begin));
+        }
+
+        template <typename UnitT>
+        token_record make_record(const UnitT *token_start, const UnitT *token_end) const {
+            return token_record{
+                token_type::UNDEFINED, operator_type::UNDEFINED,
+                static_cast<std::uint32_t>(token_start - _input.begin<UnitT>()),
+                static_cast<std::uint32_t>(token_end - token_start),
+                0
+            };
+        }
+
+        // Throws the error, or in recovery mode keeps it and returns.
+        // The message quotes [subject_start, subject_end), the span
+        // itself when not given.
+        template <typename UnitT>
+        void report(lexer_error_code code, const UnitT *token_start, const UnitT *token_end,
+                    const UnitT *subject_start = nullptr, const UnitT *subject_end = nullptr) {
+            if (subject_start == nullptr) {
+                subject_start = token_start;
+                subject_end = token_end;
+            }
+            const UnitT *begin = _input.begin<UnitT>();
+            lexer_diagnostic d{
+                code,
+                static_cast<std::uint32_t>(token_start - begin),
+                static_cast<std::uint32_t>(token_end - token_start),
+                static_cast<std::uint32_t>(subject_start - begin),
+                static_cast<std::uint32_t>(subject_end - subject_start)
+            };
+            if (_diagnostics != nullptr) {
+                _diagnostics->push_back(d);
+                return;
+            }
+            mpp::throw_ex<lexer_error>(diagnostic_error(*_input.buffer(), d));
+        }
+
+        // where lexing goes on after an error: the next separator or newline
+        template <typename UnitT>
+        const UnitT *resync(const UnitT *current, const UnitT *end) const {
+            while (current < end) {
+                const UnitT *next = current;
+                if (is_separator_char(unit_traits<UnitT>::next(next, end))) {
+                    break;
+                }
+                current = next;
+            }
+            return current;
         }
 
         // return true if it's id or keyword
         bool is_id_or_kw(CharT c, bool first) const {
-            return (c >= U'a' && c <= U'z')
-                   || (c >= U'A' && c <= U'Z')
-                   || c == U'$'
-                   || c == U'_'
-                   || _charset->is_identifier(c)
-                   || (!first && is_digit_char(c));
+            return _classes->is_identifier(c, first);
         }
 
         bool is_separator_char(CharT c) const {
-            return c == U' '
-                   || c == U'\n'
-                   || c == U'\r'
-                   || c == U'\t'
-                   || c == U'\f'
-                   || c == U'\v'
-                   || c == U';';
-        }
-
-        bool is_digit_char(CharT c) const {
-            return (c >= U'0' && c <= U'9');
+            return _classes->is_separator(c);
         }
 
         bool is_escape_char(CharT c) const {
@@ -392,478 +554,952 @@ namespace cs_impl {
             }
         }
 
-        std::string consume_preprocessor(iter_t &current, iter_t end) {
-            iter_t left = current;
-            auto length = static_cast<std::size_t>(end - current);
-            auto *s = std::char_traits<CharT>::find(current, length, U'\n');
+        // dfa column of a char, see default_lexer_dfa
+        std::size_t dfa_column(CharT c) const {
+            if (c < 128) {
+                return c;
+            }
+            return is_id_or_kw(c, true) ? dfa_wide_identifier : dfa_wide_other;
+        }
+
+        // run default_lexer_dfa from `state` until the token ends, one
+        // table lookup per char. runs of chars a state loops on are
+        // skipped in bulk first.
+        template <typename UnitT>
+        dfa_token scan(dfa_state state, const UnitT *&current, const UnitT *end) const {
+            const auto &kernels = simd::kernels<UnitT>::get();
+            while (true) {
+                switch (default_lexer_dfa.skip(state)) {
+                    case dfa_skip::NONE:
+                        break;
+                    case dfa_skip::BLANK:
+                        current = kernels._blank(current, end);
+                        break;
+                    case dfa_skip::IDENTIFIER:
+                        current = kernels._identifier(current, end);
+                        break;
+                    case dfa_skip::STRING:
+                        current = kernels._string(current, end);
+                        break;
+                    case dfa_skip::LINE:
+                        current = std::find(current, end, static_cast<UnitT>(U'\n'));
+                        break;
+                }
+                if (current == end) {
+                    return default_lexer_dfa.eof(state);
+                }
+
+                const UnitT *after = current;
+                dfa_state next = default_lexer_dfa.next(state, dfa_column(unit_traits<UnitT>::next(after, end)));
+                if (next == dfa_state::STOP) {
+                    return default_lexer_dfa.stop(state);
+                }
+                state = next;
+                current = after;
+            }
+        }
+
+        // where the e of INT_BEFORE_E or FLOAT_BEFORE_E is, the number ends
+        // there and the e is lexed again, e.g. as a name
+        template <typename UnitT>
+        static const UnitT *exponent_mark(const UnitT *end) {
+            return end[-1] == static_cast<UnitT>(U'e') || end[-1] == static_cast<UnitT>(U'E') ? end - 1 : end - 2;
+        }
 
-            current = s ? s : end;
-            _state.new_state(lexer_state::PREPROCESSOR);
-            return _charset->wide2local({left, static_cast<std::size_t>(current - left)});
+        // value of an int literal scanned as `kind`, false if it does not fit
+        template <typename UnitT>
+        static bool int_value(dfa_token kind, const UnitT *current, const UnitT *end, std::int64_t &value) {
+            switch (kind) {
+                case dfa_token::INT_HEX:
+                    return parse_hex_int(current, end, value);
+                case dfa_token::INT_BIN:
+                    return parse_binary_int(current, end, value);
+                case dfa_token::INT_OCT:
+                    return parse_octal_int(current, end, value);
+                default:
+                    return parse_decimal_int(current, end, value);
+            }
         }
 
-        std::pair<int64_t, double> consume_number(iter_t &current, iter_t end) {
-            int64_t integer_part = *current++ - U'0';
-            if (current == end) {
-                _state.new_state(lexer_state::INT_LIT);
-                return std::make_pair(integer_part, 0);
+        // value of a char literal scanned completely
+        template <typename UnitT>
+        CharT char_value(const UnitT *current, const UnitT *end) const {
+            // skip the opening `'`
+            ++current;
+            if (*current == U'\\') {
+                return to_escaped_char(current[1]);
             }
+            return unit_traits<UnitT>::next(current, end);
+        }
 
-            // lookahead for (.)
-            bool found_point = false;
-            iter_t lookahead = current;
-            while (lookahead < end) {
-                if (*current == U'.') {
-                    found_point = true;
-                    break;
+        std::u32string &literal_buffer(const char32_t *) {
+            return _literal_wide;
+        }
+
+        std::string &literal_buffer(const unsigned char *) {
+            return _literal_bytes;
+        }
+
+        // value of a string literal with escapes scanned completely. a
+        // \u{...} that is not a char is reported and kept as U+FFFD when
+        // recovering.
+        template <typename UnitT>
+        void decode_string(const UnitT *token_start, const UnitT *token_end,
+                           typename unit_traits<UnitT>::string_t &out) {
+            using traits = unit_traits<UnitT>;
+            const UnitT *close = token_end - 1;
+            out.clear();
+            for (const UnitT *p = token_start + 1; p < close;) {
+                if (*p != U'\\') {
+                    const UnitT *next = std::find(p, close, static_cast<UnitT>(U'\\'));
+                    traits::append(out, p, next);
+                    p = next;
+                    continue;
                 }
-                if (is_digit_char(*lookahead)) {
-                    ++lookahead;
-                } else {
+                if (p[1] != U'u') {
+                    traits::put(out, to_escaped_char(p[1]));
+                    p += 2;
+                    continue;
+                }
+                // the scanner only lets hex digits and the brace through,
+                // parse_hex_int skips the `u{`
+                const UnitT *brace = std::find(p + 3, close, static_cast<UnitT>(U'}'));
+                std::int64_t value = 0;
+                if (!parse_hex_int(p + 1, brace, value) || value > 0x10FFFF
+                    || (value >= 0xD800 && value <= 0xDFFF)) {
+                    report(lexer_error_code::UNICODE_ESCAPE, token_start, token_end, p, brace + 1);
+                    value = 0xFFFD;
+                }
+                traits::put(out, static_cast<char32_t>(value));
+                p = brace + 1;
+            }
+        }
+
+        // returns the operator and, only when no operator matched, the end
+        // of the unmatched text, `current` is not moved then
+        template <typename UnitT>
+        std::pair<const UnitT *, operator_type> consume_operator(const UnitT *&current, const UnitT *end) {
+            // operators never contain separators or identifier chars
+            auto stop = [this](CharT c) {
+                return is_separator_char(c) || is_id_or_kw(c, false);
+            };
+
+            // longest match in one pass
+            COVSCRIPT_LEXER_STAT(const UnitT *furthest = current;)
+            auto next = [&](const UnitT *&p, const UnitT *e) {
+                char32_t c = unit_traits<UnitT>::next(p, e);
+                COVSCRIPT_LEXER_STAT(furthest = std::max(furthest, p);)
+                return c;
+            };
+            auto result = _operators.match(current, end, next, stop);
+            if (result.second != operator_type::UNDEFINED) {
+                COVSCRIPT_LEXER_STAT(++_stats._operator_matches;
+                                     _stats._operator_backtrack_units +=
+                                         static_cast<std::uint64_t>(furthest - result.first);)
+                current = result.first;
+                return result;
+            }
+            COVSCRIPT_LEXER_STAT(++_stats._operator_failures;)
+
+            // be greedy, report everything that could have been an operator
+            const UnitT *most = current;
+            while (most < end) {
+                const UnitT *next = most;
+                if (stop(unit_traits<UnitT>::next(next, end))) {
                     break;
                 }
+                most = next;
             }
 
-            // starts with non-zero or contains floating point: must be dec
-            if (integer_part != 0 || found_point) {
-                // parsing dec number
-                bool after_point = false;
-                int64_t floating_part = 0;
-                int npoints = 1;
+            return std::make_pair(most, operator_type::UNDEFINED);
+        }
 
-                while (current < end) {
-                    if (is_digit_char(*current)) {
-                        if (after_point) {
-                            floating_part = floating_part * 10 + *current++ - U'0';
-                            npoints *= 10;
+        // lex from _position until tokens has `limit` tokens (the last one
+        // no longer waiting for a literal suffix) or the source ends.
+        // when more chunks are coming (!final), only tokens that start before
+        // the last read '\n' are lexed, and a string or char literal running
+        // past the read text is left for the next call.
+        template <typename UnitT>
+        void lex_units(token_stream &tokens, std::size_t limit, bool final) {
+            using iter_t = const UnitT *;
+            using traits = unit_traits<UnitT>;
+
+            iter_t begin = _input.begin<UnitT>();
+            iter_t p = begin + _position._offset;
+            iter_t end = _input.end<UnitT>();
+            iter_t stop = final ? end : std::max(p, begin + _complete_lines);
+
+            while (p < stop && (tokens.size() < limit || _trying_suffix)) {
+                iter_t token_start = p;
+
+                if (_trying_suffix) {
+                    // parse custom literals
+                    _trying_suffix = false;
+                    if (*p != U'_') {
+                        continue;
+                    }
+
+                    scan(dfa_state::START, p, end);
+                    if (tokens.empty()) {
+                        report(lexer_error_code::INTERNAL_SUFFIX_STATE, p, p);
+                        continue;
+                    }
+
+                    switch (tokens.back()._type) {
+                        case token_type::INT_LITERAL:
+                        case token_type::FLOATING_LITERAL:
+                        case token_type::STRING_LITERAL:
+                        case token_type::CHAR_LITERAL:
+                            break;
+                        default:
+                            report(lexer_error_code::SUFFIX_AFTER_NON_LITERAL, token_start, p);
+                            continue;
+                    }
+
+                    tokens.attach_literal_suffix(make_record(token_start, p));
+                    COVSCRIPT_LEXER_STAT(++_stats._tokens[static_cast<std::size_t>(token_type::CUSTOM_LITERAL)];
+                                         _stats._suffix_units += static_cast<std::uint64_t>(p - token_start);)
+                    continue;
+                }
+
+                // directives are only available in the beginning of a line
+                bool line_start = p == begin || p[-1] == static_cast<UnitT>(U'\n');
+                dfa_token token = scan(line_start ? dfa_state::LINE_START : dfa_state::START, p, end);
+                COVSCRIPT_LEXER_STAT(std::size_t pushed = tokens.size();)
+                switch (token) {
+                    case dfa_token::BLANK:
+                    case dfa_token::NEWLINE:
+                        break;
+                    case dfa_token::PREPROCESSOR:
+                        tokens.push_preprocessor(make_record(token_start, p));
+                        break;
+                    case dfa_token::IDENTIFIER:
+                        tokens.push_id_or_kw(make_record(token_start, p), intern(token_start, p));
+                        break;
+                    case dfa_token::INT_BEFORE_E:
+                    case dfa_token::INT_DEC:
+                    case dfa_token::INT_HEX:
+                    case dfa_token::INT_BIN:
+                    case dfa_token::INT_OCT: {
+                        if (token == dfa_token::INT_BEFORE_E) {
+                            p = exponent_mark(p);
+                        }
+                        // kept with a zero value when recovering
+                        std::int64_t value = 0;
+                        if (!int_value(token, token_start, p, value)) {
+                            report(lexer_error_code::INT_TOO_LARGE, token_start, p);
+                        }
+                        tokens.push_int_literal(make_record(token_start, p), value);
+                        _trying_suffix = true;
+                        break;
+                    }
+                    case dfa_token::FLOAT_BEFORE_E:
+                    case dfa_token::FLOAT: {
+                        if (token == dfa_token::FLOAT_BEFORE_E) {
+                            p = exponent_mark(p);
+                        }
+                        double value = parse_float_literal(token_start, p);
+                        if (std::isinf(value)) {
+                            report(lexer_error_code::FLOAT_OUT_OF_RANGE, token_start, p);
+                            value = 0;
+                        }
+                        tokens.push_float_literal(make_record(token_start, p), value);
+                        _trying_suffix = true;
+                        break;
+                    }
+                    case dfa_token::STRING:
+                        tokens.push_string_literal(make_record(token_start, p));
+                        _trying_suffix = true;
+                        break;
+                    case dfa_token::ESCAPED_STRING: {
+                        auto &value = literal_buffer(p);
+                        decode_string(token_start, p, value);
+                        tokens.push_string_literal(make_record(token_start, p),
+                                                   reinterpret_cast<iter_t>(value.data()), value.size());
+                        _trying_suffix = true;
+                        break;
+                    }
+                    case dfa_token::CHAR:
+                        tokens.push_char_literal(make_record(token_start, p), char_value(token_start, p));
+                        _trying_suffix = true;
+                        break;
+                    case dfa_token::ERROR_EOF:
+                        if (!final) {
+                            // wait for the rest of it
+                            p = stop = token_start;
+                            break;
+                        }
+                        report(lexer_error_code::UNEXPECTED_EOF, token_start, p);
+                        break;
+                    case dfa_token::ERROR_STRING_ESCAPE:
+                    case dfa_token::ERROR_UNICODE_ESCAPE: {
+                        // the string still ends at its closing quote,
+                        // later bad escapes in it are not reported again.
+                        // the char after a `\` is part of the escape, the
+                        // one that ends a \u{ is not, it may be the quote.
+                        auto skip = [&](dfa_token escape, iter_t bad) {
+                            if (escape == dfa_token::ERROR_STRING_ESCAPE) {
+                                traits::next(bad, end);
+                            }
+                            return bad;
+                        };
+                        iter_t bad = p;
+                        iter_t after = skip(token, p);
+                        iter_t rest = after;
+                        dfa_token tail;
+                        while ((tail = scan(dfa_state::STRING, rest, end)) == dfa_token::ERROR_STRING_ESCAPE
+                               || tail == dfa_token::ERROR_UNICODE_ESCAPE) {
+                            rest = skip(tail, rest);
+                        }
+                        if (tail == dfa_token::ERROR_EOF && !final) {
+                            p = stop = token_start;
+                            break;
+                        }
+                        if (token == dfa_token::ERROR_STRING_ESCAPE) {
+                            report(lexer_error_code::STRING_ESCAPE, token_start, bad, bad, after);
                         } else {
-                            integer_part = integer_part * 10 + *current++ - U'0';
+                            // back to the `\`, an escape is ASCII
+                            iter_t escape = bad;
+                            while (*--escape != U'\\') {
+                            }
+                            report(lexer_error_code::UNICODE_ESCAPE, token_start, bad, escape, bad);
+                        }
+                        p = rest;
+                        if (tail == dfa_token::ERROR_EOF) {
+                            report(lexer_error_code::UNEXPECTED_EOF, token_start, p);
                         }
-                    } else if (*current == U'.') {
-                        after_point = true;
-                        current++;
-                    } else {
-                        // consumed the number
+                        break;
+                    }
+                    case dfa_token::ERROR_CHAR_ESCAPE:
+                    case dfa_token::ERROR_EMPTY:
+                    case dfa_token::ERROR_ENCLOSING: {
+                        iter_t next = resync(p, end);
+                        if (next == end && !final) {
+                            // where to go on may not be read yet
+                            p = stop = token_start;
+                            break;
+                        }
+                        if (token == dfa_token::ERROR_CHAR_ESCAPE) {
+                            iter_t after = p;
+                            traits::next(after, end);
+                            report(lexer_error_code::CHAR_ESCAPE, token_start, p, p, after);
+                        } else {
+                            report(token == dfa_token::ERROR_EMPTY ? lexer_error_code::EMPTY_CHAR
+                                                                   : lexer_error_code::UNCLOSED_CHAR,
+                                   token_start, p);
+                        }
+                        p = next;
+                        break;
+                    }
+                    case dfa_token::OPERATOR: {
+                        auto value = consume_operator(p, end);
+                        if (value.second == operator_type::UNDEFINED) {
+                            // at least one char, even when nothing could be an operator
+                            iter_t next = value.first;
+                            if (next == p) {
+                                traits::next(next, end);
+                            }
+                            next = resync(next, end);
+                            if (next == end && !final) {
+                                p = stop = token_start;
+                                break;
+                            }
+                            report(lexer_error_code::UNEXPECTED_TOKEN, token_start, p, p, value.first);
+                            p = next;
+                            break;
+                        }
+                        tokens.push_operator(make_record(token_start, p), value.second);
                         break;
                     }
                 }
+                COVSCRIPT_LEXER_STAT(
+                    _stats._units[static_cast<std::size_t>(token)] += static_cast<std::uint64_t>(p - token_start);
+                    if (tokens.size() > pushed) {
+                        ++_stats._tokens[static_cast<std::size_t>(tokens.back()._type)];
+                    })
+            }
 
-                if (after_point) {
-                    double value = integer_part + 1.0 * floating_part / npoints;
-                    _state.new_state(lexer_state::FLOATING_LIT);
-                    return std::make_pair(0, value);
-                } else {
-                    _state.new_state(lexer_state::INT_LIT);
-                    return std::make_pair(integer_part, 0);
-                }
+            if (final && p == end) {
+                // no suffix can follow the last literal
+                _trying_suffix = false;
             }
+            _position._offset = static_cast<std::size_t>(p - begin);
+        }
 
-            // starts with 0x/0b/0
-            // must be int
-            _state.new_state(lexer_state::INT_LIT);
-
-            if (*current == U'x' || *current == U'X') {
-                // parsing hex number
-                ++current;
-                while (current < end && ((*current >= U'0' && *current <= U'9')
-                                         || (*current >= U'a' && *current <= U'f')
-                                         || (*current >= U'A' && *current <= U'F'))) {
-                    integer_part = integer_part * 16
-                                   + (*current & 15U)
-                                   + (*current >= U'A' ? 9 : 0);
-                    ++current;
+        void lex_some(token_stream &tokens, std::size_t limit) {
+            if (!_input.buffer()) {
+                // no source yet
+                return;
+            }
+            while (true) {
+                bool final = !_reader || _reader->eof();
+                std::size_t offset = _position._offset;
+                {
+                    COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::LEX);)
+                    if (_engine == lexer_engine::UTF8) {
+                        lex_units<unsigned char>(tokens, limit, final);
+                    } else {
+                        lex_units<char32_t>(tokens, limit, final);
+                    }
                 }
 
-                return std::make_pair(integer_part, 0);
-
-            } else if (*current == U'b' || *current == U'B') {
-                // parsing binary number
-                ++current;
-                while (current < end && (*current == U'0' || *current == U'1')) {
-                    integer_part = integer_part * 2 + *current - U'0';
-                    ++current;
+                if (final || (tokens.size() >= limit
+                              && !_trying_suffix)) {
+                    return;
                 }
-
-                return std::make_pair(integer_part, 0);
-
-            } else {
-                // parsing oct number
-                while (current < end && *current >= U'0' && *current <= U'7') {
-                    integer_part = integer_part * 8 + *current - U'0';
-                    ++current;
+                if (offset == _position._offset) {
+                    // not even one token fits in what we have
+                    _reader->grow();
                 }
-
-                return std::make_pair(integer_part, 0);
+                read_chunk();
             }
         }
 
-        std::string consume_string_lit(iter_t &current, iter_t end) {
-            if (*current == U'"') {
-                ++current;
+        // Lex [start, stop) as if start were the beginning of a line with
+        // no literal before it. Lines are counted from 1 at start, tokens starting
+        // before stop are lexed completely even if they run past it.
+        template <typename UnitT>
+        void lex_chunk(std::size_t start, std::size_t stop, chunk_result &result) const {
+            basic_lexer worker(*this, worker_tag{});
+            worker._position = lexer_position{start};
+            worker._complete_lines = stop;
+            result._tokens.source(_input.buffer());
+            try {
+                // never final: an unterminated literal rewinds instead of
+                // failing, it may just be a guess that started inside a string
+                worker.lex_units<UnitT>(result._tokens, std::numeric_limits<std::size_t>::max(), false);
+            } catch (const lexer_error &e) {
+                result._error.reset(new lexer_error(e));
+            } catch (...) {
+                result._other_error = std::current_exception();
             }
+            result._end = worker._position;
+            result._trying_suffix = worker._trying_suffix;
+            result._symbols = std::move(worker._symbols);
+            COVSCRIPT_LEXER_STAT(result._stats = worker._stats;)
+        }
 
-            // string start
-            iter_t left = current;
-            _state.new_state(lexer_state::PARSING_STRING);
-
-            bool escape = false;
-            while (current < end && _state.current() == lexer_state::PARSING_STRING) {
-                if (escape) {
-                    if (is_escape_char(*current)) {
-                        escape = false;
-                        ++current;
-                    } else {
-                        // invalid escape char
-                        _state.replace(lexer_state::ERROR_ESCAPE);
+        template <typename UnitT>
+        void lex_parallel_units(token_stream &tokens, std::size_t threads) {
+            const UnitT *begin = _input.begin<UnitT>();
+            const UnitT *end = _input.end<UnitT>();
+            auto length = static_cast<std::size_t>(end - begin);
+
+            // chunks start just after a '\n'
+            std::size_t nchunks = threads * parallel_chunks_per_thread;
+            std::vector<std::size_t> starts{0};
+            for (std::size_t i = 1; i < nchunks; ++i) {
+                std::size_t pos = std::max(length / nchunks * i, starts.back());
+                const UnitT *newline = std::find(begin + pos, end, static_cast<UnitT>(U'\n'));
+                if (newline == end || newline + 1 == end) {
+                    break;
+                }
+                starts.push_back(static_cast<std::size_t>(newline + 1 - begin));
+            }
+            starts.push_back(length);
+
+            // lex_chunk keeps what a chunk throws in its result
+            std::vector<chunk_result> results(starts.size() - 1);
+            work_stealing_pool::run(results.size(), threads, [&](std::size_t, std::size_t k) {
+                lex_chunk<UnitT>(starts[k], starts[k + 1], results[k]);
+            });
+
+            // Merge in order. A chunk's guess holds when the previous chunk
+            // stopped exactly at its start, not waiting for a suffix, otherwise
+            // (e.g. a string literal ran across the boundary) the chunk is
+            // lexed again, continuing from where the previous one stopped.
+            bool guessed_right = true;
+            for (std::size_t k = 0; k < results.size(); ++k) {
+                auto &result = results[k];
+                // wrong guesses are counted too, the time went into them
+                COVSCRIPT_LEXER_STAT(_stats.merge(result._stats);)
+                if (guessed_right) {
+                    auto symbols = result._symbols.merge_into(_symbols);
+                    tokens.append(result._tokens, 0, result._tokens.size(), token_shift{}, &symbols);
+                    if (result._error) {
+                        throw lexer_error(*result._error);
                     }
-                } else {
-                    switch (*current) {
-                        case U'\\':
-                            escape = true;
-                            ++current;
-                            break;
-                        case U'"':
-                            _state.replace(lexer_state::STRING_LIT);
-                            ++current;
-                            break;
-                        default:
-                            ++current;
-                            break;
+                    if (result._other_error) {
+                        std::rethrow_exception(result._other_error);
                     }
+                    _position = result._end;
+                    _trying_suffix = result._trying_suffix;
+                } else {
+                    _complete_lines = starts[k + 1];
+                    lex_units<UnitT>(tokens, std::numeric_limits<std::size_t>::max(), false);
                 }
+                guessed_right = _position._offset == starts[k + 1]
+                                && !_trying_suffix;
             }
 
-            switch (_state.current()) {
-                case lexer_state::STRING_LIT:
-                    return _charset->wide2local({left, static_cast<std::size_t>(current - left - 1)});
-                case lexer_state::PARSING_STRING:
-                    // unexpected EOF when parsing string
-                    _state.replace(lexer_state::ERROR_EOF);
-                    // fall-through
-                default:
-                    // error happened, reason stored in state
-                    return std::string{};
-            }
+            // report an unterminated literal, or drop the wait for
+            // a suffix after the last literal
+            lex_units<UnitT>(tokens, std::numeric_limits<std::size_t>::max(), true);
+        }
+
+        // where a token starts, for custom literals the literal before the suffix
+        static const token_record &head(const token_stream &tokens, const token_record &r) {
+            return r._type == token_type::CUSTOM_LITERAL ? tokens.custom_literal(r) : r;
         }
 
-        CharT consume_char_lit(iter_t &current, iter_t end) {
-            if (*current == U'\'') {
-                ++current;
+        // tokens were lexed from the source before the edit, the source is
+        // the edited one already.
+        template <typename UnitT>
+        token_change relex_units(token_stream &tokens, std::size_t offset,
+                                 std::size_t removed, std::size_t inserted) {
+            auto start = [&](std::size_t i) -> std::size_t {
+                return head(tokens, tokens[i])._offset;
+            };
+            auto finish = [&](std::size_t i) -> std::size_t {
+                return tokens[i]._offset + tokens[i]._length;
+            };
+
+            // first token touching the edit
+            auto first = static_cast<std::size_t>(std::partition_point(
+                tokens.begin(), tokens.end(), [offset](const token_record &r) {
+                    return r._offset + r._length < offset;
+                }) - tokens.begin());
+            if (first > 0 && (first == tokens.size() || start(first) > offset)) {
+                // the edit is between tokens
+                --first;
             }
+            // operators and literal suffixes may grow over adjacent tokens,
+            // restart after a gap, where nothing before can reach over
+            while (first > 0 && finish(first - 1) == start(first)) {
+                --first;
+            }
+
+            // text before the edit did not move
+            _position = lexer_position{first > 0 ? head(tokens, tokens[first])._offset : 0};
 
-            if (current == end) {
-                _state.new_state(lexer_state::ERROR_EMPTY);
-                return 0;
+            // old tokens after the edit, the new ones may line up with them again
+            auto delta = static_cast<std::int64_t>(inserted) - static_cast<std::int64_t>(removed);
+            std::size_t next_old = first;
+            while (next_old < tokens.size() && start(next_old) < offset + removed) {
+                ++next_old;
             }
 
-            bool escape = false;
-            bool found = false;
+            token_stream fresh;
+            fresh.source(_input.buffer());
+            auto splice = [&](std::size_t old_last, std::size_t fresh_last, const token_shift &shift) {
+                token_stream result;
+                result.source(_input.buffer());
+                result.reserve(first + fresh_last + tokens.size() - old_last);
+                result.append(tokens, 0, first);
+                result.append(fresh, 0, fresh_last);
+                result.append(tokens, old_last, tokens.size(), shift);
+                tokens = std::move(result);
+                return token_change{first, old_last - first, fresh_last};
+            };
+
+            try {
+                while (_position._offset < _input.buffer()->length()) {
+                    lex_units<UnitT>(fresh, fresh.size() + 1, true);
+                    if (fresh.empty()) {
+                        continue;
+                    }
 
-            while (current < end) {
-                if (escape) {
-                    if (is_escape_char(*current)) {
-                        found = true;
-                        break;
-                    } else {
-                        _state.new_state(lexer_state::ERROR_ESCAPE);
-                        return 0;
+                    const token_record &now = head(fresh, fresh.back());
+                    while (next_old < tokens.size()
+                           && static_cast<std::int64_t>(start(next_old)) + delta < now._offset) {
+                        ++next_old;
                     }
-                } else {
-                    if (*current == U'\\') {
-                        escape = true;
-                        ++current;
-                    } else if (*current == U'\'') {
-                        break;
-                    } else {
-                        found = true;
-                        break;
+                    if (next_old == tokens.size()) {
+                        continue;
+                    }
+
+                    // same text from the same state: lexing after this token
+                    // gives the old tokens again, only moved. the unit before
+                    // it decides whether a directive may start there, so it
+                    // must be one the edit did not touch.
+                    const token_record &old = head(tokens, tokens[next_old]);
+                    if (static_cast<std::int64_t>(old._offset) + delta == now._offset
+                        && old._offset > offset + removed) {
+                        return splice(next_old, fresh.size() - 1, token_shift{delta});
                     }
                 }
+            } catch (const lexer_error &) {
+                // keep tokens before the error, just like lex()
+                splice(tokens.size(), fresh.size(), token_shift{});
+                throw;
             }
+            return splice(tokens.size(), fresh.size(), token_shift{});
+        }
 
-            if (!found) {
-                // no char was found
-                _state.new_state(current == end ? lexer_state::ERROR_EOF : lexer_state::ERROR_EMPTY);
-                return 0;
+        void read_chunk() {
+            COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::SOURCE);)
+            std::string chunk = _reader->next(_engine == lexer_engine::WIDE);
+            if (_engine == lexer_engine::UTF8) {
+                std::size_t newline = chunk.rfind('\n');
+                if (newline != std::string::npos) {
+                    _complete_lines = _growing->length() + newline + 1;
+                }
+                _growing->append(chunk.data(), chunk.length());
+            } else {
+                // whole lines only
+                COVSCRIPT_LEXER_STAT(++_stats._local2wide_calls; _stats._local2wide_bytes += chunk.length();)
+                _decoded.clear();
+                _transcoder.decode(chunk.data(), chunk.length(), _decoded);
+                _growing->append(_decoded);
+                _complete_lines = _growing->length();
             }
-
-            CharT lit = *current++;
-            if (current == end) {
-                // there's one more `'`
-                _state.new_state(lexer_state::ERROR_EOF);
-                return 0;
+            if (_growing->length() > std::numeric_limits<std::uint32_t>::max()) {
+                mpp::throw_ex<std::length_error>("source too large for token records");
             }
+        }
 
-            if (*current != '\'') {
-                // there's one more `'`
-                _state.new_state(lexer_state::ERROR_ENCLOSING);
-                return 0;
-            }
+        bool finished() const {
+            return !_input.buffer()
+                   || (_position._offset == _input.buffer()->length() && (!_reader || _reader->eof()));
+        }
 
-            // consume the closing `'`
-            ++current;
-            _state.new_state(lexer_state::CHAR_LIT);
-            return escape ? to_escaped_char(lit) : lit;
+        void source_chunked(std::unique_ptr<chunk_reader> reader) {
+            _reader = std::move(reader);
+            if (_engine == lexer_engine::UTF8) {
+                _growing = std::make_shared<source_buffer>(std::string{}, _charset);
+            } else {
+                _growing = std::make_shared<source_buffer>(std::u32string{}, _charset);
+            }
+            _complete_lines = 0;
+            _input.source(_growing);
+            restart();
         }
 
-        std::string consume_id_or_kw(iter_t &current, iter_t end) {
-            // start part
-            iter_t left = current++;
-            while (current < end && is_id_or_kw(*current, false)) {
-                ++current;
+        // With chunked input, go on with a copy of the source from the line
+        // the window starts on, once at least half of the text is before it.
+        // The window and the scan are moved onto the copy.
+        void drop_consumed() {
+            if (!_growing) {
+                return;
+            }
+            std::size_t keep = _position._offset;
+            if (!_window.empty()) {
+                keep = std::min<std::size_t>(keep, head(_window, _window[0])._offset);
             }
-            return _charset->wide2local({left, static_cast<std::size_t>(current - left)});
+            if (keep < _growing->length() / 2) {
+                return;
+            }
+            // whole lines, columns are counted from the line start
+            std::uint32_t start = _growing->line_start(static_cast<std::uint32_t>(keep));
+            if (start < _growing->length() / 2) {
+                return;
+            }
+            _growing = _growing->tail(start);
+            _input.source(_growing);
+            _window.source(_growing);
+            _window.rebase(token_shift{-static_cast<std::int64_t>(start)});
+            _position._offset -= start;
+            _complete_lines -= start;
         }
 
-        std::pair<std::string, operator_type> consume_operator(iter_t &current, iter_t end) {
-            iter_t left = current;
+        void restart() {
+            _trying_suffix = false;
+            _position = lexer_position{};
+            _window.clear();
+            _window.source(_input.buffer());
+            _window_pos = 0;
+        }
 
-            // be greedy, be lookahead
-            while (current < end
-                   && !is_separator_char(*current)
-                   && !is_id_or_kw(*current, false)) {
-                ++current;
+    public:
+        // the UTF8 engine requires a UTF-8 charset, source text is used as is
+        explicit basic_lexer(std::unique_ptr<Charset> charset,
+                             lexer_engine engine = lexer_engine::WIDE)
+            : _engine(engine), _charset(std::move(charset)), _transcoder(_charset),
+              _classes(char_class_table::of(*_charset)),
+              _utf8_names(std::is_same<Charset, mpp::codecvt::utf8>::value
+                          || dynamic_cast<mpp::codecvt::utf8 *>(_charset.get()) != nullptr) {
+            if (_engine == lexer_engine::UTF8 && !utf8_names()) {
+                mpp::throw_ex<std::invalid_argument>("UTF8 lexer engine requires utf8 charset");
             }
+        }
 
-            iter_t most = current;
-            while (current != left) {
-                std::string op = _charset->wide2local({left, static_cast<std::size_t>(current - left)});
-                auto iter = _op_maps.find(op);
-                if (iter != _op_maps.end()) {
-                    _state.new_state(lexer_state::OPERATOR);
-                    return std::make_pair(op, iter->second);
+        lexer_engine engine() const {
+            return _engine;
+        }
+
+        void source(const std::string &str) {
+            COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::SOURCE);)
+            _reader.reset();
+            _growing.reset();
+            if (_engine == lexer_engine::UTF8) {
+                if (str.length() > std::numeric_limits<std::uint32_t>::max()) {
+                    mpp::throw_ex<std::length_error>("source too large for token records");
                 }
-                // lookahead failed, try previous one
-                --current;
+                _input.source(std::make_shared<source_buffer>(str, _charset));
+                restart();
+                return;
             }
 
-            _state.new_state(lexer_state::ERROR_OPERATOR);
-            return std::make_pair(
-                _charset->wide2local({left, static_cast<std::size_t>(most - left)}),
-                operator_type::UNDEFINED);
+            COVSCRIPT_LEXER_STAT(++_stats._local2wide_calls; _stats._local2wide_bytes += str.length();)
+            std::u32string wide;
+            _transcoder.decode(str.data(), str.length(), wide);
+            if (wide.length() > std::numeric_limits<std::uint32_t>::max()) {
+                mpp::throw_ex<std::length_error>("source too large for token records");
+            }
+            _input.source(std::make_shared<source_buffer>(std::move(wide), _charset));
+            restart();
         }
 
-        std::string try_consume_literal_suffix(std::deque<std::unique_ptr<token>> &tokens,
-                                               std::size_t line_no, iter_t line_start,
-                                               iter_t &current, iter_t end) {
-            // got literal suffix
-            if (*current != U'_') {
-                return std::string{};
+        // Regular files are mapped into memory and the UTF8 engine lexes the
+        // mapping directly. Anything else (pipes, devices), and every file
+        // for the WIDE engine, is read and decoded by chunks as lexing goes
+        // on, so the pull API never holds the whole decoded text.
+        void source_file(const std::string &path, std::size_t chunk_size = 64 * 1024) {
+            COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::SOURCE);)
+            auto file = _engine == lexer_engine::UTF8 ? mapped_file::open(path) : nullptr;
+            if (!file) {
+                std::unique_ptr<std::ifstream> in(new std::ifstream(path, std::ios::binary));
+                if (!in->is_open()) {
+                    throw std::runtime_error("cannot open source file: " + path);
+                }
+                source_chunked(std::unique_ptr<chunk_reader>(new chunk_reader(
+                    std::unique_ptr<std::istream>(std::move(in)), chunk_size)));
+                return;
             }
 
-            auto value = consume_id_or_kw(current, end);
-            _state.new_state(lexer_state::LITERAL_SUFFIX);
-            return value;
-        }
+            if (file->length() > std::numeric_limits<std::uint32_t>::max()) {
+                mpp::throw_ex<std::length_error>("source too large for token records");
+            }
 
-    public:
-        explicit lexer(std::unique_ptr<mpp::codecvt::charset> charset)
-            : _charset(std::move(charset)) {
+            _reader.reset();
+            _growing.reset();
+            _input.source(std::make_shared<source_buffer>(file->data(), file->length(), file, _charset));
+            restart();
         }
 
-        void source(const std::string &str) {
-            _input.source(_charset->local2wide(str));
+        // read a stream (e.g. std::cin) chunk by chunk while lexing,
+        // the stream must outlive the lexing.
+        void source_stream(std::istream &in, std::size_t chunk_size = 64 * 1024) {
+            source_chunked(std::unique_ptr<chunk_reader>(new chunk_reader(in, chunk_size)));
         }
 
+        // an operator that was already added keeps its first type
         void add_operators(const std::unordered_map<std::string, operator_type> &ops) {
-            _op_maps.insert(ops.begin(), ops.end());
+            for (const auto &op : ops) {
+                COVSCRIPT_LEXER_STAT(++_stats._local2wide_calls; _stats._local2wide_bytes += op.first.length();)
+                _operators.add(op.first, _transcoder.decode(op.first), op.second);
+            }
         }
 
-        void lex(std::deque<std::unique_ptr<token>> &tokens) {
-            iter_t p = _input.begin();
-            iter_t end = _input.end();
-
-            // current line start position
-            std::size_t line_no = 1;
-            iter_t line_start = p;
-
-            while (p < end) {
-                /////////////////////////////////////////////////////////////////
-                // special position
-                /////////////////////////////////////////////////////////////////
-                // tokens only available in the beginning of a line
-                if (line_start == p) {
-                    if (*p == U'#' || *p == U'@') {
-                        // comment and preprocessor tag in CovScript 3
-                        iter_t token_start = p;
-                        auto value = consume_preprocessor(p, end);
-                        switch (_state.pop()) {
-                            case lexer_state::PREPROCESSOR:
-                                tokens.push_back(make_token<token_preprocessor>(line_no, line_start,
-                                    token_start, p, value));
-                                break;
-                            default:
-                                error(line_no, line_start, token_start, p,
-                                    "<internal error>: illegal state in preprocessor tag");
-                        }
-                        continue;
-                    }
-                }
+        const OperatorTable &operators() const {
+            return _operators;
+        }
 
-                /////////////////////////////////////////////////////////////////
-                // special state
-                /////////////////////////////////////////////////////////////////
-                if (_state.current() == lexer_state::TRYING_LITERAL_SUFFIX) {
-                    // parse custom literals
-                    _state.end(lexer_state::TRYING_LITERAL_SUFFIX);
+        // names of the symbols in ID_OR_KW tokens, they stay the
+        // same for the lifetime of the lexer
+        const symbol_table &symbols() const {
+            return _symbols;
+        }
 
-                    // lookahead and parse literal suffix
-                    iter_t token_start = p;
-                    auto value = try_consume_literal_suffix(tokens, line_no, line_start, p, end);
+        // what this lexer did so far, all zero unless built with COVSCRIPT_LEXER_STATS
+        const lexer_stats &stats() const {
+            return _stats;
+        }
 
-                    if (_state.current() == lexer_state::LITERAL_SUFFIX) {
-                        _state.end(lexer_state::LITERAL_SUFFIX);
-                        if (tokens.empty()) {
-                            error(line_no, line_start, p, p,
-                                "<internal error>: illegal state in literal suffix");
-                        }
+        void reset_stats() {
+            _stats = lexer_stats{};
+        }
 
-                        switch (tokens.back()->_type) {
-                            case token_type::INT_LITERAL:
-                            case token_type::FLOATING_LITERAL:
-                            case token_type::STRING_LITERAL:
-                            case token_type::CHAR_LITERAL:
-                                break;
-                            default:
-                                error(line_no, line_start, token_start, p,
-                                    "unsupported literal suffix {} after non-literal", value);
-                        }
+        void lex(std::deque<std::unique_ptr<token>> &tokens) {
+            token_stream stream;
+            try {
+                lex(stream);
+            } catch (const lexer_error &) {
+                // keep tokens before the error, just like before
+                stream.to_tokens(tokens);
+                throw;
+            }
+            COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::TO_TOKENS);)
+            stream.to_tokens(tokens);
+        }
 
-                        auto literal = std::move(tokens.back());
-                        tokens.pop_back();
-                        tokens.push_back(make_token<token_custom_literal>(
-                            line_no, line_start, token_start, p,
-                            std::move(literal), value));
-                    }
-                    continue;
-                }
+        // tokens only keep spans into the source, local-encoded
+        // text is made when asked through the stream.
+        // always lexes the whole source and resets the pull API.
+        void lex(token_stream &tokens) {
+            restart();
+            tokens.source(_input.buffer());
+            lex_some(tokens, std::numeric_limits<std::size_t>::max());
+        }
 
-                /////////////////////////////////////////////////////////////////
-                // global state
-                /////////////////////////////////////////////////////////////////
+        // Recovery mode: errors are kept in `diagnostics` instead of thrown,
+        // lexing goes on at the next separator or newline after one, so a
+        // single pass finds every error. A literal too large for its type
+        // is kept with a zero value.
+        void lex(token_stream &tokens, lexer_diagnostics &diagnostics) {
+            diagnostics.clear();
+            diagnostics.source(_input.buffer());
+            _diagnostics = &diagnostics;
+            try {
+                lex(tokens);
+            } catch (...) {
+                // e.g. reading chunked input failed
+                _diagnostics = nullptr;
+                throw;
+            }
+            _diagnostics = nullptr;
+        }
 
-                // if we meet \n
-                if (*p == U'\n') {
-                    ++line_no;
-                    line_start = ++p;
-                    continue;
+        // Same tokens as lex(), taken from the cache when the same text was
+        // lexed before with the same engine and operators, possibly by another
+        // process. Chunked input is read completely first. Sources that fail
+        // to lex are not cached.
+        void lex(token_stream &tokens, token_cache &cache) {
+            if (!_input.buffer()) {
+                lex(tokens);
+                return;
+            }
+            if (_reader) {
+                while (!_reader->eof()) {
+                    read_chunk();
                 }
+            }
 
-                // skip separators
-                if (is_separator_char(*p)) {
-                    ++p;
-                    continue;
+            const source_buffer &source = *_input.buffer();
+            restart();
+            tokens.source(_input.buffer());
+            token_cache_key key;
+            {
+                COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::CACHE);)
+                // the engine and the charset names and strings are encoded
+                // with decide the token values
+                auto engine = static_cast<std::uint64_t>(_engine);
+                std::string charset = typeid(*_charset).name();
+                key = _engine == lexer_engine::UTF8
+                    ? token_cache::make_key(source.data<unsigned char>(), source.length(), source.length(),
+                                            engine, charset, operator_fingerprint(_operators))
+                    : token_cache::make_key(source.data<char32_t>(), source.length() * sizeof(char32_t),
+                                            source.length(), engine, charset, operator_fingerprint(_operators));
+                if (cache.load(key, _symbols, tokens)) {
+                    _position._offset = source.length();
+                    return;
                 }
+            }
+            bool fresh = tokens.empty();
+            lex_some(tokens, std::numeric_limits<std::size_t>::max());
+            // a stream that had tokens before holds more than this source
+            if (fresh) {
+                COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::CACHE);)
+                cache.store(key, tokens, _symbols);
+            }
+        }
 
-                // digit
-                if (is_digit_char(*p)) {
-                    iter_t token_start = p;
-                    auto result = consume_number(p, end);
-                    switch (_state.pop()) {
-                        case lexer_state::INT_LIT:
-                            tokens.push_back(make_token<token_int_literal>(
-                                line_no, line_start, token_start, p, result.first));
-                            // try parse literal suffix
-                            _state.new_state(lexer_state::TRYING_LITERAL_SUFFIX);
-                            break;
-                        case lexer_state::FLOATING_LIT:
-                            tokens.push_back(make_token<token_float_literal>(
-                                line_no, line_start, token_start, p, result.second));
-                            // try parse literal suffix
-                            _state.new_state(lexer_state::TRYING_LITERAL_SUFFIX);
-                            break;
-                        default:
-                            error(line_no, line_start, token_start, p,
-                                "<internal error>: illegal state in number literal");
-                    }
-                    continue;
+        // Same tokens as lex(), but the source is split at line boundaries
+        // and the parts are lexed on up to `threads` threads (0 for one per
+        // core). Chunked input is read completely first.
+        void lex_parallel(token_stream &tokens, std::size_t threads = 0) {
+            if (threads == 0) {
+                threads = std::max(1U, std::thread::hardware_concurrency());
+            }
+            if (_reader && threads > 1) {
+                while (!_reader->eof()) {
+                    read_chunk();
                 }
+            }
+            if (threads == 1 || !_input.buffer() || _input.buffer()->length() < parallel_min_length) {
+                lex(tokens);
+                return;
+            }
 
-                // string literal
-                if (*p == U'"') {
-                    iter_t token_start = p;
-                    auto value = consume_string_lit(p, end);
-                    switch (_state.pop()) {
-                        case lexer_state::STRING_LIT:
-                            tokens.push_back(make_token<token_string_literal>(
-                                line_no, line_start, token_start, p, value));
-                            // try parse literal suffix
-                            _state.new_state(lexer_state::TRYING_LITERAL_SUFFIX);
-                            break;
-                        case lexer_state::ERROR_EOF:
-                            printf("unexpected EOF\n");
-                            error(line_no, line_start, token_start, p,
-                                "unexpected EOF");
-                        case lexer_state::ERROR_ESCAPE:
-                            error(line_no, line_start, token_start, p,
-                                "unsupported escape char: \\{}", *p);
-                        default:
-                            error(line_no, line_start, token_start, p,
-                                "<internal error>: illegal state in string literal");
-                    }
-                    continue;
-                }
+            restart();
+            tokens.source(_input.buffer());
+            COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::LEX);)
+            if (_engine == lexer_engine::UTF8) {
+                lex_parallel_units<unsigned char>(tokens, threads);
+            } else {
+                lex_parallel_units<char32_t>(tokens, threads);
+            }
+        }
 
-                // char literal
-                if (*p == U'\'') {
-                    iter_t token_start = p;
-                    auto ch = consume_char_lit(p, end);
-                    switch (_state.pop()) {
-                        case lexer_state::CHAR_LIT:
-                            tokens.push_back(make_token<token_char_literal>(
-                                line_no, line_start, token_start, p, ch));
-                            // try parse literal suffix
-                            _state.new_state(lexer_state::TRYING_LITERAL_SUFFIX);
-                            break;
-                        case lexer_state::ERROR_EOF:
-                            printf("unexpected EOF\n");
-                            error(line_no, line_start, token_start, p,
-                                "unexpected EOF");
-                        case lexer_state::ERROR_ESCAPE:
-                            error(line_no, line_start, token_start, p,
-                                "unsupported escape char: `\\{}`", *p);
-                        case lexer_state::ERROR_EMPTY:
-                            error(line_no, line_start, token_start, p,
-                                "empty char is not allowed");
-                        case lexer_state::ERROR_ENCLOSING:
-                            error(line_no, line_start, token_start, p,
-                                "unclosed char literal, expected `'`");
-                        default:
-                            error(line_no, line_start, token_start, p,
-                                "<internal error>: illegal state in char literal");
-                    }
-                    continue;
+        // Replace [offset, offset + removed) of the source with local-encoded
+        // text and bring tokens, lexed from the source before, up to date.
+        // Only tokens from a safe restart point before the edit are lexed
+        // again, until they line up with the old ones; the rest are moved.
+        // Offsets are in code units like token offsets (chars for the WIDE
+        // engine, bytes for UTF8). The pull API starts over on the edited source.
+        token_change relex(token_stream &tokens, std::size_t offset, std::size_t removed,
+                           const std::string &inserted) {
+            COVSCRIPT_LEXER_STAT(lexer_stats_timer timer(_stats, lexer_phase::RELEX);)
+            if (_reader) {
+                while (!_reader->eof()) {
+                    read_chunk();
                 }
+                _reader.reset();
+                _growing.reset();
+            }
+            if (!_input.buffer() || tokens.source() != _input.buffer()) {
+                mpp::throw_ex<std::invalid_argument>("tokens were not lexed from the current source");
+            }
 
-                // id or kw
-                if (is_id_or_kw(*p, true)) {
-                    iter_t token_start = p;
-                    auto value = consume_id_or_kw(p, end);
-                    tokens.push_back(make_token<token_id_or_kw>(
-                        line_no, line_start, token_start, p, value));
-                    continue;
-                }
+            std::size_t length = _input.buffer()->length();
+            if (offset > length || removed > length - offset) {
+                mpp::throw_ex<std::out_of_range>("edit out of source range");
+            }
+            COVSCRIPT_LEXER_STAT(if (_engine == lexer_engine::WIDE) {
+                ++_stats._local2wide_calls;
+                _stats._local2wide_bytes += inserted.length();
+            })
+            auto edited = _input.buffer()->edit(offset, removed, inserted);
+            if (edited->length() > std::numeric_limits<std::uint32_t>::max()) {
+                mpp::throw_ex<std::length_error>("source too large for token records");
+            }
+            std::size_t inserted_length = edited->length() + removed - length;
+
+            _input.source(edited);
+            restart();
+            token_change change = _engine == lexer_engine::UTF8
+                                  ? relex_units<unsigned char>(tokens, offset, removed, inserted_length)
+                                  : relex_units<char32_t>(tokens, offset, removed, inserted_length);
+            restart();
+            return change;
+        }
 
-                iter_t token_start = p;
-                // we have operators
-                auto value = consume_operator(p, end);
-                switch (_state.pop()) {
-                    case lexer_state::OPERATOR:
-                        tokens.push_back(make_token<token_operator>(
-                            line_no, line_start, token_start, p, value.first, value.second));
-                        break;
-                    case lexer_state::ERROR_OPERATOR:
-                        error(line_no, line_start, token_start, p,
-                            "unexpected token '{}'", value.first);
-                    default:
-                        error(line_no, line_start, token_start, p,
-                            "<internal error>: illegal state in post-done lex");
+        // Pull API: tokens are lexed on demand and only a small window of
+        // them is kept, with the values of its string literals. Chunked
+        // input also drops the lines before the window as they are read
+        // past, so lexing a pipe keeps about two chunks or the longest line,
+        // and a later lex() only sees the rest. Symbols are kept.
+        // Returned records and window() stay valid until the next call to
+        // next_token() or peek(). Returns nullptr at the end of source.
+        const token_record *next_token() {
+            const token_record *tok = peek(0);
+            if (tok != nullptr) {
+                ++_window_pos;
+            }
+            return tok;
+        }
+
+        // look at the n-th token after the current one without consuming it
+        const token_record *peek(std::size_t n) {
+            if (_window_pos == _window.size() || _window_pos >= window_compact_threshold) {
+                _window.erase_front(_window_pos);
+                _window_pos = 0;
+                drop_consumed();
+            }
+            while (_window.size() - _window_pos <= n) {
+                if (finished()) {
+                    return nullptr;
                 }
+                lex_some(_window, _window.size() + 1);
             }
+            return &_window[_window_pos + n];
+        }
+
+        // payloads and text of tokens returned by next_token() and peek()
+        const token_stream &window() const {
+            return _window;
         }
     };
+
+    // charset and operators configured at runtime
+    using lexer = basic_lexer<mpp::codecvt::charset, operator_trie>;
+
+    // UTF-8 and the default operators, fixed at compile time
+    using utf8_lexer = basic_lexer<mpp::codecvt::utf8, default_operator_set>;
 }
 
 namespace cs {
+    using cs_impl::basic_lexer;
     using cs_impl::lexer;
+    using cs_impl::utf8_lexer;
 }
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // token specification
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // states of the scanner, STOP means the token ended before the char
+    enum class dfa_state : std::uint8_t {
+        STOP,
+        START,
+        // START at the beginning of a line, where directives are allowed
+        LINE_START,
+        BLANK,
+        NEWLINE,
+        PREPROCESSOR,
+        IDENTIFIER,
+        ZERO,
+        DEC,
+        FRAC,
+        HEX,
+        BIN,
+        OCT,
+        // e and an optional sign after an int, or after a fraction
+        INT_EXP_MARK,
+        INT_EXP_SIGN,
+        EXP_MARK,
+        EXP_SIGN,
+        EXP,
+        STRING,
+        STRING_ESCAPE,
+        // \u{...} in a string
+        UNICODE_OPEN,
+        UNICODE_FIRST,
+        UNICODE_HEX,
+        STRING_END,
+        // the rest of a string after an escape
+        ESCAPED,
+        ESCAPED_END,
+        CHAR_OPEN,
+        CHAR_ESCAPE,
+        CHAR_BODY,
+        CHAR_END,
+        COUNT,
+    };
+
+    // what the scanned text is, by the state the scan ended in
+    enum class dfa_token : std::uint8_t {
+        // nothing consumed, the operator table takes over
+        OPERATOR,
+        BLANK,
+        NEWLINE,
+        PREPROCESSOR,
+        IDENTIFIER,
+        INT_DEC,
+        INT_HEX,
+        INT_BIN,
+        INT_OCT,
+        FLOAT,
+        // an int or a float followed by an e that starts no exponent,
+        // e.g. 2em, the number ends before the e
+        INT_BEFORE_E,
+        FLOAT_BEFORE_E,
+        STRING,
+        // a string with escapes, its value must be decoded
+        ESCAPED_STRING,
+        CHAR,
+
+        ERROR_EOF,
+        ERROR_STRING_ESCAPE,
+        ERROR_UNICODE_ESCAPE,
+        ERROR_CHAR_ESCAPE,
+        ERROR_EMPTY,
+        ERROR_ENCLOSING,
+    };
+
+    // bulk kernel that may run before the next lookup, it only ever
+    // skips chars the state loops on
+    enum class dfa_skip : std::uint8_t {
+        NONE,
+        BLANK,
+        IDENTIFIER,
+        STRING,
+        LINE,
+    };
+
+    // Char columns of the table: ASCII chars are their own column, the
+    // others are either identifier chars of the charset or not. ASCII
+    // identifier chars are fixed to [A-Za-z0-9_$] by the rules below.
+    constexpr std::size_t dfa_columns = 130;
+    constexpr std::size_t dfa_wide_identifier = 128;
+    constexpr std::size_t dfa_wide_other = 129;
+
+    struct dfa_state_def {
+        dfa_state _state;
+        // token when the next char has no transition
+        dfa_token _stop;
+        // token when the source ends
+        dfa_token _eof;
+        dfa_skip _skip;
+    };
+
+    // `_chars` is a set of ASCII chars, `a-z` is a range.
+    // \x01 stands for non-ASCII identifier chars, \x02 for other non-ASCII
+    // chars and \x03 for every char. Later rules override earlier ones.
+    struct dfa_rule {
+        dfa_state _from;
+        const char *_chars;
+        dfa_state _to;
+    };
+
+#define COVSCRIPT_DFA_ID_START "A-Za-z_$\x01"
+#define COVSCRIPT_DFA_ID_PART  "A-Za-z0-9_$\x01"
+#define COVSCRIPT_DFA_ESCAPE   "rntbfv\\\"'"
+
+    constexpr dfa_state_def default_token_states[] = {
+        {dfa_state::START,         dfa_token::OPERATOR,            dfa_token::OPERATOR,        dfa_skip::NONE},
+        {dfa_state::LINE_START,    dfa_token::OPERATOR,            dfa_token::OPERATOR,        dfa_skip::NONE},
+        {dfa_state::BLANK,         dfa_token::BLANK,               dfa_token::BLANK,           dfa_skip::BLANK},
+        {dfa_state::NEWLINE,       dfa_token::NEWLINE,             dfa_token::NEWLINE,         dfa_skip::NONE},
+        {dfa_state::PREPROCESSOR,  dfa_token::PREPROCESSOR,        dfa_token::PREPROCESSOR,    dfa_skip::LINE},
+        {dfa_state::IDENTIFIER,    dfa_token::IDENTIFIER,          dfa_token::IDENTIFIER,      dfa_skip::IDENTIFIER},
+        {dfa_state::ZERO,          dfa_token::INT_OCT,             dfa_token::INT_OCT,         dfa_skip::NONE},
+        {dfa_state::DEC,           dfa_token::INT_DEC,             dfa_token::INT_DEC,         dfa_skip::NONE},
+        {dfa_state::FRAC,          dfa_token::FLOAT,               dfa_token::FLOAT,           dfa_skip::NONE},
+        {dfa_state::HEX,           dfa_token::INT_HEX,             dfa_token::INT_HEX,         dfa_skip::NONE},
+        {dfa_state::BIN,           dfa_token::INT_BIN,             dfa_token::INT_BIN,         dfa_skip::NONE},
+        {dfa_state::OCT,           dfa_token::INT_OCT,             dfa_token::INT_OCT,         dfa_skip::NONE},
+        {dfa_state::INT_EXP_MARK,  dfa_token::INT_BEFORE_E,        dfa_token::INT_BEFORE_E,    dfa_skip::NONE},
+        {dfa_state::INT_EXP_SIGN,  dfa_token::INT_BEFORE_E,        dfa_token::INT_BEFORE_E,    dfa_skip::NONE},
+        {dfa_state::EXP_MARK,      dfa_token::FLOAT_BEFORE_E,      dfa_token::FLOAT_BEFORE_E,  dfa_skip::NONE},
+        {dfa_state::EXP_SIGN,      dfa_token::FLOAT_BEFORE_E,      dfa_token::FLOAT_BEFORE_E,  dfa_skip::NONE},
+        {dfa_state::EXP,           dfa_token::FLOAT,               dfa_token::FLOAT,           dfa_skip::NONE},
+        {dfa_state::STRING,        dfa_token::ERROR_EOF,           dfa_token::ERROR_EOF,       dfa_skip::STRING},
+        {dfa_state::STRING_ESCAPE, dfa_token::ERROR_STRING_ESCAPE, dfa_token::ERROR_EOF,       dfa_skip::NONE},
+        {dfa_state::UNICODE_OPEN,  dfa_token::ERROR_UNICODE_ESCAPE, dfa_token::ERROR_EOF,      dfa_skip::NONE},
+        {dfa_state::UNICODE_FIRST, dfa_token::ERROR_UNICODE_ESCAPE, dfa_token::ERROR_EOF,      dfa_skip::NONE},
+        {dfa_state::UNICODE_HEX,   dfa_token::ERROR_UNICODE_ESCAPE, dfa_token::ERROR_EOF,      dfa_skip::NONE},
+        {dfa_state::STRING_END,    dfa_token::STRING,              dfa_token::STRING,          dfa_skip::NONE},
+        {dfa_state::ESCAPED,       dfa_token::ERROR_EOF,           dfa_token::ERROR_EOF,       dfa_skip::STRING},
+        {dfa_state::ESCAPED_END,   dfa_token::ESCAPED_STRING,      dfa_token::ESCAPED_STRING,  dfa_skip::NONE},
+        {dfa_state::CHAR_OPEN,     dfa_token::ERROR_EMPTY,         dfa_token::ERROR_EMPTY,     dfa_skip::NONE},
+        {dfa_state::CHAR_ESCAPE,   dfa_token::ERROR_CHAR_ESCAPE,   dfa_token::ERROR_EOF,       dfa_skip::NONE},
+        {dfa_state::CHAR_BODY,     dfa_token::ERROR_ENCLOSING,     dfa_token::ERROR_EOF,       dfa_skip::NONE},
+        {dfa_state::CHAR_END,      dfa_token::CHAR,                dfa_token::CHAR,            dfa_skip::NONE},
+    };
+
+    // tokens of CovScript, operators are left to the operator table
+    constexpr dfa_rule default_token_rules[] = {
+        {dfa_state::START,         " \t\r\f\v;",           dfa_state::BLANK},
+        {dfa_state::START,         "\n",                   dfa_state::NEWLINE},
+        {dfa_state::START,         COVSCRIPT_DFA_ID_START, dfa_state::IDENTIFIER},
+        {dfa_state::START,         "0",                    dfa_state::ZERO},
+        {dfa_state::START,         "1-9",                  dfa_state::DEC},
+        {dfa_state::START,         "\"",                   dfa_state::STRING},
+        {dfa_state::START,         "'",                    dfa_state::CHAR_OPEN},
+
+        {dfa_state::LINE_START,    " \t\r\f\v;",           dfa_state::BLANK},
+        {dfa_state::LINE_START,    "\n",                   dfa_state::NEWLINE},
+        {dfa_state::LINE_START,    COVSCRIPT_DFA_ID_START, dfa_state::IDENTIFIER},
+        {dfa_state::LINE_START,    "0",                    dfa_state::ZERO},
+        {dfa_state::LINE_START,    "1-9",                  dfa_state::DEC},
+        {dfa_state::LINE_START,    "\"",                   dfa_state::STRING},
+        {dfa_state::LINE_START,    "'",                    dfa_state::CHAR_OPEN},
+        // comment and preprocessor tag in CovScript 3
+        {dfa_state::LINE_START,    "#@",                   dfa_state::PREPROCESSOR},
+
+        {dfa_state::BLANK,         " \t\r\f\v;",           dfa_state::BLANK},
+        {dfa_state::PREPROCESSOR,  "\x03",                 dfa_state::PREPROCESSOR},
+        {dfa_state::PREPROCESSOR,  "\n",                   dfa_state::STOP},
+        {dfa_state::IDENTIFIER,    COVSCRIPT_DFA_ID_PART,  dfa_state::IDENTIFIER},
+
+        // a point right after the first digit makes it dec, even after 0
+        {dfa_state::ZERO,          ".",                    dfa_state::FRAC},
+        {dfa_state::ZERO,          "xX",                   dfa_state::HEX},
+        {dfa_state::ZERO,          "bB",                   dfa_state::BIN},
+        {dfa_state::ZERO,          "0-7",                  dfa_state::OCT},
+        {dfa_state::DEC,           "0-9",                  dfa_state::DEC},
+        {dfa_state::DEC,           ".",                    dfa_state::FRAC},
+        {dfa_state::FRAC,          "0-9.",                 dfa_state::FRAC},
+        {dfa_state::HEX,           "0-9a-fA-F",            dfa_state::HEX},
+        {dfa_state::BIN,           "01",                   dfa_state::BIN},
+        {dfa_state::OCT,           "0-7",                  dfa_state::OCT},
+        // an exponent makes it floating, it needs at least one digit,
+        // without one the e is not part of the number
+        {dfa_state::ZERO,          "eE",                   dfa_state::INT_EXP_MARK},
+        {dfa_state::DEC,           "eE",                   dfa_state::INT_EXP_MARK},
+        {dfa_state::FRAC,          "eE",                   dfa_state::EXP_MARK},
+        {dfa_state::INT_EXP_MARK,  "+-",                   dfa_state::INT_EXP_SIGN},
+        {dfa_state::INT_EXP_MARK,  "0-9",                  dfa_state::EXP},
+        {dfa_state::INT_EXP_SIGN,  "0-9",                  dfa_state::EXP},
+        {dfa_state::EXP_MARK,      "+-",                   dfa_state::EXP_SIGN},
+        {dfa_state::EXP_MARK,      "0-9",                  dfa_state::EXP},
+        {dfa_state::EXP_SIGN,      "0-9",                  dfa_state::EXP},
+        {dfa_state::EXP,           "0-9",                  dfa_state::EXP},
+
+        {dfa_state::STRING,        "\x03",                 dfa_state::STRING},
+        {dfa_state::STRING,        "\\",                   dfa_state::STRING_ESCAPE},
+        {dfa_state::STRING,        "\"",                   dfa_state::STRING_END},
+        {dfa_state::STRING_ESCAPE, COVSCRIPT_DFA_ESCAPE,   dfa_state::ESCAPED},
+        {dfa_state::STRING_ESCAPE, "u",                    dfa_state::UNICODE_OPEN},
+        {dfa_state::UNICODE_OPEN,  "{",                    dfa_state::UNICODE_FIRST},
+        {dfa_state::UNICODE_FIRST, "0-9a-fA-F",            dfa_state::UNICODE_HEX},
+        {dfa_state::UNICODE_HEX,   "0-9a-fA-F",            dfa_state::UNICODE_HEX},
+        {dfa_state::UNICODE_HEX,   "}",                    dfa_state::ESCAPED},
+        {dfa_state::ESCAPED,       "\x03",                 dfa_state::ESCAPED},
+        {dfa_state::ESCAPED,       "\\",                   dfa_state::STRING_ESCAPE},
+        {dfa_state::ESCAPED,       "\"",                   dfa_state::ESCAPED_END},
+
+        {dfa_state::CHAR_OPEN,     "\x03",                 dfa_state::CHAR_BODY},
+        {dfa_state::CHAR_OPEN,     "'",                    dfa_state::STOP},
+        {dfa_state::CHAR_OPEN,     "\\",                   dfa_state::CHAR_ESCAPE},
+        {dfa_state::CHAR_ESCAPE,   COVSCRIPT_DFA_ESCAPE,   dfa_state::CHAR_BODY},
+        {dfa_state::CHAR_BODY,     "'",                    dfa_state::CHAR_END},
+    };
+
+#undef COVSCRIPT_DFA_ID_START
+#undef COVSCRIPT_DFA_ID_PART
+#undef COVSCRIPT_DFA_ESCAPE
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // transition table
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct lexer_dfa {
+        dfa_state _next[static_cast<std::size_t>(dfa_state::COUNT)][dfa_columns];
+        dfa_token _stop[static_cast<std::size_t>(dfa_state::COUNT)];
+        dfa_token _eof[static_cast<std::size_t>(dfa_state::COUNT)];
+        dfa_skip _skip[static_cast<std::size_t>(dfa_state::COUNT)];
+
+        constexpr dfa_state next(dfa_state state, std::size_t column) const {
+            return _next[static_cast<std::size_t>(state)][column];
+        }
+
+        constexpr dfa_token stop(dfa_state state) const {
+            return _stop[static_cast<std::size_t>(state)];
+        }
+
+        constexpr dfa_token eof(dfa_state state) const {
+            return _eof[static_cast<std::size_t>(state)];
+        }
+
+        constexpr dfa_skip skip(dfa_state state) const {
+            return _skip[static_cast<std::size_t>(state)];
+        }
+    };
+
+    // fails to compile on a malformed char set
+    template <std::size_t NStates, std::size_t NRules>
+    constexpr lexer_dfa make_lexer_dfa(const dfa_state_def (&states)[NStates],
+                                       const dfa_rule (&rules)[NRules]) {
+        lexer_dfa dfa{};
+        for (std::size_t i = 0; i < NStates; ++i) {
+            auto s = static_cast<std::size_t>(states[i]._state);
+            dfa._stop[s] = states[i]._stop;
+            dfa._eof[s] = states[i]._eof;
+            dfa._skip[s] = states[i]._skip;
+        }
+        for (std::size_t i = 0; i < NRules; ++i) {
+            dfa_state *row = dfa._next[static_cast<std::size_t>(rules[i]._from)];
+            for (const char *p = rules[i]._chars; *p != '\0'; ++p) {
+                auto c = static_cast<unsigned char>(*p);
+                if (c >= 128) {
+                    throw std::invalid_argument("token rules are ASCII only");
+                }
+                if (c == 1) {
+                    row[dfa_wide_identifier] = rules[i]._to;
+                } else if (c == 2) {
+                    row[dfa_wide_other] = rules[i]._to;
+                } else if (c == 3) {
+                    for (std::size_t col = 0; col < dfa_columns; ++col) {
+                        row[col] = rules[i]._to;
+                    }
+                } else if (p[1] == '-' && p[2] != '\0') {
+                    auto last = static_cast<unsigned char>(p[2]);
+                    if (last < c || last >= 128) {
+                        throw std::invalid_argument("bad char range in token rules");
+                    }
+                    for (std::size_t col = c; col <= last; ++col) {
+                        row[col] = rules[i]._to;
+                    }
+                    p += 2;
+                } else {
+                    row[c] = rules[i]._to;
+                }
+            }
+        }
+        return dfa;
+    }
+
+    constexpr lexer_dfa default_lexer_dfa = make_lexer_dfa(default_token_states, default_token_rules);
+}
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) && !defined(COVSCRIPT_LEXER_NO_SIMD)
+#define COVSCRIPT_LEXER_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // scan kernels
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Kernels skip a run of code units that the lexer would consume one by
+    // one anyway and return the first unit that needs a closer look.
+    // They never look past `end` and only ever stop early, so callers must
+    // still check the unit they stop at with the scalar rules.
+    //
+    //   skip_blank:      ' ', '\t', '\r', '\f', '\v' and ';' (not '\n')
+    //   skip_identifier: ASCII [A-Za-z0-9_$], stops at non-ASCII chars
+    //   skip_string:     anything but '\\', '"' and '\n'
+    //   skip_line:       anything but '\n'
+    //
+    // Non-ASCII bytes can never end a string, so skip_string runs
+    // through them instead of stopping.
+    namespace simd {
+        inline bool is_blank(std::uint32_t c) {
+            return c == U' ' || c == U'\t' || c == U'\r'
+                   || c == U'\f' || c == U'\v' || c == U';';
+        }
+
+        inline bool is_identifier(std::uint32_t c) {
+            return (c >= U'a' && c <= U'z')
+                   || (c >= U'A' && c <= U'Z')
+                   || (c >= U'0' && c <= U'9')
+                   || c == U'_' || c == U'$';
+        }
+
+        inline bool is_string_body(std::uint32_t c) {
+            return c != U'\\' && c != U'"' && c != U'\n';
+        }
+
+        inline bool is_line_body(std::uint32_t c) {
+            return c != U'\n';
+        }
+
+        template <typename UnitT, bool (*Pred)(std::uint32_t)>
+        const UnitT *scalar_skip(const UnitT *p, const UnitT *end) {
+            while (p < end && Pred(*p)) {
+                ++p;
+            }
+            return p;
+        }
+
+#ifdef COVSCRIPT_LEXER_SIMD_X86
+        // the predicates below return a mask of the bytes to stop at
+
+        struct sse2_blank {
+            __m128i operator()(__m128i v) const {
+                __m128i hit = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8(';'))),
+                    // '\t' '\v' '\f' '\r' are 9, 11, 12, 13
+                    _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                     _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                                   _mm_cmpgt_epi8(_mm_set1_epi8('\r' + 1), v))));
+                return _mm_xor_si128(hit, _mm_set1_epi8(-1));
+            }
+        };
+
+        struct sse2_identifier {
+            static __m128i in_range(__m128i v, char lo, char hi) {
+                return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                                     _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(hi + 1)), v));
+            }
+
+            __m128i operator()(__m128i v) const {
+                // bytes >= 0x80 are negative, so they never fall in a range
+                __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+                __m128i hit = _mm_or_si128(
+                    _mm_or_si128(in_range(lower, 'a', 'z'), in_range(v, '0', '9')),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('$'))));
+                return _mm_xor_si128(hit, _mm_set1_epi8(-1));
+            }
+        };
+
+        struct sse2_string {
+            __m128i operator()(__m128i v) const {
+                return _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))),
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+            }
+        };
+
+        struct sse2_line {
+            __m128i operator()(__m128i v) const {
+                return _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+            }
+        };
+
+        // narrow 16 chars to bytes, non-ASCII chars stay non-ASCII
+        inline __m128i sse2_narrow(const char32_t *p) {
+            auto *v = reinterpret_cast<const __m128i *>(p);
+            __m128i lo = _mm_packs_epi32(_mm_loadu_si128(v), _mm_loadu_si128(v + 1));
+            __m128i hi = _mm_packs_epi32(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3));
+            return _mm_packus_epi16(lo, hi);
+        }
+
+        template <typename Pred>
+        const unsigned char *sse2_skip(const unsigned char *p, const unsigned char *end, Pred pred) {
+            while (end - p >= 16) {
+                auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+                    pred(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)))));
+                if (mask != 0) {
+                    return p + __builtin_ctz(mask);
+                }
+                p += 16;
+            }
+            return p;
+        }
+
+        template <typename Pred>
+        const char32_t *sse2_skip(const char32_t *p, const char32_t *end, Pred pred) {
+            while (end - p >= 16) {
+                auto mask = static_cast<unsigned>(_mm_movemask_epi8(pred(sse2_narrow(p))));
+                if (mask != 0) {
+                    return p + __builtin_ctz(mask);
+                }
+                p += 16;
+            }
+            return p;
+        }
+
+#define COVSCRIPT_AVX2 __attribute__((target("avx2")))
+
+        struct avx2_blank {
+            COVSCRIPT_AVX2 __m256i operator()(__m256i v) const {
+                __m256i hit = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';'))),
+                    _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                        _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v))));
+                return _mm256_xor_si256(hit, _mm256_set1_epi8(-1));
+            }
+        };
+
+        struct avx2_identifier {
+            COVSCRIPT_AVX2 static __m256i in_range(__m256i v, char lo, char hi) {
+                return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(static_cast<char>(lo - 1))),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi + 1)), v));
+            }
+
+            COVSCRIPT_AVX2 __m256i operator()(__m256i v) const {
+                __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+                __m256i hit = _mm256_or_si256(
+                    _mm256_or_si256(in_range(lower, 'a', 'z'), in_range(v, '0', '9')),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')),
+                                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('$'))));
+                return _mm256_xor_si256(hit, _mm256_set1_epi8(-1));
+            }
+        };
+
+        struct avx2_string {
+            COVSCRIPT_AVX2 __m256i operator()(__m256i v) const {
+                return _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')),
+                                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+            }
+        };
+
+        struct avx2_line {
+            COVSCRIPT_AVX2 __m256i operator()(__m256i v) const {
+                return _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+            }
+        };
+
+        // narrow 32 chars to bytes, pack works per 128-bit lane so
+        // the 4-byte groups have to be put back in order.
+        COVSCRIPT_AVX2 inline __m256i avx2_narrow(const char32_t *p) {
+            auto *v = reinterpret_cast<const __m256i *>(p);
+            __m256i ab = _mm256_packs_epi32(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1));
+            __m256i cd = _mm256_packs_epi32(_mm256_loadu_si256(v + 2), _mm256_loadu_si256(v + 3));
+            return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd),
+                                               _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        }
+
+        template <typename Pred>
+        COVSCRIPT_AVX2 const unsigned char *avx2_skip(const unsigned char *p, const unsigned char *end, Pred pred) {
+            while (end - p >= 32) {
+                auto mask = static_cast<unsigned>(_mm256_movemask_epi8(
+                    pred(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)))));
+                if (mask != 0) {
+                    return p + __builtin_ctz(mask);
+                }
+                p += 32;
+            }
+            return p;
+        }
+
+        template <typename Pred>
+        COVSCRIPT_AVX2 const char32_t *avx2_skip(const char32_t *p, const char32_t *end, Pred pred) {
+            while (end - p >= 32) {
+                auto mask = static_cast<unsigned>(_mm256_movemask_epi8(pred(avx2_narrow(p))));
+                if (mask != 0) {
+                    return p + __builtin_ctz(mask);
+                }
+                p += 32;
+            }
+            return p;
+        }
+
+#undef COVSCRIPT_AVX2
+#endif
+
+        template <typename UnitT>
+        struct kernels {
+            using skip_fn = const UnitT *(*)(const UnitT *, const UnitT *);
+
+            skip_fn _blank;
+            skip_fn _identifier;
+            skip_fn _string;
+            skip_fn _line;
+
+            static kernels scalar() {
+                return kernels{
+                    &scalar_skip<UnitT, is_blank>,
+                    &scalar_skip<UnitT, is_identifier>,
+                    &scalar_skip<UnitT, is_string_body>,
+                    &scalar_skip<UnitT, is_line_body>,
+                };
+            }
+
+#ifdef COVSCRIPT_LEXER_SIMD_X86
+            // vector loop first, then the tail the vector loop left
+            template <bool (*Pred)(std::uint32_t), typename VecPred>
+            static const UnitT *sse2(const UnitT *p, const UnitT *end) {
+                return scalar_skip<UnitT, Pred>(sse2_skip(p, end, VecPred{}), end);
+            }
+
+            template <bool (*Pred)(std::uint32_t), typename VecPred>
+            __attribute__((target("avx2")))
+            static const UnitT *avx2(const UnitT *p, const UnitT *end) {
+                return scalar_skip<UnitT, Pred>(avx2_skip(p, end, VecPred{}), end);
+            }
+#endif
+
+            static kernels detect() {
+#ifdef COVSCRIPT_LEXER_SIMD_X86
+                if (__builtin_cpu_supports("avx2")) {
+                    return kernels{
+                        &avx2<is_blank, avx2_blank>,
+                        &avx2<is_identifier, avx2_identifier>,
+                        &avx2<is_string_body, avx2_string>,
+                        &avx2<is_line_body, avx2_line>,
+                    };
+                }
+                // SSE2 is always there on x86-64
+                return kernels{
+                    &sse2<is_blank, sse2_blank>,
+                    &sse2<is_identifier, sse2_identifier>,
+                    &sse2<is_string_body, sse2_string>,
+                    &sse2<is_line_body, sse2_line>,
+                };
+#else
+                return scalar();
+#endif
+            }
+
+            static const kernels &get() {
+                static const kernels k = detect();
+                return k;
+            }
+        };
+    }
+}
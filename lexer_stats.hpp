@@ -0,0 +1,186 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include "lexer_dfa.hpp"
+#include "token.hpp"
+
+// Counters for finding where lexing time goes. They are only kept when
+// COVSCRIPT_LEXER_STATS is defined, otherwise every hook compiles to nothing
+// and lexer_stats stays zero.
+#ifdef COVSCRIPT_LEXER_STATS
+#define COVSCRIPT_LEXER_STAT(...) __VA_ARGS__
+#else
+#define COVSCRIPT_LEXER_STAT(...)
+#endif
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // lexer statistics
+    ////////////////////////////////////////////////////////////////////////////////
+
+    enum class lexer_phase : std::uint8_t {
+        // reading and decoding the source
+        SOURCE,
+        LEX,
+        // looking tokens up in and writing them to a token_cache
+        CACHE,
+        RELEX,
+        // building the token hierarchy for lex(deque)
+        TO_TOKENS,
+        COUNT,
+    };
+
+    constexpr std::size_t token_type_count = static_cast<std::size_t>(token_type::CUSTOM_LITERAL) + 1;
+    constexpr std::size_t dfa_token_count = static_cast<std::size_t>(dfa_token::ERROR_ENCLOSING) + 1;
+    constexpr std::size_t lexer_phase_count = static_cast<std::size_t>(lexer_phase::COUNT);
+
+    constexpr const char *token_type_names[token_type_count] = {
+        "undefined", "id_or_kw", "int_literal", "floating_literal", "string_literal",
+        "char_literal", "preprocessor", "operator", "custom_literal",
+    };
+
+    constexpr const char *dfa_token_names[dfa_token_count] = {
+        "operator", "blank", "newline", "preprocessor", "identifier",
+        "int_dec", "int_hex", "int_bin", "int_oct", "float", "int_before_e", "float_before_e",
+        "string", "escaped_string", "char",
+        "error_eof", "error_string_escape", "error_unicode_escape", "error_char_escape",
+        "error_empty", "error_enclosing",
+    };
+
+    constexpr const char *lexer_phase_names[lexer_phase_count] = {
+        "source", "lex", "cache", "relex", "to_tokens",
+    };
+
+    struct lexer_stats {
+        // tokens pushed by type, a custom literal counts as its literal too
+        std::uint64_t _tokens[token_type_count] = {};
+        // code units consumed by what the scanner found, errors include
+        // what was skipped to get back in sync
+        std::uint64_t _units[dfa_token_count] = {};
+        std::uint64_t _suffix_units = 0;
+        std::uint64_t _operator_matches = 0;
+        std::uint64_t _operator_failures = 0;
+        // units the operator table read past the operator it returned,
+        // the char that ended the walk included
+        std::uint64_t _operator_backtrack_units = 0;
+        // charset calls made by the lexer, token text made later through
+        // a token_stream is not counted
+        std::uint64_t _wide2local_calls = 0;
+        std::uint64_t _wide2local_units = 0;
+        std::uint64_t _local2wide_calls = 0;
+        std::uint64_t _local2wide_bytes = 0;
+        // the lexer cannot see allocations, a driver that counts them sets this
+        std::uint64_t _allocations = 0;
+        double _seconds[lexer_phase_count] = {};
+
+        void merge(const lexer_stats &other) {
+            for (std::size_t i = 0; i < token_type_count; ++i) {
+                _tokens[i] += other._tokens[i];
+            }
+            for (std::size_t i = 0; i < dfa_token_count; ++i) {
+                _units[i] += other._units[i];
+            }
+            _suffix_units += other._suffix_units;
+            _operator_matches += other._operator_matches;
+            _operator_failures += other._operator_failures;
+            _operator_backtrack_units += other._operator_backtrack_units;
+            _wide2local_calls += other._wide2local_calls;
+            _wide2local_units += other._wide2local_units;
+            _local2wide_calls += other._local2wide_calls;
+            _local2wide_bytes += other._local2wide_bytes;
+            _allocations += other._allocations;
+            for (std::size_t i = 0; i < lexer_phase_count; ++i) {
+                _seconds[i] += other._seconds[i];
+            }
+        }
+
+        std::string json() const {
+            std::ostringstream out;
+            auto object = [&](const char *name, const char *const *keys, const std::uint64_t *values,
+                              std::size_t n) {
+                out << "  \"" << name << "\": {";
+                for (std::size_t i = 0; i < n; ++i) {
+                    out << (i == 0 ? "" : ", ") << '"' << keys[i] << "\": " << values[i];
+                }
+                out << "},\n";
+            };
+            out << "{\n";
+            object("tokens", token_type_names, _tokens, token_type_count);
+            object("units", dfa_token_names, _units, dfa_token_count);
+            out << "  \"suffix_units\": " << _suffix_units << ",\n"
+                << "  \"operators\": {\"matches\": " << _operator_matches
+                << ", \"failures\": " << _operator_failures
+                << ", \"backtrack_units\": " << _operator_backtrack_units << "},\n"
+                << "  \"charset\": {\"wide2local_calls\": " << _wide2local_calls
+                << ", \"wide2local_units\": " << _wide2local_units
+                << ", \"local2wide_calls\": " << _local2wide_calls
+                << ", \"local2wide_bytes\": " << _local2wide_bytes << "},\n"
+                << "  \"allocations\": " << _allocations << ",\n"
+                << "  \"seconds\": {";
+            for (std::size_t i = 0; i < lexer_phase_count; ++i) {
+                out << (i == 0 ? "" : ", ") << '"' << lexer_phase_names[i] << "\": " << _seconds[i];
+            }
+            out << "}\n}\n";
+            return out.str();
+        }
+
+        // Prometheus text exposition format
+        std::string prometheus(const std::string &prefix = "covscript_lexer") const {
+            std::ostringstream out;
+            auto counter = [&](const std::string &name, const char *help) {
+                out << "# HELP " << prefix << '_' << name << ' ' << help << '\n'
+                    << "# TYPE " << prefix << '_' << name << " counter\n";
+            };
+            auto labeled = [&](const std::string &name, const char *help, const char *label,
+                               const char *const *keys, const std::uint64_t *values, std::size_t n) {
+                counter(name, help);
+                for (std::size_t i = 0; i < n; ++i) {
+                    out << prefix << '_' << name << '{' << label << "=\"" << keys[i] << "\"} " << values[i] << '\n';
+                }
+            };
+            auto single = [&](const std::string &name, const char *help, std::uint64_t value) {
+                counter(name, help);
+                out << prefix << '_' << name << ' ' << value << '\n';
+            };
+
+            labeled("tokens_total", "Tokens pushed by type.", "type", token_type_names, _tokens, token_type_count);
+            labeled("units_total", "Code units consumed by scan result.", "scan", dfa_token_names, _units,
+                    dfa_token_count);
+            single("suffix_units_total", "Code units consumed by literal suffixes.", _suffix_units);
+            single("operator_matches_total", "Operators matched.", _operator_matches);
+            single("operator_failures_total", "Operator lookups that matched nothing.", _operator_failures);
+            single("operator_backtrack_units_total", "Code units read past matched operators.",
+                   _operator_backtrack_units);
+            single("wide2local_calls_total", "wide2local calls made by the lexer.", _wide2local_calls);
+            single("wide2local_units_total", "Chars passed to wide2local.", _wide2local_units);
+            single("local2wide_calls_total", "local2wide calls made by the lexer.", _local2wide_calls);
+            single("local2wide_bytes_total", "Bytes passed to local2wide.", _local2wide_bytes);
+            single("allocations_total", "Allocations while lexing.", _allocations);
+            counter("phase_seconds_total", "Wall time by phase.");
+            for (std::size_t i = 0; i < lexer_phase_count; ++i) {
+                out << prefix << "_phase_seconds_total{phase=\"" << lexer_phase_names[i] << "\"} "
+                    << _seconds[i] << '\n';
+            }
+            return out.str();
+        }
+    };
+
+    // adds the time until it goes out of scope to a phase
+    struct lexer_stats_timer {
+        double &_seconds;
+        std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+
+        lexer_stats_timer(lexer_stats &stats, lexer_phase phase)
+            : _seconds(stats._seconds[static_cast<std::size_t>(phase)]) {}
+
+        lexer_stats_timer(const lexer_stats_timer &) = delete;
+
+        ~lexer_stats_timer() {
+            _seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+        }
+    };
+}
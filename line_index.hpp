@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "lexer_simd.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // line index
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // lines are counted from 1, columns in chars from the line start
+    struct source_location {
+        std::uint32_t _line;
+        std::uint32_t _column;
+    };
+
+    // where every line starts, so tokens only keep their offset and
+    // lines are looked up when someone asks, e.g. for a diagnostic.
+    // text can only be appended, the index is extended over the new text.
+    struct line_index {
+    private:
+        std::vector<std::uint32_t> _starts;
+        std::size_t _scanned = 0;
+        // lines before the first start, dropped with their text
+        std::uint32_t _dropped = 0;
+
+    public:
+        // index the text after what was looked at before
+        template <typename UnitT>
+        void extend(const UnitT *begin, std::size_t length) {
+            if (_starts.empty()) {
+                _starts.push_back(0);
+            }
+            auto skip = simd::kernels<UnitT>::get()._line;
+            const UnitT *end = begin + length;
+            for (const UnitT *p = begin + _scanned; (p = skip(p, end)) < end; ++p) {
+                _starts.push_back(static_cast<std::uint32_t>(p + 1 - begin));
+            }
+            _scanned = length;
+        }
+
+        std::size_t lines() const {
+            return _dropped + _starts.size();
+        }
+
+        // the line offset is on
+        std::uint32_t line(std::uint32_t offset) const {
+            return _dropped + static_cast<std::uint32_t>(
+                std::upper_bound(_starts.begin(), _starts.end(), offset) - _starts.begin());
+        }
+
+        std::uint32_t line_start(std::uint32_t line) const {
+            return _starts[line - _dropped - 1];
+        }
+
+        // the same lines after the text before the start of line was
+        // dropped, offsets are then from that start
+        line_index tail(std::uint32_t line) const {
+            line_index index;
+            std::uint32_t start = line_start(line);
+            for (std::size_t i = line - _dropped - 1; i < _starts.size(); ++i) {
+                index._starts.push_back(_starts[i] - start);
+            }
+            index._scanned = _scanned - start;
+            index._dropped = line - 1;
+            return index;
+        }
+    };
+}
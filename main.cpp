@@ -1,9 +1,178 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include "batch_lexer.hpp"
+#include "bytecode_compiler.hpp"
 #include "lexer.hpp"
+#include "module_loader.hpp"
+#include "parser.hpp"
 
-int main() {
+#ifdef COVSCRIPT_LEXER_STATS
+// every allocation of the process, counted in bench_alloc.cpp,
+// lexer_stats::_allocations is taken from here
+extern std::atomic<std::size_t> allocations;
+#endif
+
+// covscript-exp [-j threads] [--cache dir] [--parse] [--compile] [--disassemble] [--imports] [-I dir]...
+//               [--stats json|prometheus] <file or directory>...
+// lexes every .csc file given or found under the directories, and parses them with --parse.
+// --compile also compiles them to bytecode, which --disassemble prints.
+// --imports also loads every module they import, looked up next to the importing file
+// and then in the -I directories.
+// --stats writes lexer_stats to stderr when built with COVSCRIPT_LEXER_STATS
+static int batch_main(int argc, char **argv) {
     using namespace cs_impl;
 
+    std::size_t threads = 0;
+    std::string cache_directory;
+    std::string stats_format;
+    bool parse = false;
+    bool compile = false;
+    bool disassemble = false;
+    bool imports = false;
+    std::vector<std::string> search_paths;
+    std::vector<std::string> paths;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                threads = static_cast<std::size_t>(std::strtoul(argv[++i], nullptr, 10));
+            } else if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+                cache_directory = argv[++i];
+            } else if (std::strcmp(argv[i], "--parse") == 0) {
+                parse = true;
+            } else if (std::strcmp(argv[i], "--compile") == 0) {
+                parse = compile = true;
+            } else if (std::strcmp(argv[i], "--disassemble") == 0) {
+                parse = compile = disassemble = true;
+            } else if (std::strcmp(argv[i], "--imports") == 0) {
+                imports = true;
+            } else if (std::strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+                search_paths.emplace_back(argv[++i]);
+            } else if (std::strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+                stats_format = argv[++i];
+                if (stats_format != "json" && stats_format != "prometheus") {
+                    mpp::throw_ex<std::invalid_argument>("--stats takes json or prometheus");
+                }
+#ifndef COVSCRIPT_LEXER_STATS
+                mpp::throw_ex<std::invalid_argument>("--stats needs a build with COVSCRIPT_LEXER_STATS");
+#endif
+            } else {
+                auto files = list_source_files(argv[i]);
+                paths.insert(paths.end(), files.begin(), files.end());
+            }
+        }
+    } catch (const std::exception &e) {
+        mpp::format(std::cerr, "{}\n", e.what());
+        return 2;
+    }
+
+    auto make_lexer = []() {
+        return std::unique_ptr<cs::utf8_lexer>(new cs::utf8_lexer(
+            std::unique_ptr<mpp::codecvt::utf8>(new mpp::codecvt::utf8), lexer_engine::UTF8));
+    };
+    cs::utf8_batch_lexer batch{make_lexer, threads};
+    cs::utf8_module_loader loader{make_lexer, threads};
+    if (!cache_directory.empty()) {
+        batch.cache(cache_directory);
+        loader.cache(cache_directory);
+    }
+    loader.search_paths(search_paths);
+
+    COVSCRIPT_LEXER_STAT(std::uint64_t allocated = allocations;)
+    auto start = std::chrono::steady_clock::now();
+    std::vector<batch_result> results;
+    std::size_t failed = 0;
+    if (imports) {
+        module_graph graph = loader.load(paths);
+        try {
+            graph.order();
+        } catch (const std::runtime_error &e) {
+            ++failed;
+            mpp::format(std::cout, "error: {}\n", e.what());
+        }
+        for (auto &m : graph._modules) {
+            failed += m._missing.empty() ? 0 : 1;
+            for (const auto &name : m._missing) {
+                mpp::format(std::cout, "{}: error: cannot find module {}\n", m._file._path, name);
+            }
+            results.push_back(std::move(m._file));
+        }
+    } else {
+        results = batch.lex(paths);
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    COVSCRIPT_LEXER_STAT(allocated = allocations - allocated;)
+
+    std::size_t tokens = 0;
+    double busy = 0;
+    // one tree for all files, its blocks are reused
+    cs::parser parser;
+    cs::ast tree;
+    cs::bytecode_compiler compiler;
+    cs::bytecode_module module;
+    const symbol_table &symbols = imports ? loader.symbols() : batch.symbols();
+    for (const auto &r : results) {
+        tokens += r._tokens.size();
+        busy += r._seconds;
+        if (r._error) {
+            ++failed;
+            mpp::format(std::cout, "{}:{}:{}: error: {}\n", r._path, r._error->_line,
+                        r._error->_start_column, r._error->what());
+        } else if (r._other_error) {
+            ++failed;
+            try {
+                std::rethrow_exception(r._other_error);
+            } catch (const std::exception &e) {
+                mpp::format(std::cout, "{}: error: {}\n", r._path, e.what());
+            }
+        } else if (!parse) {
+            printf("%s: %zu tokens, %zu units, %.3f ms\n", r._path.c_str(),
+                   r._tokens.size(), r._length, r._seconds * 1000);
+        } else {
+            try {
+                parser.parse(r._tokens, tree);
+                if (!compile) {
+                    printf("%s: %zu tokens, %zu units, %u nodes, %.3f ms\n", r._path.c_str(),
+                           r._tokens.size(), r._length, tree.size() - 1, r._seconds * 1000);
+                    continue;
+                }
+                compiler.compile(r._tokens, symbols, tree, module);
+                printf("%s: %zu tokens, %u nodes, %zu functions, %zu constants, %zu bytes\n", r._path.c_str(),
+                       r._tokens.size(), tree.size() - 1, module._functions.size(), module._constants.size(),
+                       module.code_size());
+                if (disassemble) {
+                    std::fputs(module.disassemble().c_str(), stdout);
+                }
+            } catch (const parser_error &e) {
+                ++failed;
+                mpp::format(std::cout, "{}:{}:{}: error: {}\n", r._path, e._line, e._start_column, e.what());
+            } catch (const compiler_error &e) {
+                ++failed;
+                mpp::format(std::cout, "{}:{}:{}: error: {}\n", r._path, e._line, e._start_column, e.what());
+            }
+        }
+    }
+    printf("%zu files, %zu failed, %zu tokens, %.3f ms (%.3f ms in workers)\n",
+           results.size(), failed, tokens, wall * 1000, busy * 1000);
+    if (!stats_format.empty()) {
+        lexer_stats stats = imports ? loader.stats() : batch.stats();
+        COVSCRIPT_LEXER_STAT(stats._allocations = allocated;)
+        std::fflush(stdout);
+        std::cerr << (stats_format == "json" ? stats.json() : stats.prometheus());
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    using namespace cs_impl;
+
+    if (argc > 1) {
+        return batch_main(argc, argv);
+    }
+
     cs::lexer lexer{std::make_unique<mpp::codecvt::utf8>()};
     std::string code = "#!/usr/bin/env cs4\n"
                        "var text = \"hello world\"\n"
@@ -0,0 +1,536 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "batch_lexer.hpp"
+#include "source_file.hpp"
+#include "thread_pool.hpp"
+#include "token_cache.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // imports
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Module names of a preprocessor line `@import: a.b, c` (or `#import
+    // a.b, c`, the colon is optional), appended to names. false when the
+    // line is some other directive, std::invalid_argument when it is an
+    // import that does not name modules.
+    inline bool parse_import_directive(const std::string &line, std::vector<std::string> &names) {
+        auto blank = [](char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        };
+        std::size_t i = 1;
+        while (i < line.size() && blank(line[i])) {
+            ++i;
+        }
+        static const char directive[] = "import";
+        std::size_t length = sizeof(directive) - 1;
+        if (line.compare(i, length, directive) != 0) {
+            return false;
+        }
+        i += length;
+        if (i < line.size() && !blank(line[i]) && line[i] != ':') {
+            // e.g. @imports
+            return false;
+        }
+
+        std::size_t count = names.size();
+        while (true) {
+            while (i < line.size() && (blank(line[i]) || (line[i] == ':' && names.size() == count))) {
+                ++i;
+            }
+            std::size_t start = i;
+            while (i < line.size() && line[i] != ',') {
+                ++i;
+            }
+            std::size_t end = i;
+            while (end > start && blank(line[end - 1])) {
+                --end;
+            }
+            std::string name = line.substr(start, end - start);
+            bool valid = !name.empty() && name.front() != '.' && name.back() != '.'
+                         && name.find("..") == std::string::npos;
+            for (char c : name) {
+                valid = valid && !blank(c) && c != ':' && c != '/' && c != '\\';
+            }
+            if (!valid) {
+                throw std::invalid_argument("malformed import directive: " + line);
+            }
+            names.push_back(std::move(name));
+            if (i == line.size()) {
+                break;
+            }
+            // the comma
+            ++i;
+        }
+        return true;
+    }
+
+    // Modules a module imports, by import directives and by `import a.b, c`
+    // statements, in the order they are named. Statements are found by
+    // their tokens, not parsed, one that is cut short ends where its names
+    // do, the parser reports it.
+    inline void find_imports(const token_stream &tokens, const symbol_table &symbols,
+                             std::vector<std::string> &names) {
+        auto is_name = [&](std::size_t i) {
+            return i < tokens.size() && tokens[i]._type == token_type::ID_OR_KW
+                   && tokens.keyword(tokens[i]) == keyword_type::UNDEFINED;
+        };
+        auto is_op = [&](std::size_t i, operator_type op) {
+            return i < tokens.size() && tokens[i]._type == token_type::OPERATOR && tokens[i]._op_type == op;
+        };
+
+        for (std::size_t i = 0; i < tokens.size(); ++i) {
+            const token_record &r = tokens[i];
+            if (r._type == token_type::PREPROCESSOR) {
+                parse_import_directive(tokens.text(r), names);
+                continue;
+            }
+            if (r._type != token_type::ID_OR_KW || tokens.keyword(r) != keyword_type::KEYWORD_IMPORT) {
+                continue;
+            }
+            while (is_name(i + 1)) {
+                std::string name = symbols.name(tokens[++i]._payload);
+                while (is_op(i + 1, operator_type::OPERATOR_DOT) && is_name(i + 2)) {
+                    name += '.';
+                    name += symbols.name(tokens[i + 2]._payload);
+                    i += 2;
+                }
+                names.push_back(std::move(name));
+                if (!is_op(i + 1, operator_type::OPERATOR_COMMA)) {
+                    break;
+                }
+                ++i;
+            }
+        }
+    }
+
+    // the file of a module, a.b is a/b.csc
+    inline std::string module_file(const std::string &name, const std::string &extension = ".csc") {
+        std::string file = name;
+        for (char &c : file) {
+            if (c == '.') {
+                c = '/';
+            }
+        }
+        return file + extension;
+    }
+
+    // the absolute path of a regular file with links resolved, so a module
+    // reached by different paths is loaded once. false when there is no
+    // such file.
+    inline bool canonical_file(const std::string &path, std::string &out) {
+#ifndef _WIN32
+        struct stat st{};
+        if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+        char *resolved = ::realpath(path.c_str(), nullptr);
+        if (resolved == nullptr) {
+            return false;
+        }
+        out = resolved;
+        std::free(resolved);
+        return true;
+#else
+        std::ifstream file(path);
+        out = path;
+        return static_cast<bool>(file);
+#endif
+    }
+
+    inline std::string parent_directory(const std::string &path) {
+        std::size_t slash = path.find_last_of('/');
+        if (slash == std::string::npos) {
+            return ".";
+        }
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // module graph
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // index of a module in its module_graph
+    using module_index = std::uint32_t;
+
+    struct loaded_module {
+        // _file._path is the canonical path
+        batch_result _file;
+        // modules it imports, in the order they are named, once each
+        std::vector<module_index> _imports;
+        // names that matched no file
+        std::vector<std::string> _missing;
+
+        bool ok() const {
+            return _file.ok() && _missing.empty();
+        }
+    };
+
+    // Modules reachable from the roots. The roots come first, then the
+    // others breadth first in the order they are imported, so a graph is
+    // numbered the same way however it was loaded.
+    struct module_graph {
+        std::vector<loaded_module> _modules;
+        // the roots are [0, _roots)
+        std::size_t _roots = 0;
+
+        std::size_t size() const {
+            return _modules.size();
+        }
+
+        const loaded_module &operator[](module_index index) const {
+            return _modules[index];
+        }
+
+        bool ok() const {
+            for (const auto &m : _modules) {
+                if (!m.ok()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // every module after the modules it imports, std::runtime_error
+        // naming the modules of an import cycle
+        std::vector<module_index> order() const {
+            enum : std::uint8_t { NEW, OPEN, DONE };
+            std::vector<std::uint8_t> state(_modules.size(), NEW);
+            std::vector<module_index> order;
+            // depth first, a module and how many of its imports are done
+            std::vector<std::pair<module_index, std::size_t>> stack;
+            for (module_index root = 0; root < _modules.size(); ++root) {
+                if (state[root] != NEW) {
+                    continue;
+                }
+                state[root] = OPEN;
+                stack.emplace_back(root, 0);
+                while (!stack.empty()) {
+                    auto &top = stack.back();
+                    const auto &imports = _modules[top.first]._imports;
+                    if (top.second == imports.size()) {
+                        state[top.first] = DONE;
+                        order.push_back(top.first);
+                        stack.pop_back();
+                        continue;
+                    }
+                    module_index next = imports[top.second++];
+                    if (state[next] == NEW) {
+                        state[next] = OPEN;
+                        stack.emplace_back(next, 0);
+                    } else if (state[next] == OPEN) {
+                        std::string cycle;
+                        std::size_t i = stack.size();
+                        while (stack[i - 1].first != next) {
+                            --i;
+                        }
+                        for (; i <= stack.size(); ++i) {
+                            cycle += _modules[stack[i - 1].first]._file._path + " -> ";
+                        }
+                        throw std::runtime_error("import cycle: " + cycle + _modules[next]._file._path);
+                    }
+                }
+            }
+            return order;
+        }
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // module loader
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Loads modules and everything they import on a job_queue: a module is
+    // lexed as soon as some module names it, while the others are still
+    // being lexed. Names are looked up as files next to the importing
+    // module and then in the search paths.
+    //
+    // With cache(), the paths of every graph are kept on disk, and the
+    // next load of the same roots starts lexing all of them at once
+    // instead of one import level after the other. Imports are still
+    // taken from the tokens, a stale list only costs lexing a file that
+    // is not in the graph any more. The workers' token caches are kept in
+    // the same directory.
+    template <typename Charset, typename OperatorTable>
+    struct basic_module_loader {
+        using lexer_type = basic_lexer<Charset, OperatorTable>;
+
+    private:
+        using worker = batch_worker<Charset, OperatorTable>;
+
+        std::function<std::unique_ptr<lexer_type>()> _make_lexer;
+        std::size_t _threads;
+        std::vector<worker> _workers;
+        symbol_table _symbols;
+        std::vector<std::string> _search_paths;
+        std::string _extension = ".csc";
+        std::string _cache_directory;
+        std::uint64_t _cache_max_bytes = 0;
+
+        // one load
+        struct loading {
+            std::mutex _lock;
+            std::vector<std::unique_ptr<loaded_module>> _modules;
+            std::vector<std::size_t> _lexed_by;
+            std::unordered_map<std::string, module_index> _index;
+            job_queue _queue;
+
+            // the module of a canonical path, queued when it is new
+            module_index add(const std::string &path) {
+                std::lock_guard<std::mutex> guard(_lock);
+                auto it = _index.find(path);
+                if (it != _index.end()) {
+                    return it->second;
+                }
+                if (_modules.size() == std::numeric_limits<module_index>::max()) {
+                    throw std::length_error("too many modules");
+                }
+                auto index = static_cast<module_index>(_modules.size());
+                _modules.emplace_back(new loaded_module);
+                _modules.back()->_file._path = path;
+                _lexed_by.push_back(0);
+                _index.emplace(path, index);
+                _queue.push(index);
+                return index;
+            }
+
+            // _modules may grow meanwhile, the module itself does not move
+            loaded_module &start(module_index index, std::size_t worker) {
+                std::lock_guard<std::mutex> guard(_lock);
+                _lexed_by[index] = worker;
+                return *_modules[index];
+            }
+        };
+
+        static constexpr const char *graph_suffix = ".imports";
+        static constexpr const char *graph_magic = "covscript imports 1";
+
+        // names the list of a set of roots, a different search changes the graph
+        std::string graph_path(const std::vector<std::string> &roots) const {
+            content_hash h;
+            for (const auto &root : roots) {
+                h.update(root);
+            }
+            h.fold(0);
+            for (const auto &dir : _search_paths) {
+                h.update(dir);
+            }
+            h.update(_extension);
+            char name[17];
+            std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(h.key()));
+            return _cache_directory + "/" + name + graph_suffix;
+        }
+
+        static std::vector<std::string> read_graph(const std::string &path) {
+            std::vector<std::string> paths;
+            std::ifstream in(path, std::ios::binary);
+            std::string line;
+            if (!std::getline(in, line) || line != graph_magic) {
+                return paths;
+            }
+            while (std::getline(in, line)) {
+                paths.push_back(std::move(line));
+            }
+            return paths;
+        }
+
+        // failing to write is not an error, the next load just finds imports as it goes
+        void write_graph(const std::string &path, const module_graph &graph) const {
+#ifndef _WIN32
+            ::mkdir(_cache_directory.c_str(), 0755);
+#endif
+            std::string data = std::string(graph_magic) + "\n";
+            for (const auto &m : graph._modules) {
+                if (m._file._path.find('\n') != std::string::npos) {
+                    return;
+                }
+                data += m._file._path + "\n";
+            }
+            replace_file(path, data);
+        }
+
+        bool resolve(const std::string &name, const std::string &from, std::string &path) const {
+            std::string file = module_file(name, _extension);
+            if (canonical_file(parent_directory(from) + "/" + file, path)) {
+                return true;
+            }
+            for (const auto &dir : _search_paths) {
+                if (canonical_file(dir + "/" + file, path)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void load_module(std::size_t self, loading &state, module_index index) {
+            worker &w = _workers[self];
+            if (!w._lexer) {
+                w._lexer = _make_lexer();
+                if (!_cache_directory.empty()) {
+                    w._cache.reset(new token_cache(_cache_directory, _cache_max_bytes));
+                }
+            }
+            loaded_module &m = state.start(index, self);
+            batch_result &file = m._file;
+            w.lex_file(file);
+            if (!file.ok()) {
+                return;
+            }
+
+            std::vector<std::string> names;
+            try {
+                find_imports(file._tokens, w._lexer->symbols(), names);
+            } catch (...) {
+                file._other_error = std::current_exception();
+                return;
+            }
+            std::string path;
+            for (const auto &name : names) {
+                if (!resolve(name, file._path, path)) {
+                    m._missing.push_back(name);
+                    continue;
+                }
+                module_index imported = state.add(path);
+                if (std::find(m._imports.begin(), m._imports.end(), imported) == m._imports.end()) {
+                    m._imports.push_back(imported);
+                }
+            }
+        }
+
+    public:
+        // threads is the number of workers, 0 for one per core
+        explicit basic_module_loader(std::function<std::unique_ptr<lexer_type>()> make_lexer,
+                                     std::size_t threads = 0)
+            : _make_lexer(std::move(make_lexer)),
+              _threads(threads != 0 ? threads : std::max(1U, std::thread::hardware_concurrency())),
+              _workers(_threads) {}
+
+        // looked up in order after the directory of the importing module
+        void search_paths(std::vector<std::string> paths) {
+            _search_paths = std::move(paths);
+        }
+
+        // of module files, ".csc" by default
+        void extension(std::string extension) {
+            _extension = std::move(extension);
+        }
+
+        // keep import graphs and tokens in directory
+        void cache(std::string directory, std::uint64_t max_bytes = 256ULL * 1024 * 1024) {
+            _cache_directory = std::move(directory);
+            _cache_max_bytes = max_bytes;
+            for (auto &w : _workers) {
+                w._cache.reset();
+                if (w._lexer && !_cache_directory.empty()) {
+                    w._cache.reset(new token_cache(_cache_directory, _cache_max_bytes));
+                }
+            }
+        }
+
+        // names of the symbols in ID_OR_KW tokens of every graph so far
+        const symbol_table &symbols() const {
+            return _symbols;
+        }
+
+        // the workers' lexer_stats added up, like basic_batch_lexer::stats()
+        lexer_stats stats() const {
+            lexer_stats total;
+            for (const auto &w : _workers) {
+                if (w._lexer) {
+                    total.merge(w._lexer->stats());
+                }
+            }
+            return total;
+        }
+
+        // Load roots and every module they import. A root that can not be
+        // read is kept with its error like a module that does not lex.
+        module_graph load(const std::vector<std::string> &roots) {
+            loading state;
+            std::vector<std::string> root_paths;
+            for (const auto &root : roots) {
+                std::string path;
+                if (!canonical_file(root, path)) {
+                    // lexing it reports why
+                    path = root;
+                }
+                root_paths.push_back(path);
+                state.add(path);
+            }
+            std::size_t root_count = state._modules.size();
+
+            std::string cached_graph;
+            if (!_cache_directory.empty()) {
+                cached_graph = graph_path(root_paths);
+                std::string path;
+                for (const auto &file : read_graph(cached_graph)) {
+                    if (canonical_file(file, path)) {
+                        state.add(path);
+                    }
+                }
+            }
+
+            state._queue.run(_threads, [&](std::size_t self, std::size_t job) {
+                load_module(self, state, static_cast<module_index>(job));
+            });
+
+            // number what the roots reach breadth first, cached modules
+            // that are not imported any more are dropped
+            const module_index none = std::numeric_limits<module_index>::max();
+            std::vector<module_index> renumbered(state._modules.size(), none);
+            std::vector<module_index> reached;
+            for (module_index root = 0; root < root_count; ++root) {
+                renumbered[root] = static_cast<module_index>(reached.size());
+                reached.push_back(root);
+            }
+            for (std::size_t i = 0; i < reached.size(); ++i) {
+                for (module_index imported : state._modules[reached[i]]->_imports) {
+                    if (renumbered[imported] == none) {
+                        renumbered[imported] = static_cast<module_index>(reached.size());
+                        reached.push_back(imported);
+                    }
+                }
+            }
+
+            module_graph graph;
+            graph._roots = root_count;
+            graph._modules.reserve(reached.size());
+            for (module_index old : reached) {
+                loaded_module &m = *state._modules[old];
+                for (auto &imported : m._imports) {
+                    imported = renumbered[imported];
+                }
+                _workers[state._lexed_by[old]].rename(_symbols, m._file);
+                graph._modules.push_back(std::move(m));
+            }
+            if (!cached_graph.empty()) {
+                write_graph(cached_graph, graph);
+            }
+            return graph;
+        }
+    };
+
+    using module_loader = basic_module_loader<mpp::codecvt::charset, operator_trie>;
+    using utf8_module_loader = basic_module_loader<mpp::codecvt::utf8, default_operator_set>;
+}
+
+namespace cs {
+    using cs_impl::basic_module_loader;
+    using cs_impl::module_graph;
+    using cs_impl::module_index;
+    using cs_impl::module_loader;
+    using cs_impl::utf8_module_loader;
+}
@@ -0,0 +1,116 @@
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include "lexer.hpp"
+
+// covscript-number-test: floating literals near the top of the double range,
+// and an e after a number that starts no exponent
+//
+// exits with 1 when a check fails, run by ctest.
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what) {
+    if (!ok) {
+        ++failures;
+        std::printf("FAIL: %s\n", what.c_str());
+    }
+}
+
+static double parse(const std::string &text) {
+    return cs_impl::parse_float_literal(text.data(), text.data() + text.size());
+}
+
+// 2^1024 - 2^970, halfway between the largest double and 2^1024
+static const char *const overflow_midpoint =
+    "17976931348623158079372897140530341507993413271003782693617377898044496829276475094664901797758720709633028641"
+    "66928879109465555478519404026306574886715058206819089020007083836762738548458177115317644757302700698555713669"
+    "59622842914819860834936475292719074168444365510704342711559699508093042880177904174497792";
+
+static void test_parse() {
+    std::string midpoint = overflow_midpoint;
+    // a tie rounds to even, which is 2^1024
+    check(std::isinf(parse(midpoint + ".0")), "the midpoint overflows");
+    // the digit deciding the rounding is dropped by the fast path
+    check(std::isinf(parse(midpoint + "0001e-4")), "just above the midpoint overflows");
+    check(parse(midpoint.substr(0, midpoint.size() - 1) + "19e-1") == std::numeric_limits<double>::max(),
+          "just below the midpoint is the largest double");
+    check(std::isinf(parse("1e309")), "1e309 overflows");
+}
+
+static void test_diagnostic() {
+    cs::utf8_lexer lexer{std::unique_ptr<mpp::codecvt::utf8>(new mpp::codecvt::utf8), cs_impl::lexer_engine::UTF8};
+    std::string literal = std::string(overflow_midpoint) + "0001e-4";
+    lexer.source(literal + "\n");
+
+    cs_impl::token_stream tokens;
+    cs_impl::lexer_diagnostics diagnostics;
+    lexer.lex(tokens, diagnostics);
+    check(diagnostics.size() == 1 && diagnostics[0]._code == cs_impl::lexer_error_code::FLOAT_OUT_OF_RANGE,
+          "the recovering lexer reports FLOAT_OUT_OF_RANGE");
+    check(diagnostics.size() == 1 && diagnostics.text(diagnostics[0]) == literal,
+          "the diagnostic is on the literal");
+
+    bool thrown = false;
+    try {
+        lexer.lex(tokens);
+    } catch (const cs_impl::lexer_error &e) {
+        thrown = std::string(e.what()) == "floating literal " + literal + " is out of range";
+    }
+    check(thrown, "the lexer throws FLOAT_OUT_OF_RANGE");
+}
+
+// types and text of the tokens, separated by spaces, or the error
+static std::string lex_types(cs_impl::lexer_engine engine, const std::string &text) {
+    cs::utf8_lexer lexer{std::unique_ptr<mpp::codecvt::utf8>(new mpp::codecvt::utf8), engine};
+    lexer.source(text);
+    cs_impl::token_stream tokens;
+    try {
+        lexer.lex(tokens);
+    } catch (const cs_impl::lexer_error &e) {
+        return std::string("error: ") + e.what();
+    }
+    std::string out;
+    for (const auto &r : tokens) {
+        switch (r._type) {
+            case cs_impl::token_type::INT_LITERAL:
+                out += "int:" + std::to_string(tokens.int_value(r));
+                break;
+            case cs_impl::token_type::FLOATING_LITERAL:
+                out += "float:" + tokens.text(r);
+                break;
+            case cs_impl::token_type::ID_OR_KW:
+                out += "id:" + tokens.text(r);
+                break;
+            default:
+                out += tokens.text(r);
+                break;
+        }
+        out += " ";
+    }
+    return out;
+}
+
+static void test_exponent_suffix() {
+    for (auto engine : {cs_impl::lexer_engine::WIDE, cs_impl::lexer_engine::UTF8}) {
+        check(lex_types(engine, "2em") == "int:2 id:em ", "2em is 2 and em");
+        check(lex_types(engine, "3exp") == "int:3 id:exp ", "3exp is 3 and exp");
+        check(lex_types(engine, "5e") == "int:5 id:e ", "5e is 5 and e");
+        check(lex_types(engine, "0e\n") == "int:0 id:e ", "0e is 0 and e");
+        check(lex_types(engine, "1.5e+x") == "float:1.5 id:e + id:x ", "1.5e+x is 1.5, e, + and x");
+        check(lex_types(engine, "7E-") == "int:7 id:E - ", "7E- is 7, E and -");
+        check(lex_types(engine, "2e3 2E+3 2.5e-1") == "float:2e3 float:2E+3 float:2.5e-1 ",
+              "exponents with digits are kept");
+    }
+}
+
+int main() {
+    test_parse();
+    test_diagnostic();
+    test_exponent_suffix();
+    if (failures == 0) {
+        std::printf("all passed\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
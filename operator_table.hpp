@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "token.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // operator definitions
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct operator_def {
+        const char *_text;
+        operator_type _type;
+    };
+
+    // operators of CovScript
+    constexpr operator_def default_operators[] = {
+        {"+",   operator_type::OPERATOR_ADD},
+        {"-",   operator_type::OPERATOR_SUB},
+        {"*",   operator_type::OPERATOR_MUL},
+        {"/",   operator_type::OPERATOR_DIV},
+        {"%",   operator_type::OPERATOR_MOD},
+        {"=",   operator_type::OPERATOR_ASSIGN},
+        {"+=",  operator_type::OPERATOR_ADD_ASSIGN},
+        {"-=",  operator_type::OPERATOR_SUB_ASSIGN},
+        {"*=",  operator_type::OPERATOR_MUL_ASSIGN},
+        {"/=",  operator_type::OPERATOR_DIV_ASSIGN},
+        {"%=",  operator_type::OPERATOR_MOD_ASSIGN},
+        {"&=",  operator_type::OPERATOR_AND_ASSIGN},
+        {"|=",  operator_type::OPERATOR_OR_ASSIGN},
+        {"^=",  operator_type::OPERATOR_XOR_ASSIGN},
+        {"==",  operator_type::OPERATOR_EQ},
+        {"!=",  operator_type::OPERATOR_NE},
+        {">",   operator_type::OPERATOR_GT},
+        {">=",  operator_type::OPERATOR_GE},
+        {"<",   operator_type::OPERATOR_LT},
+        {"<=",  operator_type::OPERATOR_LE},
+        {":",   operator_type::OPERATOR_COLON},
+        {",",   operator_type::OPERATOR_COMMA},
+        {"?",   operator_type::OPERATOR_QUESTION},
+        {"++",  operator_type::OPERATOR_INC},
+        {"--",  operator_type::OPERATOR_DEC},
+        {"->",  operator_type::OPERATOR_ARROW},
+        {".",   operator_type::OPERATOR_DOT},
+        {"&&",  operator_type::OPERATOR_AND},
+        {"||",  operator_type::OPERATOR_OR},
+        {"!",   operator_type::OPERATOR_NOT},
+        {"&",   operator_type::OPERATOR_BITAND},
+        {"|",   operator_type::OPERATOR_BITOR},
+        {"^",   operator_type::OPERATOR_BITXOR},
+        {"~",   operator_type::OPERATOR_BITNOT},
+        {"...", operator_type::OPERATOR_VARARG},
+        {"(",   operator_type::OPERATOR_LPAREN},
+        {")",   operator_type::OPERATOR_RPAREN},
+        {"[",   operator_type::OPERATOR_LBRACKET},
+        {"]",   operator_type::OPERATOR_RBRACKET},
+        {"{",   operator_type::OPERATOR_LBRACE},
+        {"}",   operator_type::OPERATOR_RBRACE},
+        {";",   operator_type::OPERATOR_SEMI},
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // operator trie
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Both tables below answer the same question: starting at `current`,
+    // what is the longest registered operator? `next(current, end)` decodes
+    // one char and advances, `stop(c)` ends the walk at chars that cannot
+    // be part of an operator. Returns the end of the match (`current` itself
+    // when nothing matched) and its type.
+
+    // longest-match trie built at runtime by lexer::add_operators.
+    // ASCII transitions are dense, others are looked up in a sorted list.
+    struct operator_trie {
+    private:
+        using node_t = std::uint16_t;
+
+        struct wide_edge {
+            node_t _from;
+            char32_t _char;
+            node_t _to;
+
+            bool operator<(const wide_edge &o) const {
+                return _from != o._from ? _from < o._from : _char < o._char;
+            }
+        };
+
+        std::vector<std::array<node_t, 128>> _ascii;
+        std::vector<operator_type> _types;
+        std::vector<wide_edge> _wide;
+        std::vector<std::pair<std::string, operator_type>> _entries;
+
+        node_t child(node_t node, char32_t c) const {
+            if (c < 128) {
+                return _ascii[node][c];
+            }
+            auto iter = std::lower_bound(_wide.begin(), _wide.end(), wide_edge{node, c, 0});
+            return iter != _wide.end() && iter->_from == node && iter->_char == c ? iter->_to : 0;
+        }
+
+        node_t new_node() {
+            if (_types.size() > std::numeric_limits<node_t>::max()) {
+                throw std::length_error("too many operators");
+            }
+            _ascii.emplace_back();
+            _ascii.back().fill(0);
+            _types.push_back(operator_type::UNDEFINED);
+            return static_cast<node_t>(_types.size() - 1);
+        }
+
+    public:
+        operator_trie() {
+            // root
+            new_node();
+        }
+
+        // text is the operator in local encoding, wide is the same text decoded.
+        // the first definition of an operator wins.
+        void add(const std::string &text, const std::u32string &wide, operator_type type) {
+            node_t node = 0;
+            for (char32_t c : wide) {
+                node_t next = child(node, c);
+                if (next == 0) {
+                    next = new_node();
+                    if (c < 128) {
+                        _ascii[node][c] = next;
+                    } else {
+                        wide_edge edge{node, c, next};
+                        _wide.insert(std::upper_bound(_wide.begin(), _wide.end(), edge), edge);
+                    }
+                }
+                node = next;
+            }
+            if (node != 0 && _types[node] == operator_type::UNDEFINED) {
+                _types[node] = type;
+                _entries.emplace_back(text, type);
+            }
+        }
+
+        // registered operators in the order they were added
+        const std::vector<std::pair<std::string, operator_type>> &entries() const {
+            return _entries;
+        }
+
+        template <typename IterT, typename NextFn, typename StopFn>
+        std::pair<IterT, operator_type> match(IterT current, IterT end,
+                                              NextFn &&next, StopFn &&stop) const {
+            std::pair<IterT, operator_type> best{current, operator_type::UNDEFINED};
+            node_t node = 0;
+            while (current < end) {
+                IterT after = current;
+                char32_t c = next(after, end);
+                if (stop(c) || (node = child(node, c)) == 0) {
+                    break;
+                }
+                current = after;
+                if (_types[node] != operator_type::UNDEFINED) {
+                    best = std::make_pair(current, _types[node]);
+                }
+            }
+            return best;
+        }
+    };
+
+    // dense ASCII-only table built at compile time, for a fixed operator set
+    template <std::size_t MaxNodes>
+    struct static_operator_table {
+        std::uint8_t _next[MaxNodes][128];
+        operator_type _types[MaxNodes];
+        std::size_t _size;
+
+        template <typename IterT, typename NextFn, typename StopFn>
+        std::pair<IterT, operator_type> match(IterT current, IterT end,
+                                              NextFn &&next, StopFn &&stop) const {
+            std::pair<IterT, operator_type> best{current, operator_type::UNDEFINED};
+            std::size_t node = 0;
+            while (current < end) {
+                IterT after = current;
+                char32_t c = next(after, end);
+                if (c >= 128 || stop(c) || (node = _next[node][c]) == 0) {
+                    break;
+                }
+                current = after;
+                if (_types[node] != operator_type::UNDEFINED) {
+                    best = std::make_pair(current, _types[node]);
+                }
+            }
+            return best;
+        }
+    };
+
+    // fails to compile when the operators do not fit or are not ASCII
+    template <std::size_t MaxNodes, std::size_t N>
+    constexpr static_operator_table<MaxNodes> make_operator_table(const operator_def (&defs)[N]) {
+        static_assert(MaxNodes <= 256, "node index must fit in one byte");
+        static_operator_table<MaxNodes> table{};
+        table._size = 1;
+        for (std::size_t i = 0; i < N; ++i) {
+            std::size_t node = 0;
+            for (const char *p = defs[i]._text; *p != '\0'; ++p) {
+                auto c = static_cast<unsigned char>(*p);
+                if (c >= 128) {
+                    throw std::invalid_argument("static operator table is ASCII only");
+                }
+                if (table._next[node][c] == 0) {
+                    if (table._size == MaxNodes) {
+                        throw std::length_error("too many operator table nodes");
+                    }
+                    table._next[node][c] = static_cast<std::uint8_t>(table._size++);
+                }
+                node = table._next[node][c];
+            }
+            if (table._types[node] == operator_type::UNDEFINED) {
+                table._types[node] = defs[i]._type;
+            }
+        }
+        return table;
+    }
+
+    constexpr auto default_operator_table = make_operator_table<64>(default_operators);
+
+    // default_operator_table as an OperatorTable of basic_lexer
+    struct default_operator_set {
+        template <typename IterT, typename NextFn, typename StopFn>
+        std::pair<IterT, operator_type> match(IterT current, IterT end,
+                                              NextFn &&next, StopFn &&stop) const {
+            return default_operator_table.match(current, end, std::forward<NextFn>(next),
+                                                std::forward<StopFn>(stop));
+        }
+    };
+}
@@ -0,0 +1,772 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <mozart++/format>
+#include "ast.hpp"
+#include "symbol_table.hpp"
+#include "token_stream.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // parser
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct parser_error : public std::runtime_error {
+        std::size_t _line;
+        std::size_t _start_column;
+        std::size_t _end_column;
+        std::string _error_text;
+
+        explicit parser_error(std::size_t line, std::size_t start_column, std::size_t end_column,
+                              std::string error_text, const std::string &message)
+            : std::runtime_error(message), _line(line),
+              _start_column(start_column), _end_column(end_column),
+              _error_text(std::move(error_text)) {
+        }
+
+        ~parser_error() override = default;
+    };
+
+    // how tightly an infix operator holds its operands, 0 for none.
+    // an operand is parsed with the right power, so left == right
+    // makes an operator right associative.
+    struct binding_power {
+        std::uint8_t _left;
+        std::uint8_t _right;
+    };
+
+    constexpr std::uint8_t assignment_power = 10;
+    constexpr std::uint8_t prefix_power = 130;
+    constexpr std::uint8_t postfix_power = 140;
+
+    constexpr binding_power infix_power(operator_type op) {
+        switch (op) {
+            case operator_type::OPERATOR_ASSIGN:
+            case operator_type::OPERATOR_ADD_ASSIGN:
+            case operator_type::OPERATOR_SUB_ASSIGN:
+            case operator_type::OPERATOR_MUL_ASSIGN:
+            case operator_type::OPERATOR_DIV_ASSIGN:
+            case operator_type::OPERATOR_MOD_ASSIGN:
+            case operator_type::OPERATOR_AND_ASSIGN:
+            case operator_type::OPERATOR_OR_ASSIGN:
+            case operator_type::OPERATOR_XOR_ASSIGN:
+                return {assignment_power, assignment_power};
+            case operator_type::OPERATOR_QUESTION:
+                return {20, 20};
+            // pairs, e.g. {"key": value}
+            case operator_type::OPERATOR_COLON:
+                return {30, 31};
+            case operator_type::OPERATOR_OR:
+                return {40, 41};
+            case operator_type::OPERATOR_AND:
+                return {50, 51};
+            case operator_type::OPERATOR_BITOR:
+                return {60, 61};
+            case operator_type::OPERATOR_BITXOR:
+                return {70, 71};
+            case operator_type::OPERATOR_BITAND:
+                return {80, 81};
+            case operator_type::OPERATOR_EQ:
+            case operator_type::OPERATOR_NE:
+                return {90, 91};
+            case operator_type::OPERATOR_GT:
+            case operator_type::OPERATOR_GE:
+            case operator_type::OPERATOR_LT:
+            case operator_type::OPERATOR_LE:
+                return {100, 101};
+            case operator_type::OPERATOR_ADD:
+            case operator_type::OPERATOR_SUB:
+                return {110, 111};
+            case operator_type::OPERATOR_MUL:
+            case operator_type::OPERATOR_DIV:
+            case operator_type::OPERATOR_MOD:
+                return {120, 121};
+            case operator_type::OPERATOR_INC:
+            case operator_type::OPERATOR_DEC:
+            case operator_type::OPERATOR_LPAREN:
+            case operator_type::OPERATOR_LBRACKET:
+            case operator_type::OPERATOR_DOT:
+            case operator_type::OPERATOR_ARROW:
+                return {postfix_power, postfix_power};
+            default:
+                return {0, 0};
+        }
+    }
+
+    constexpr bool is_assignment(operator_type op) {
+        return infix_power(op)._left == assignment_power;
+    }
+
+    // Pratt parser from a token_stream to an ast. Statements are not
+    // terminated, one ends where the next can not go on with its tokens;
+    // like in CovScript a line break ends an expression before an operator
+    // that could also start one (e.g. `(` or `-`), unless inside brackets.
+    // The first error is thrown as a parser_error.
+    struct parser {
+    private:
+        const token_stream *_tokens = nullptr;
+        ast *_tree = nullptr;
+        std::size_t _pos = 0;
+        // open brackets around the expression being parsed
+        std::size_t _nesting = 0;
+        // in the middle of a ternary and not in brackets inside it,
+        // where ':' ends the middle instead of making a pair
+        bool _ternary_middle = false;
+        std::size_t _depth = 0;
+
+        // deeper nesting is refused instead of running out of stack
+        static constexpr std::size_t max_depth = 256;
+
+        struct depth_guard {
+            parser &_parser;
+
+            explicit depth_guard(parser &p) : _parser(p) {
+                if (++_parser._depth > max_depth) {
+                    _parser.fail("too deeply nested code");
+                }
+            }
+
+            ~depth_guard() {
+                --_parser._depth;
+            }
+        };
+
+        // brackets let expressions run over line breaks, and make pairs
+        // again in the middle of a ternary
+        struct nesting_guard {
+            parser &_parser;
+            bool _ternary_middle;
+
+            explicit nesting_guard(parser &p) : _parser(p), _ternary_middle(p._ternary_middle) {
+                ++_parser._nesting;
+                _parser._ternary_middle = false;
+            }
+
+            ~nesting_guard() {
+                --_parser._nesting;
+                _parser._ternary_middle = _ternary_middle;
+            }
+        };
+
+        bool at_end() const {
+            return _pos >= _tokens->size();
+        }
+
+        const token_record &current() const {
+            return (*_tokens)[_pos];
+        }
+
+        keyword_type keyword() const {
+            if (at_end() || current()._type != token_type::ID_OR_KW) {
+                return keyword_type::UNDEFINED;
+            }
+            return _tokens->keyword(current());
+        }
+
+        operator_type op() const {
+            if (at_end() || current()._type != token_type::OPERATOR) {
+                return operator_type::UNDEFINED;
+            }
+            return current()._op_type;
+        }
+
+        std::uint32_t advance() {
+            return static_cast<std::uint32_t>(_pos++);
+        }
+
+        bool accept(operator_type type) {
+            if (op() == type) {
+                ++_pos;
+                return true;
+            }
+            return false;
+        }
+
+        bool accept(keyword_type type) {
+            if (keyword() == type) {
+                ++_pos;
+                return true;
+            }
+            return false;
+        }
+
+        void expect(operator_type type, const char *what) {
+            if (!accept(type)) {
+                fail_expected(what);
+            }
+        }
+
+        void expect(keyword_type type, const char *what) {
+            if (!accept(type)) {
+                fail_expected(what);
+            }
+        }
+
+        std::uint32_t expect_name() {
+            if (at_end() || current()._type != token_type::ID_OR_KW || keyword() != keyword_type::UNDEFINED) {
+                fail_expected("a name");
+            }
+            return advance();
+        }
+
+        // where a token starts, for custom literals the literal before the suffix
+        std::uint32_t start_of(const token_record &r) const {
+            return r._type == token_type::CUSTOM_LITERAL ? _tokens->custom_literal(r)._offset : r._offset;
+        }
+
+        template <typename UnitT>
+        static bool has_newline(const UnitT *p, const UnitT *end) {
+            for (; p < end; ++p) {
+                if (*p == static_cast<UnitT>(U'\n')) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // a line break between the current token and the one before
+        bool newline_before() const {
+            const source_buffer *source = _tokens->source().get();
+            if (_pos == 0 || at_end() || source == nullptr) {
+                return false;
+            }
+            const token_record &prev = (*_tokens)[_pos - 1];
+            std::uint32_t from = prev._offset + prev._length;
+            std::uint32_t to = start_of(current());
+            if (source->encoding() == source_encoding::UTF8) {
+                return has_newline(source->data<unsigned char>() + from, source->data<unsigned char>() + to);
+            }
+            return has_newline(source->data<char32_t>() + from, source->data<char32_t>() + to);
+        }
+
+        [[noreturn]] void fail(const std::string &message) const {
+            const source_buffer *source = _tokens->source().get();
+            if (source == nullptr) {
+                throw parser_error(0, 0, 0, std::string{}, message);
+            }
+            if (at_end()) {
+                auto at = source->location(static_cast<std::uint32_t>(source->length()));
+                throw parser_error(at._line, at._column, at._column, std::string{}, message);
+            }
+            const token_record &r = current();
+            std::uint32_t start = start_of(r);
+            std::uint32_t length = r._offset + r._length - start;
+            auto at = source->location(start);
+            throw parser_error(at._line, at._column, at._column + source->count_chars(start, length),
+                               source->local(start, length), message);
+        }
+
+        [[noreturn]] void fail_expected(const char *what) const {
+            if (at_end()) {
+                fail(mpp::format("expected {}, got end of file", what));
+            }
+            fail(mpp::format("expected {}, got '{}'", what, _tokens->text(current())));
+        }
+
+        ast_index make(ast_kind kind, std::uint32_t token, operator_type type,
+                       ast_index a = no_node, ast_index b = no_node, ast_index c = no_node) {
+            ast_index node = _tree->make(kind, token, a, b, c);
+            (*_tree)[node]._op = type;
+            return node;
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // expressions
+        ////////////////////////////////////////////////////////////////////////////////
+
+        bool starts_expression() const {
+            if (at_end()) {
+                return false;
+            }
+            switch (current()._type) {
+                case token_type::ID_OR_KW:
+                    switch (keyword()) {
+                        case keyword_type::UNDEFINED:
+                        case keyword_type::KEYWORD_TRUE:
+                        case keyword_type::KEYWORD_FALSE:
+                        case keyword_type::KEYWORD_NULL:
+                        case keyword_type::KEYWORD_NOT:
+                        case keyword_type::KEYWORD_NEW:
+                        case keyword_type::KEYWORD_GCNEW:
+                        case keyword_type::KEYWORD_TYPEID:
+                        case keyword_type::KEYWORD_LOCAL:
+                        case keyword_type::KEYWORD_GLOBAL:
+                            return true;
+                        default:
+                            return false;
+                    }
+                case token_type::INT_LITERAL:
+                case token_type::FLOATING_LITERAL:
+                case token_type::STRING_LITERAL:
+                case token_type::CHAR_LITERAL:
+                case token_type::CUSTOM_LITERAL:
+                    return true;
+                case token_type::OPERATOR:
+                    switch (current()._op_type) {
+                        case operator_type::OPERATOR_ADD:
+                        case operator_type::OPERATOR_SUB:
+                        case operator_type::OPERATOR_NOT:
+                        case operator_type::OPERATOR_BITNOT:
+                        case operator_type::OPERATOR_INC:
+                        case operator_type::OPERATOR_DEC:
+                        case operator_type::OPERATOR_VARARG:
+                        case operator_type::OPERATOR_LPAREN:
+                        case operator_type::OPERATOR_LBRACKET:
+                        case operator_type::OPERATOR_LBRACE:
+                            return true;
+                        default:
+                            return false;
+                    }
+                default:
+                    return false;
+            }
+        }
+
+        // comma separated expressions up to the closing bracket
+        ast_index expression_list(operator_type close, const char *what) {
+            nesting_guard nesting(*this);
+            ast_list list;
+            if (accept(close)) {
+                return list._first;
+            }
+            do {
+                list.push(*_tree, expression(0));
+            } while (accept(operator_type::OPERATOR_COMMA));
+            expect(close, what);
+            return list._first;
+        }
+
+        // (a, b, ...rest)
+        ast_index parameters() {
+            nesting_guard nesting(*this);
+            expect(operator_type::OPERATOR_LPAREN, "'('");
+            ast_list list;
+            if (accept(operator_type::OPERATOR_RPAREN)) {
+                return list._first;
+            }
+            do {
+                if (op() == operator_type::OPERATOR_VARARG) {
+                    std::uint32_t token = advance();
+                    ast_index name = _tree->make(ast_kind::NAME, expect_name());
+                    list.push(*_tree, make(ast_kind::UNARY, token, operator_type::OPERATOR_VARARG, name));
+                } else {
+                    list.push(*_tree, _tree->make(ast_kind::NAME, expect_name()));
+                }
+            } while (accept(operator_type::OPERATOR_COMMA));
+            expect(operator_type::OPERATOR_RPAREN, "')'");
+            return list._first;
+        }
+
+        ast_index prefix() {
+            if (at_end()) {
+                fail("expected an expression, got end of file");
+            }
+            const token_record &r = current();
+            switch (r._type) {
+                case token_type::INT_LITERAL:
+                case token_type::FLOATING_LITERAL:
+                case token_type::STRING_LITERAL:
+                case token_type::CHAR_LITERAL:
+                case token_type::CUSTOM_LITERAL:
+                    return _tree->make(ast_kind::LITERAL, advance());
+                case token_type::ID_OR_KW:
+                    switch (keyword()) {
+                        case keyword_type::UNDEFINED:
+                        case keyword_type::KEYWORD_LOCAL:
+                        case keyword_type::KEYWORD_GLOBAL:
+                            return _tree->make(ast_kind::NAME, advance());
+                        case keyword_type::KEYWORD_TRUE:
+                        case keyword_type::KEYWORD_FALSE:
+                        case keyword_type::KEYWORD_NULL:
+                            return _tree->make(ast_kind::CONSTANT, advance());
+                        case keyword_type::KEYWORD_NOT: {
+                            std::uint32_t token = advance();
+                            return make(ast_kind::UNARY, token, operator_type::OPERATOR_NOT, expression(prefix_power));
+                        }
+                        case keyword_type::KEYWORD_NEW:
+                        case keyword_type::KEYWORD_GCNEW:
+                        case keyword_type::KEYWORD_TYPEID: {
+                            std::uint32_t token = advance();
+                            return make(ast_kind::UNARY, token, operator_type::UNDEFINED, expression(prefix_power));
+                        }
+                        default:
+                            break;
+                    }
+                    break;
+                case token_type::OPERATOR:
+                    switch (r._op_type) {
+                        case operator_type::OPERATOR_ADD:
+                        case operator_type::OPERATOR_SUB:
+                        case operator_type::OPERATOR_NOT:
+                        case operator_type::OPERATOR_BITNOT:
+                        case operator_type::OPERATOR_INC:
+                        case operator_type::OPERATOR_DEC:
+                        case operator_type::OPERATOR_VARARG: {
+                            std::uint32_t token = advance();
+                            return make(ast_kind::UNARY, token, r._op_type, expression(prefix_power));
+                        }
+                        case operator_type::OPERATOR_LPAREN: {
+                            nesting_guard nesting(*this);
+                            advance();
+                            ast_index inner = expression(0);
+                            expect(operator_type::OPERATOR_RPAREN, "')'");
+                            return inner;
+                        }
+                        case operator_type::OPERATOR_LBRACE: {
+                            std::uint32_t token = advance();
+                            return _tree->make(ast_kind::ARRAY, token,
+                                               expression_list(operator_type::OPERATOR_RBRACE, "'}'"));
+                        }
+                        case operator_type::OPERATOR_LBRACKET: {
+                            // [](params) -> expression
+                            std::uint32_t token = advance();
+                            expect(operator_type::OPERATOR_RBRACKET, "']'");
+                            ast_index params = parameters();
+                            expect(operator_type::OPERATOR_ARROW, "'->'");
+                            return _tree->make(ast_kind::LAMBDA, token, params, expression(0));
+                        }
+                        default:
+                            break;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            fail(mpp::format("unexpected '{}'", _tokens->text(r)));
+        }
+
+        ast_index expression(std::uint8_t min_power) {
+            depth_guard depth(*this);
+            ast_index left = prefix();
+            while (!at_end()) {
+                operator_type type = op();
+                switch (keyword()) {
+                    case keyword_type::KEYWORD_AND:
+                        type = operator_type::OPERATOR_AND;
+                        break;
+                    case keyword_type::KEYWORD_OR:
+                        type = operator_type::OPERATOR_OR;
+                        break;
+                    default:
+                        break;
+                }
+                binding_power power = infix_power(type);
+                if (power._left == 0 || power._left < min_power) {
+                    break;
+                }
+                if (type == operator_type::OPERATOR_COLON && _ternary_middle) {
+                    // ends the middle of a ternary
+                    break;
+                }
+                switch (type) {
+                    case operator_type::OPERATOR_ADD:
+                    case operator_type::OPERATOR_SUB:
+                    case operator_type::OPERATOR_INC:
+                    case operator_type::OPERATOR_DEC:
+                    case operator_type::OPERATOR_LPAREN:
+                    case operator_type::OPERATOR_LBRACKET:
+                        // could start the next statement
+                        if (_nesting == 0 && newline_before()) {
+                            return left;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+
+                std::uint32_t token = advance();
+                switch (type) {
+                    case operator_type::OPERATOR_INC:
+                    case operator_type::OPERATOR_DEC:
+                        left = make(ast_kind::POSTFIX, token, type, left);
+                        break;
+                    case operator_type::OPERATOR_LPAREN:
+                        left = make(ast_kind::CALL, token, type, left,
+                                    expression_list(operator_type::OPERATOR_RPAREN, "')'"));
+                        break;
+                    case operator_type::OPERATOR_LBRACKET: {
+                        nesting_guard nesting(*this);
+                        ast_index index = expression(0);
+                        expect(operator_type::OPERATOR_RBRACKET, "']'");
+                        left = make(ast_kind::INDEX, token, type, left, index);
+                        break;
+                    }
+                    case operator_type::OPERATOR_DOT:
+                    case operator_type::OPERATOR_ARROW:
+                        left = make(ast_kind::MEMBER, token, type, left, _tree->make(ast_kind::NAME, expect_name()));
+                        break;
+                    case operator_type::OPERATOR_QUESTION: {
+                        // the middle may hold another ternary, a ':' outside
+                        // of it ends the middle
+                        bool middle = _ternary_middle;
+                        _ternary_middle = true;
+                        ast_index then = expression(power._right);
+                        _ternary_middle = middle;
+                        expect(operator_type::OPERATOR_COLON, "':'");
+                        left = make(ast_kind::TERNARY, token, type, left, then, expression(power._right));
+                        break;
+                    }
+                    default:
+                        left = make(is_assignment(type) ? ast_kind::ASSIGN : ast_kind::BINARY, token, type,
+                                    left, expression(power._right));
+                        break;
+                }
+            }
+            return left;
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // statements
+        ////////////////////////////////////////////////////////////////////////////////
+
+        bool at_keyword(std::initializer_list<keyword_type> keywords) const {
+            keyword_type kw = keyword();
+            for (keyword_type k : keywords) {
+                if (kw == k) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // statements up to one of the keywords, which is not consumed
+        ast_index body(std::initializer_list<keyword_type> stops, const char *what) {
+            ast_list list;
+            while (!at_keyword(stops)) {
+                if (at_end()) {
+                    fail_expected(what);
+                }
+                ast_index node = statement();
+                if (node != no_node) {
+                    list.push(*_tree, node);
+                }
+            }
+            return list._first;
+        }
+
+        // statements up to `end`, which is consumed
+        ast_index block() {
+            ast_index first = body({keyword_type::KEYWORD_END}, "'end'");
+            advance();
+            return first;
+        }
+
+        // a.b.c
+        ast_index path() {
+            ast_index node = _tree->make(ast_kind::NAME, expect_name());
+            while (op() == operator_type::OPERATOR_DOT) {
+                std::uint32_t token = advance();
+                node = make(ast_kind::MEMBER, token, operator_type::OPERATOR_DOT, node,
+                            _tree->make(ast_kind::NAME, expect_name()));
+            }
+            return node;
+        }
+
+        ast_index var_statement(std::uint16_t flags) {
+            std::uint32_t name = expect_name();
+            ast_index init = no_node;
+            if (accept(operator_type::OPERATOR_ASSIGN)) {
+                init = expression(0);
+            }
+            ast_index node = _tree->make(ast_kind::VAR, name, init);
+            (*_tree)[node]._flags = flags;
+            return node;
+        }
+
+        ast_index function_statement(std::uint16_t flags) {
+            std::uint32_t name = expect_name();
+            ast_index params = parameters();
+            if (accept(keyword_type::KEYWORD_OVERRIDE)) {
+                flags |= AST_OVERRIDE;
+            }
+            ast_index node = _tree->make(ast_kind::FUNCTION, name, params, block());
+            (*_tree)[node]._flags = flags;
+            return node;
+        }
+
+        ast_index statement() {
+            depth_guard depth(*this);
+            if (current()._type == token_type::PREPROCESSOR) {
+                return _tree->make(ast_kind::PREPROCESSOR, advance());
+            }
+            if (accept(operator_type::OPERATOR_SEMI)) {
+                return no_node;
+            }
+
+            switch (keyword()) {
+                case keyword_type::KEYWORD_IMPORT: {
+                    std::uint32_t token = advance();
+                    ast_list paths;
+                    do {
+                        paths.push(*_tree, path());
+                    } while (accept(operator_type::OPERATOR_COMMA));
+                    return _tree->make(ast_kind::IMPORT, token, paths._first);
+                }
+                case keyword_type::KEYWORD_PACKAGE: {
+                    std::uint32_t token = advance();
+                    return _tree->make(ast_kind::PACKAGE, token, path());
+                }
+                case keyword_type::KEYWORD_USING: {
+                    std::uint32_t token = advance();
+                    return _tree->make(ast_kind::USING, token, expression(0));
+                }
+                case keyword_type::KEYWORD_VAR:
+                    advance();
+                    return var_statement(0);
+                case keyword_type::KEYWORD_CONST:
+                    advance();
+                    expect(keyword_type::KEYWORD_VAR, "'var'");
+                    return var_statement(AST_CONST);
+                case keyword_type::KEYWORD_FUNCTION:
+                    advance();
+                    return function_statement(0);
+                case keyword_type::KEYWORD_RETURN: {
+                    std::uint32_t token = advance();
+                    ast_index value = no_node;
+                    if (starts_expression() && !newline_before()) {
+                        value = expression(0);
+                    }
+                    return _tree->make(ast_kind::RETURN, token, value);
+                }
+                case keyword_type::KEYWORD_BREAK:
+                    return _tree->make(ast_kind::BREAK, advance());
+                case keyword_type::KEYWORD_CONTINUE:
+                    return _tree->make(ast_kind::CONTINUE, advance());
+                case keyword_type::KEYWORD_THROW: {
+                    std::uint32_t token = advance();
+                    return _tree->make(ast_kind::THROW, token, expression(0));
+                }
+                case keyword_type::KEYWORD_BLOCK: {
+                    std::uint32_t token = advance();
+                    return _tree->make(ast_kind::BLOCK, token, block());
+                }
+                case keyword_type::KEYWORD_IF: {
+                    std::uint32_t token = advance();
+                    ast_index condition = expression(0);
+                    ast_index then = body({keyword_type::KEYWORD_ELSE, keyword_type::KEYWORD_END}, "'end'");
+                    ast_index otherwise = no_node;
+                    if (accept(keyword_type::KEYWORD_ELSE)) {
+                        otherwise = block();
+                    } else {
+                        advance();
+                    }
+                    return _tree->make(ast_kind::IF, token, condition, then, otherwise);
+                }
+                case keyword_type::KEYWORD_WHILE: {
+                    std::uint32_t token = advance();
+                    ast_index condition = expression(0);
+                    return _tree->make(ast_kind::WHILE, token, condition, block());
+                }
+                case keyword_type::KEYWORD_LOOP: {
+                    std::uint32_t token = advance();
+                    ast_index loop = body({keyword_type::KEYWORD_UNTIL, keyword_type::KEYWORD_END}, "'end'");
+                    ast_index until = no_node;
+                    if (accept(keyword_type::KEYWORD_UNTIL)) {
+                        until = expression(0);
+                    } else {
+                        advance();
+                    }
+                    return _tree->make(ast_kind::LOOP, token, loop, until);
+                }
+                case keyword_type::KEYWORD_FOR: {
+                    std::uint32_t token = advance();
+                    if (_pos + 1 < _tokens->size() && (*_tokens)[_pos + 1]._type == token_type::ID_OR_KW
+                        && _tokens->keyword((*_tokens)[_pos + 1]) == keyword_type::KEYWORD_IN) {
+                        // for name in range
+                        std::uint32_t name = expect_name();
+                        advance();
+                        ast_index range = expression(0);
+                        return _tree->make(ast_kind::FOR_IN, name, range, block());
+                    }
+                    // for init, condition, step
+                    ast_list header;
+                    header.push(*_tree, expression(0));
+                    expect(operator_type::OPERATOR_COMMA, "','");
+                    header.push(*_tree, expression(0));
+                    expect(operator_type::OPERATOR_COMMA, "','");
+                    header.push(*_tree, expression(0));
+                    return _tree->make(ast_kind::FOR, token, header._first, block());
+                }
+                case keyword_type::KEYWORD_TRY: {
+                    std::uint32_t token = advance();
+                    ast_index tried = body({keyword_type::KEYWORD_CATCH}, "'catch'");
+                    advance();
+                    ast_index name = _tree->make(ast_kind::NAME, expect_name());
+                    return _tree->make(ast_kind::TRY, token, tried, name, block());
+                }
+                case keyword_type::KEYWORD_SWITCH: {
+                    std::uint32_t token = advance();
+                    ast_index value = expression(0);
+                    ast_list cases;
+                    while (!accept(keyword_type::KEYWORD_END)) {
+                        auto label = static_cast<std::uint32_t>(_pos);
+                        ast_index match = no_node;
+                        if (accept(keyword_type::KEYWORD_CASE)) {
+                            match = expression(0);
+                        } else {
+                            expect(keyword_type::KEYWORD_DEFAULT, "'case', 'default' or 'end'");
+                        }
+                        cases.push(*_tree, _tree->make(ast_kind::CASE, label, match, block()));
+                    }
+                    return _tree->make(ast_kind::SWITCH, token, value, cases._first);
+                }
+                case keyword_type::KEYWORD_NAMESPACE: {
+                    advance();
+                    std::uint32_t name = expect_name();
+                    return _tree->make(ast_kind::NAMESPACE, name, no_node, block());
+                }
+                case keyword_type::KEYWORD_STRUCT:
+                case keyword_type::KEYWORD_CLASS: {
+                    std::uint16_t flags = keyword() == keyword_type::KEYWORD_CLASS ? AST_CLASS : 0;
+                    advance();
+                    std::uint32_t name = expect_name();
+                    ast_index base = no_node;
+                    if (accept(keyword_type::KEYWORD_EXTENDS)) {
+                        base = expression(0);
+                    }
+                    ast_index node = _tree->make(ast_kind::STRUCT, name, base, block());
+                    (*_tree)[node]._flags = flags;
+                    return node;
+                }
+                case keyword_type::KEYWORD_OVERRIDE:
+                    advance();
+                    expect(keyword_type::KEYWORD_FUNCTION, "'function'");
+                    return function_statement(AST_OVERRIDE);
+                default: {
+                    auto token = static_cast<std::uint32_t>(_pos);
+                    return _tree->make(ast_kind::EXPRESSION, token, expression(0));
+                }
+            }
+        }
+
+    public:
+        // parse tokens as a module into tree, what tree held is dropped
+        // but its blocks are reused
+        void parse(const token_stream &tokens, ast &tree) {
+            _tokens = &tokens;
+            _tree = &tree;
+            _pos = 0;
+            _nesting = 0;
+            _ternary_middle = false;
+            _depth = 0;
+            tree.clear();
+
+            ast_list statements;
+            while (!at_end()) {
+                ast_index node = statement();
+                if (node != no_node) {
+                    statements.push(tree, node);
+                }
+            }
+            tree.root(tree.make(ast_kind::MODULE, 0, statements._first));
+        }
+    };
+}
+
+namespace cs {
+    using cs_impl::parser;
+    using cs_impl::parser_error;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <mozart++/codecvt>
+#include "line_index.hpp"
+#include "transcode.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // source buffer
+    ////////////////////////////////////////////////////////////////////////////////
+
+    enum class source_encoding {
+        // decoded into char32_t, see transcoder
+        WIDE,
+        // raw UTF-8 bytes, used as is
+        UTF8,
+    };
+
+    // source text, shared by the lexer and every token stream
+    // lexed from it, so tokens only need to keep offsets into it.
+    // offsets are in code units of the encoding.
+    // text can only be appended, so offsets never go stale.
+    struct source_buffer {
+    private:
+        source_encoding _encoding;
+        std::u32string _wide;
+        std::string _bytes;
+        // UTF-8 bytes we do not own, kept alive by _mapping
+        const char *_mapped = nullptr;
+        std::size_t _mapped_length = 0;
+        std::shared_ptr<const void> _mapping;
+        std::shared_ptr<mpp::codecvt::charset> _charset;
+        transcoder _transcoder;
+        // built on the first lookup, shared by all threads lexing this text
+        mutable std::mutex _lines_lock;
+        mutable line_index _lines;
+
+        const char *bytes() const {
+            return _mapping ? _mapped : _bytes.data();
+        }
+
+        // with _lines_lock held
+        void index_lines() const {
+            if (_encoding == source_encoding::WIDE) {
+                _lines.extend(_wide.data(), _wide.length());
+            } else {
+                _lines.extend(reinterpret_cast<const unsigned char *>(bytes()), length());
+            }
+        }
+
+    public:
+        explicit source_buffer(std::u32string text,
+                               std::shared_ptr<mpp::codecvt::charset> charset)
+            : _encoding(source_encoding::WIDE), _wide(std::move(text)),
+              _charset(std::move(charset)), _transcoder(_charset) {}
+
+        explicit source_buffer(std::string utf8,
+                               std::shared_ptr<mpp::codecvt::charset> charset)
+            : _encoding(source_encoding::UTF8), _bytes(std::move(utf8)),
+              _charset(std::move(charset)), _transcoder(_charset) {}
+
+        // UTF-8 bytes owned by someone else, e.g. a mapped file
+        explicit source_buffer(const char *utf8, std::size_t length,
+                               std::shared_ptr<const void> mapping,
+                               std::shared_ptr<mpp::codecvt::charset> charset)
+            : _encoding(source_encoding::UTF8), _mapped(utf8), _mapped_length(length),
+              _mapping(std::move(mapping)), _charset(std::move(charset)), _transcoder(_charset) {}
+
+        source_encoding encoding() const {
+            return _encoding;
+        }
+
+        template <typename UnitT>
+        const UnitT *data() const;
+
+        std::size_t length() const {
+            if (_encoding == source_encoding::WIDE) {
+                return _wide.length();
+            }
+            return _mapping ? _mapped_length : _bytes.length();
+        }
+
+        // for chunked input, only for buffers that own their text
+        void append(const std::u32string &text) {
+            _wide.append(text);
+        }
+
+        void append(const char *utf8, std::size_t length) {
+            _bytes.append(utf8, length);
+        }
+
+        // a copy with [offset, offset + removed) replaced by local-encoded
+        // text, tokens of this buffer stay valid
+        std::shared_ptr<source_buffer> edit(std::size_t offset, std::size_t removed,
+                                            const std::string &local) const {
+            if (_encoding == source_encoding::UTF8) {
+                std::string text{bytes(), length()};
+                text.replace(offset, removed, local);
+                return std::make_shared<source_buffer>(std::move(text), _charset);
+            }
+            std::u32string text{_wide, 0, offset};
+            text.reserve(_wide.length() - removed + local.length());
+            _transcoder.decode(local.data(), local.length(), text);
+            text.append(_wide, offset + removed, std::u32string::npos);
+            return std::make_shared<source_buffer>(std::move(text), _charset);
+        }
+
+        // local-encoded text of [offset, offset + length)
+        std::string local(std::uint32_t offset, std::uint32_t length) const {
+            std::string out;
+            local(offset, length, out);
+            return out;
+        }
+
+        // same, appended to out
+        void local(std::uint32_t offset, std::uint32_t length, std::string &out) const {
+            if (_encoding == source_encoding::UTF8) {
+                out.append(bytes() + offset, length);
+            } else {
+                _transcoder.encode(_wide.data() + offset, length, out);
+            }
+        }
+
+        // local encoding of chars that are not in the buffer, e.g. a
+        // decoded literal, appended to out
+        void encode(const char32_t *text, std::size_t length, std::string &out) const {
+            _transcoder.encode(text, length, out);
+        }
+
+        // chars in [offset, offset + length)
+        std::uint32_t count_chars(std::uint32_t offset, std::uint32_t length) const {
+            if (_encoding == source_encoding::WIDE) {
+                return length;
+            }
+            std::uint32_t n = 0;
+            for (const char *p = bytes() + offset, *end = p + length; p < end; ++p) {
+                // skip continuation bytes
+                n += (static_cast<unsigned char>(*p) & 0xC0U) != 0x80;
+            }
+            return n;
+        }
+
+        // line and column of offset, text appended since the last
+        // lookup is indexed first
+        source_location location(std::uint32_t offset) const {
+            std::uint32_t line;
+            std::uint32_t line_start;
+            {
+                std::lock_guard<std::mutex> guard(_lines_lock);
+                index_lines();
+                line = _lines.line(offset);
+                line_start = _lines.line_start(line);
+            }
+            return source_location{line, count_chars(line_start, offset - line_start)};
+        }
+
+        // where the line offset is on starts
+        std::uint32_t line_start(std::uint32_t offset) const {
+            std::lock_guard<std::mutex> guard(_lines_lock);
+            index_lines();
+            return _lines.line_start(_lines.line(offset));
+        }
+
+        // for chunked input, a copy without the text before start, which
+        // must be a line start. lines keep their numbers, offsets are from
+        // start. tokens of this buffer stay valid.
+        std::shared_ptr<source_buffer> tail(std::uint32_t start) const {
+            std::shared_ptr<source_buffer> copy;
+            if (_encoding == source_encoding::UTF8) {
+                copy = std::make_shared<source_buffer>(std::string{bytes() + start, length() - start}, _charset);
+            } else {
+                copy = std::make_shared<source_buffer>(_wide.substr(start), _charset);
+            }
+            std::lock_guard<std::mutex> guard(_lines_lock);
+            index_lines();
+            copy->_lines = _lines.tail(_lines.line(start));
+            return copy;
+        }
+    };
+
+    template <>
+    inline const char32_t *source_buffer::data<char32_t>() const {
+        return _wide.data();
+    }
+
+    template <>
+    inline const unsigned char *source_buffer::data<unsigned char>() const {
+        return reinterpret_cast<const unsigned char *>(bytes());
+    }
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // file inputs
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // a regular file mapped read-only into memory
+    struct mapped_file {
+    private:
+        const char *_data = "";
+        std::size_t _length = 0;
+        bool _mapped = false;
+
+    public:
+        mapped_file() = default;
+
+        mapped_file(const mapped_file &) = delete;
+
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        ~mapped_file() {
+#ifndef _WIN32
+            if (_mapped) {
+                ::munmap(const_cast<char *>(_data), _length);
+            }
+#endif
+        }
+
+        const char *data() const {
+            return _data;
+        }
+
+        std::size_t length() const {
+            return _length;
+        }
+
+        // returns nullptr when path is not a regular file (pipes, ttys, ...)
+        // or mapping is not supported, those should be read by chunk_reader.
+        static std::shared_ptr<mapped_file> open(const std::string &path) {
+#ifndef _WIN32
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("cannot open source file: " + path);
+            }
+
+            struct stat st{};
+            if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                ::close(fd);
+                return nullptr;
+            }
+
+            auto file = std::make_shared<mapped_file>();
+            if (st.st_size > 0) {
+                void *addr = ::mmap(nullptr, static_cast<std::size_t>(st.st_size),
+                                    PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr == MAP_FAILED) {
+                    ::close(fd);
+                    return nullptr;
+                }
+                ::madvise(addr, static_cast<std::size_t>(st.st_size), MADV_SEQUENTIAL);
+                file->_data = static_cast<const char *>(addr);
+                file->_length = static_cast<std::size_t>(st.st_size);
+                file->_mapped = true;
+            }
+            ::close(fd);
+            return file;
+#else
+            (void) path;
+            return nullptr;
+#endif
+        }
+    };
+
+    // reads a stream (pipe, stdin, or a file that cannot be mapped)
+    // chunk by chunk, the lexer asks for more when it runs out of text.
+    struct chunk_reader {
+    private:
+        std::unique_ptr<std::istream> _owned;
+        std::istream *_in;
+        std::size_t _chunk_size;
+        // bytes read but not handed out yet
+        std::string _pending;
+        bool _eof = false;
+
+    public:
+        explicit chunk_reader(std::istream &in, std::size_t chunk_size)
+            : _in(&in), _chunk_size(chunk_size) {}
+
+        explicit chunk_reader(std::unique_ptr<std::istream> in, std::size_t chunk_size)
+            : _owned(std::move(in)), _in(_owned.get()), _chunk_size(chunk_size) {}
+
+        bool eof() const {
+            return _eof;
+        }
+
+        // used when a token did not fit in what was read so far
+        void grow() {
+            _chunk_size *= 2;
+        }
+
+        // Read the next chunk. With `whole_lines`, only text up to the last
+        // '\n' is handed out and the rest waits for the next chunk, so a
+        // multi-byte char is never split. Every ASCII-compatible charset
+        // is safe to cut after '\n'. Everything is handed out at EOF.
+        std::string next(bool whole_lines) {
+            std::size_t old_size = _pending.size();
+            _pending.resize(old_size + _chunk_size);
+            _in->read(&_pending[old_size], static_cast<std::streamsize>(_chunk_size));
+            _pending.resize(old_size + static_cast<std::size_t>(_in->gcount()));
+            // a read error (e.g. the path is a directory) is not the end of the text
+            if (_in->bad()) {
+                throw std::runtime_error("cannot read source stream");
+            }
+            if (!*_in) {
+                _eof = true;
+            }
+
+            std::size_t cut = _pending.size();
+            if (whole_lines && !_eof) {
+                std::size_t newline = _pending.rfind('\n');
+                cut = newline == std::string::npos ? 0 : newline + 1;
+            }
+            std::string chunk = _pending.substr(0, cut);
+            _pending.erase(0, cut);
+            return chunk;
+        }
+    };
+
+    // Regular files under root whose names end with extension, in sorted
+    // order so a batch sees them the same way every time. root itself
+    // is returned when it is a file.
+    inline std::vector<std::string> list_source_files(const std::string &root,
+                                                      const std::string &extension = ".csc") {
+        std::vector<std::string> files;
+#ifndef _WIN32
+        struct stat st{};
+        if (::stat(root.c_str(), &st) != 0) {
+            throw std::runtime_error("cannot open source path: " + root);
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            files.push_back(root);
+            return files;
+        }
+
+        std::vector<std::string> pending{root};
+        while (!pending.empty()) {
+            std::string dir_path = std::move(pending.back());
+            pending.pop_back();
+            DIR *dir = ::opendir(dir_path.c_str());
+            if (dir == nullptr) {
+                throw std::runtime_error("cannot open source directory: " + dir_path);
+            }
+            while (dirent *entry = ::readdir(dir)) {
+                std::string name = entry->d_name;
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                std::string path = dir_path + "/" + name;
+                // links to directories are not followed, they may loop
+                if (::lstat(path.c_str(), &st) != 0
+                    || (S_ISLNK(st.st_mode) && (::stat(path.c_str(), &st) != 0 || S_ISDIR(st.st_mode)))) {
+                    continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                    pending.push_back(std::move(path));
+                } else if (S_ISREG(st.st_mode) && name.size() >= extension.size()
+                           && name.compare(name.size() - extension.size(), extension.size(), extension) == 0) {
+                    files.push_back(std::move(path));
+                }
+            }
+            ::closedir(dir);
+        }
+        std::sort(files.begin(), files.end());
+#else
+        files.push_back(root);
+#endif
+        return files;
+    }
+
+    // Write data to a temporary file next to path and rename it into place,
+    // so readers of path see a whole file or none. The temporary file ends
+    // with ".tmp". false when anything failed, nothing is left behind then.
+    inline bool replace_file(const std::string &path, const std::string &data) {
+#ifndef _WIN32
+        static std::atomic<unsigned> counter{0};
+        std::string temp_path = path + "." + std::to_string(::getpid()) + "."
+                                + std::to_string(counter++) + ".tmp";
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        const char *p = data.data();
+        std::size_t left = data.size();
+        while (left > 0) {
+            ssize_t n = ::write(fd, p, left);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            p += n;
+            left -= static_cast<std::size_t>(n);
+        }
+        bool written = ::close(fd) == 0 && left == 0;
+        if (!written || ::rename(temp_path.c_str(), path.c_str()) != 0) {
+            ::unlink(temp_path.c_str());
+            return false;
+        }
+        return true;
+#else
+        (void) path;
+        (void) data;
+        return false;
+#endif
+    }
+}
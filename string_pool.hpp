@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "source.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // string literal pool
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // index of a string literal value in its stream's string_pool
+    using string_index = std::uint32_t;
+
+    // Distinct values of the string literals of one token stream, in code
+    // units of its source. A value without escapes is the span between the
+    // quotes in the source and is not copied, decoded values are kept back
+    // to back here. Equal values share an index, however they were written,
+    // so a literal repeated a thousand times costs one entry.
+    struct string_pool {
+    private:
+        struct entry {
+            // into the source, or into the decoded units
+            std::uint32_t _offset;
+            std::uint32_t _length;
+            std::uint32_t _hash;
+            bool _decoded;
+        };
+
+        std::u32string _wide;
+        std::string _bytes;
+        std::vector<entry> _entries;
+        // open addressing, index + 1, 0 for an empty slot
+        std::vector<std::uint32_t> _slots;
+
+        const char32_t *decoded_units(const char32_t *) const {
+            return _wide.data();
+        }
+
+        const unsigned char *decoded_units(const unsigned char *) const {
+            return reinterpret_cast<const unsigned char *>(_bytes.data());
+        }
+
+        std::size_t store(const char32_t *value, std::size_t length) {
+            _wide.append(value, length);
+            return _wide.size() - length;
+        }
+
+        std::size_t store(const unsigned char *value, std::size_t length) {
+            _bytes.append(reinterpret_cast<const char *>(value), length);
+            return _bytes.size() - length;
+        }
+
+        template <typename UnitT>
+        const UnitT *units(const source_buffer &source, const entry &e) const {
+            return (e._decoded ? decoded_units(static_cast<const UnitT *>(nullptr)) : source.data<UnitT>()) + e._offset;
+        }
+
+        // FNV-1a over the units
+        template <typename UnitT>
+        static std::uint32_t hash(const UnitT *value, std::size_t length) {
+            std::uint32_t h = 2166136261U;
+            for (std::size_t i = 0; i < length; ++i) {
+                h = (h ^ static_cast<std::uint32_t>(value[i])) * 16777619U;
+            }
+            return h;
+        }
+
+        template <typename UnitT>
+        std::size_t find_slot(const source_buffer &source, const UnitT *value, std::size_t length,
+                              std::uint32_t h) const {
+            std::size_t mask = _slots.size() - 1;
+            for (std::size_t i = h & mask;; i = (i + 1) & mask) {
+                std::uint32_t slot = _slots[i];
+                if (slot == 0) {
+                    return i;
+                }
+                const entry &e = _entries[slot - 1];
+                if (e._hash == h && e._length == length
+                    && std::memcmp(units<UnitT>(source, e), value, length * sizeof(UnitT)) == 0) {
+                    return i;
+                }
+            }
+        }
+
+        void grow() {
+            std::vector<std::uint32_t> slots(_slots.empty() ? 64 : _slots.size() * 2, 0);
+            std::size_t mask = slots.size() - 1;
+            for (std::size_t index = 0; index < _entries.size(); ++index) {
+                std::size_t i = _entries[index]._hash & mask;
+                while (slots[i] != 0) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = static_cast<std::uint32_t>(index + 1);
+            }
+            _slots.swap(slots);
+        }
+
+        // value is at offset in the source, or somewhere else and copied
+        template <typename UnitT>
+        string_index intern(const source_buffer &source, const UnitT *value, std::size_t length,
+                            bool in_source) {
+            if (length > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("string literal too large");
+            }
+            std::uint32_t h = hash(value, length);
+            if (_slots.empty()) {
+                grow();
+            }
+            std::size_t slot = find_slot(source, value, length, h);
+            if (_slots[slot] != 0) {
+                return _slots[slot] - 1;
+            }
+
+            // keep the load under a half
+            if ((_entries.size() + 1) * 2 > _slots.size()) {
+                grow();
+                slot = find_slot(source, value, length, h);
+            }
+            std::size_t offset = in_source ? static_cast<std::size_t>(value - source.data<UnitT>())
+                                           : store(value, length);
+            if (offset > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("string pool too large");
+            }
+            _entries.push_back(entry{static_cast<std::uint32_t>(offset), static_cast<std::uint32_t>(length),
+                                     h, !in_source});
+            _slots[slot] = static_cast<std::uint32_t>(_entries.size());
+            return static_cast<string_index>(_entries.size() - 1);
+        }
+
+    public:
+        // the value is [offset, offset + length) of the source
+        string_index intern_span(const source_buffer &source, std::uint32_t offset, std::uint32_t length) {
+            if (source.encoding() == source_encoding::WIDE) {
+                return intern(source, source.data<char32_t>() + offset, length, true);
+            }
+            return intern(source, source.data<unsigned char>() + offset, length, true);
+        }
+
+        // a decoded value, in units of the source's encoding
+        template <typename UnitT>
+        string_index intern(const source_buffer &source, const UnitT *value, std::size_t length) {
+            return intern(source, value, length, false);
+        }
+
+        // the value of index in another pool over a source of the same
+        // encoding, for a literal whose body is [offset, offset + length)
+        // of source. equal values share an entry however they were
+        // written, so the entry says nothing about this literal, but
+        // every escape is longer than its value: a body as long as the
+        // value has none and is the value.
+        string_index copy(const source_buffer &source, std::uint32_t offset, std::uint32_t length,
+                          const string_pool &other, const source_buffer &other_source, string_index index) {
+            const entry &e = other._entries[index];
+            if (length == e._length) {
+                return intern_span(source, offset, length);
+            }
+            if (source.encoding() == source_encoding::WIDE) {
+                return intern(source, other.units<char32_t>(other_source, e), e._length, false);
+            }
+            return intern(source, other.units<unsigned char>(other_source, e), e._length, false);
+        }
+
+        // number of distinct values
+        std::size_t size() const {
+            return _entries.size();
+        }
+
+        // false when the value is a span of the source
+        bool decoded(string_index index) const {
+            return _entries[index]._decoded;
+        }
+
+        // in code units
+        std::uint32_t length(string_index index) const {
+            return _entries[index]._length;
+        }
+
+        template <typename UnitT>
+        const UnitT *data(const source_buffer &source, string_index index) const {
+            return units<UnitT>(source, _entries[index]);
+        }
+
+        // the local-encoded value, appended to out
+        void value(const source_buffer &source, string_index index, std::string &out) const {
+            const entry &e = _entries[index];
+            if (!e._decoded) {
+                source.local(e._offset, e._length, out);
+            } else if (source.encoding() == source_encoding::WIDE) {
+                source.encode(_wide.data() + e._offset, e._length, out);
+            } else {
+                out.append(_bytes.data() + e._offset, e._length);
+            }
+        }
+
+        // values that are spans of the source move by offset, e.g. after
+        // text before them was dropped
+        void rebase(std::int64_t offset) {
+            for (auto &e : _entries) {
+                if (!e._decoded) {
+                    e._offset = static_cast<std::uint32_t>(e._offset + offset);
+                }
+            }
+        }
+
+        void clear() {
+            _wide.clear();
+            _bytes.clear();
+            _entries.clear();
+            _slots.clear();
+        }
+    };
+}
+
+namespace cs {
+    using cs_impl::string_index;
+    using cs_impl::string_pool;
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "token.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // keywords
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct keyword_def {
+        const char *_text;
+        keyword_type _type;
+    };
+
+    // keywords of CovScript, in keyword_type order
+    constexpr keyword_def default_keywords[] = {
+        {"import",   keyword_type::KEYWORD_IMPORT},
+        {"package",  keyword_type::KEYWORD_PACKAGE},
+        {"using",    keyword_type::KEYWORD_USING},
+        {"namespace", keyword_type::KEYWORD_NAMESPACE},
+        {"struct",   keyword_type::KEYWORD_STRUCT},
+        {"class",    keyword_type::KEYWORD_CLASS},
+        {"extends",  keyword_type::KEYWORD_EXTENDS},
+        {"function", keyword_type::KEYWORD_FUNCTION},
+        {"return",   keyword_type::KEYWORD_RETURN},
+        {"var",      keyword_type::KEYWORD_VAR},
+        {"const",    keyword_type::KEYWORD_CONST},
+        {"if",       keyword_type::KEYWORD_IF},
+        {"else",     keyword_type::KEYWORD_ELSE},
+        {"switch",   keyword_type::KEYWORD_SWITCH},
+        {"case",     keyword_type::KEYWORD_CASE},
+        {"default",  keyword_type::KEYWORD_DEFAULT},
+        {"while",    keyword_type::KEYWORD_WHILE},
+        {"until",    keyword_type::KEYWORD_UNTIL},
+        {"loop",     keyword_type::KEYWORD_LOOP},
+        {"for",      keyword_type::KEYWORD_FOR},
+        {"in",       keyword_type::KEYWORD_IN},
+        {"break",    keyword_type::KEYWORD_BREAK},
+        {"continue", keyword_type::KEYWORD_CONTINUE},
+        {"try",      keyword_type::KEYWORD_TRY},
+        {"catch",    keyword_type::KEYWORD_CATCH},
+        {"throw",    keyword_type::KEYWORD_THROW},
+        {"block",    keyword_type::KEYWORD_BLOCK},
+        {"end",      keyword_type::KEYWORD_END},
+        {"and",      keyword_type::KEYWORD_AND},
+        {"or",       keyword_type::KEYWORD_OR},
+        {"not",      keyword_type::KEYWORD_NOT},
+        {"typeid",   keyword_type::KEYWORD_TYPEID},
+        {"new",      keyword_type::KEYWORD_NEW},
+        {"gcnew",    keyword_type::KEYWORD_GCNEW},
+        {"local",    keyword_type::KEYWORD_LOCAL},
+        {"global",   keyword_type::KEYWORD_GLOBAL},
+        {"override", keyword_type::KEYWORD_OVERRIDE},
+        {"true",     keyword_type::KEYWORD_TRUE},
+        {"false",    keyword_type::KEYWORD_FALSE},
+        {"null",     keyword_type::KEYWORD_NULL},
+        {"do",       keyword_type::KEYWORD_DO},
+    };
+
+    constexpr std::size_t keyword_count = sizeof(default_keywords) / sizeof(default_keywords[0]);
+
+    // only looks at the first two chars, the last one and the length,
+    // make_keyword_table checks that no two keywords collide.
+    constexpr std::size_t keyword_hash(std::size_t length, std::uint32_t first,
+                                       std::uint32_t second, std::uint32_t last) {
+        return (first * 6 + second * 5 + last * 7 + length) & 127U;
+    }
+
+    // perfect hash table of a fixed keyword set, built at compile time
+    struct static_keyword_table {
+        const char *_texts[128];
+        std::size_t _lengths[128];
+        keyword_type _types[128];
+
+        template <typename UnitT>
+        keyword_type find(const UnitT *begin, const UnitT *end) const {
+            auto length = static_cast<std::size_t>(end - begin);
+            if (length < 2) {
+                return keyword_type::UNDEFINED;
+            }
+            std::size_t slot = keyword_hash(length, begin[0], begin[1], end[-1]);
+            if (_lengths[slot] != length) {
+                return keyword_type::UNDEFINED;
+            }
+            for (std::size_t i = 0; i < length; ++i) {
+                // non-ASCII units never equal a keyword char
+                if (static_cast<std::uint32_t>(begin[i]) != static_cast<unsigned char>(_texts[slot][i])) {
+                    return keyword_type::UNDEFINED;
+                }
+            }
+            return _types[slot];
+        }
+    };
+
+    // fails to compile when two keywords collide
+    template <std::size_t N>
+    constexpr static_keyword_table make_keyword_table(const keyword_def (&defs)[N]) {
+        static_keyword_table table{};
+        for (std::size_t i = 0; i < N; ++i) {
+            const char *text = defs[i]._text;
+            std::size_t length = 0;
+            while (text[length] != '\0') {
+                ++length;
+            }
+            if (length < 2) {
+                throw std::invalid_argument("keywords have at least two chars");
+            }
+            if (static_cast<std::size_t>(defs[i]._type) != i + 1) {
+                throw std::invalid_argument("keywords must be listed in keyword_type order");
+            }
+            std::size_t slot = keyword_hash(length,
+                                            static_cast<unsigned char>(text[0]),
+                                            static_cast<unsigned char>(text[1]),
+                                            static_cast<unsigned char>(text[length - 1]));
+            if (table._lengths[slot] != 0) {
+                throw std::logic_error("keyword hash collision");
+            }
+            table._texts[slot] = text;
+            table._lengths[slot] = length;
+            table._types[slot] = defs[i]._type;
+        }
+        return table;
+    }
+
+    constexpr auto default_keyword_table = make_keyword_table(default_keywords);
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // symbol table
+    ////////////////////////////////////////////////////////////////////////////////
+
+    using symbol_t = std::uint32_t;
+
+    // Interns identifiers into stable 32-bit symbols, names are local-encoded.
+    // Keywords are interned first, so the symbol of a keyword is its
+    // keyword_type and telling them apart is an integer compare.
+    // Symbol 0 is never handed out.
+    struct symbol_table {
+    private:
+        struct entry {
+            std::uint32_t _offset;
+            std::uint32_t _length;
+            std::uint32_t _hash;
+        };
+
+        // all names back to back, so a new name costs no allocation of its own
+        std::string _chars;
+        // indexed by symbol
+        std::vector<entry> _entries;
+        // open addressing, 0 for an empty slot
+        std::vector<symbol_t> _slots;
+
+        // FNV-1a
+        static std::uint32_t hash(const char *name, std::size_t length) {
+            std::uint32_t h = 2166136261U;
+            for (std::size_t i = 0; i < length; ++i) {
+                h = (h ^ static_cast<unsigned char>(name[i])) * 16777619U;
+            }
+            return h;
+        }
+
+        std::size_t find_slot(const char *name, std::size_t length, std::uint32_t h) const {
+            std::size_t mask = _slots.size() - 1;
+            for (std::size_t i = h & mask;; i = (i + 1) & mask) {
+                symbol_t symbol = _slots[i];
+                if (symbol == 0) {
+                    return i;
+                }
+                const entry &e = _entries[symbol];
+                if (e._hash == h && e._length == length
+                    && std::memcmp(_chars.data() + e._offset, name, length) == 0) {
+                    return i;
+                }
+            }
+        }
+
+        void grow() {
+            std::vector<symbol_t> slots(_slots.size() * 2, 0);
+            std::size_t mask = slots.size() - 1;
+            for (symbol_t symbol = 1; symbol < _entries.size(); ++symbol) {
+                std::size_t i = _entries[symbol]._hash & mask;
+                while (slots[i] != 0) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = symbol;
+            }
+            _slots.swap(slots);
+        }
+
+    public:
+        symbol_table() : _entries(1, entry{0, 0, 0}), _slots(256, 0) {
+            for (const auto &kw : default_keywords) {
+                intern(kw._text, std::strlen(kw._text));
+            }
+        }
+
+        symbol_t intern(const char *name, std::size_t length) {
+            std::uint32_t h = hash(name, length);
+            std::size_t slot = find_slot(name, length, h);
+            if (_slots[slot] != 0) {
+                return _slots[slot];
+            }
+
+            // keep the load under a half
+            if (_entries.size() * 2 >= _slots.size()) {
+                grow();
+                slot = find_slot(name, length, h);
+            }
+            auto symbol = static_cast<symbol_t>(_entries.size());
+            _entries.push_back(entry{static_cast<std::uint32_t>(_chars.size()),
+                                     static_cast<std::uint32_t>(length), h});
+            _chars.append(name, length);
+            _slots[slot] = symbol;
+            return symbol;
+        }
+
+        std::string name(symbol_t symbol) const {
+            const entry &e = _entries[symbol];
+            return _chars.substr(e._offset, e._length);
+        }
+
+        // number of symbols handed out, plus the unused symbol 0
+        std::size_t size() const {
+            return _entries.size();
+        }
+
+        // symbols of this table, interned into another one
+        std::vector<symbol_t> merge_into(symbol_table &target) const {
+            std::vector<symbol_t> symbols(_entries.size(), 0);
+            for (symbol_t symbol = 1; symbol < _entries.size(); ++symbol) {
+                const entry &e = _entries[symbol];
+                symbols[symbol] = target.intern(_chars.data() + e._offset, e._length);
+            }
+            return symbols;
+        }
+
+        static keyword_type keyword(symbol_t symbol) {
+            return symbol <= keyword_count ? static_cast<keyword_type>(symbol) : keyword_type::UNDEFINED;
+        }
+    };
+}
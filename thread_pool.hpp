@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // work-stealing pool
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Jobs are dealt to the workers up front in contiguous runs. A worker
+    // takes jobs from the front of its own run, and when that is empty
+    // steals the back half of another worker's run, so a few slow jobs do
+    // not leave the other threads idle. A run is two 32-bit indices in one
+    // atomic word, taking and stealing are a single compare-and-swap.
+    // Worker threads are kept parked between runs, so calling run() often
+    // (e.g. lex_parallel per file) does not create threads every time.
+    struct work_stealing_pool {
+    private:
+        // The threads of the process, started as runs need more. One run
+        // has them at a time, a run started meanwhile (from another thread
+        // or from a job) gets threads of its own.
+        struct helper_threads {
+            // a run has the threads
+            std::atomic<bool> _busy{false};
+            std::mutex _lock;
+            std::condition_variable _wake;
+            std::condition_variable _done;
+            std::vector<std::thread> _threads;
+            // the worker of the current run and its context
+            void (*_work)(void *, std::size_t) = nullptr;
+            void *_context = nullptr;
+            // threads 1 to _workers - 1 take part in the current run
+            std::size_t _workers = 0;
+            std::size_t _running = 0;
+            std::uint64_t _generation = 0;
+            bool _stop = false;
+
+            ~helper_threads() {
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _stop = true;
+                }
+                _wake.notify_all();
+                for (auto &t : _threads) {
+                    t.join();
+                }
+            }
+
+            void loop(std::size_t self) {
+                std::uint64_t seen = 0;
+                std::unique_lock<std::mutex> guard(_lock);
+                while (true) {
+                    _wake.wait(guard, [&]() { return _stop || _generation != seen; });
+                    if (_stop) {
+                        return;
+                    }
+                    seen = _generation;
+                    if (self >= _workers) {
+                        continue;
+                    }
+                    guard.unlock();
+                    _work(_context, self);
+                    guard.lock();
+                    if (--_running == 0) {
+                        _done.notify_one();
+                    }
+                }
+            }
+
+            // worker(self) on threads 0 to workers - 1, this one being 0
+            template <typename Worker>
+            void run(std::size_t workers, Worker &worker) {
+                std::unique_lock<std::mutex> guard(_lock);
+                while (_threads.size() + 1 < workers) {
+                    _threads.emplace_back(&helper_threads::loop, this, _threads.size() + 1);
+                }
+                _work = [](void *context, std::size_t self) {
+                    (*static_cast<Worker *>(context))(self);
+                };
+                _context = &worker;
+                _workers = workers;
+                _running = workers - 1;
+                ++_generation;
+                guard.unlock();
+                _wake.notify_all();
+
+                worker(0);
+                guard.lock();
+                _done.wait(guard, [&]() { return _running == 0; });
+            }
+
+            static helper_threads &get() {
+                static helper_threads threads;
+                return threads;
+            }
+        };
+
+        // a cache line each, so workers taking jobs do not slow each other down
+        struct job_range {
+            std::atomic<std::uint64_t> _range{0};
+            char _padding[64 - sizeof(std::atomic<std::uint64_t>)];
+        };
+
+        static std::uint64_t pack(std::uint64_t begin, std::uint64_t end) {
+            return (begin << 32U) | end;
+        }
+
+        static bool take(job_range &own, std::size_t &job) {
+            std::uint64_t range = own._range.load();
+            while (true) {
+                std::uint64_t begin = range >> 32U;
+                std::uint64_t end = range & 0xFFFFFFFFU;
+                if (begin >= end) {
+                    return false;
+                }
+                if (own._range.compare_exchange_weak(range, pack(begin + 1, end))) {
+                    job = static_cast<std::size_t>(begin);
+                    return true;
+                }
+            }
+        }
+
+        static bool steal(job_range &victim, job_range &own) {
+            std::uint64_t range = victim._range.load();
+            while (true) {
+                std::uint64_t begin = range >> 32U;
+                std::uint64_t end = range & 0xFFFFFFFFU;
+                if (begin >= end) {
+                    return false;
+                }
+                std::uint64_t middle = begin + (end - begin) / 2;
+                if (victim._range.compare_exchange_weak(range, pack(begin, middle))) {
+                    // only the owner refills its run, and only when it is empty
+                    own._range.store(pack(middle, end));
+                    return true;
+                }
+            }
+        }
+
+    public:
+        // Run work(worker, job) for every job in [0, jobs) on up to `threads`
+        // threads (0 for one per core), the calling thread being worker 0.
+        // The first exception thrown by a job is rethrown when all are done.
+        template <typename Work>
+        static void run(std::size_t jobs, std::size_t threads, Work &&work) {
+            if (jobs > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("too many jobs");
+            }
+            if (threads == 0) {
+                threads = std::max(1U, std::thread::hardware_concurrency());
+            }
+            threads = std::max<std::size_t>(1, std::min(threads, jobs));
+
+            std::unique_ptr<job_range[]> ranges(new job_range[threads]);
+            for (std::size_t w = 0; w < threads; ++w) {
+                ranges[w]._range.store(pack(jobs * w / threads, jobs * (w + 1) / threads));
+            }
+
+            std::mutex error_lock;
+            std::exception_ptr error;
+            auto worker = [&](std::size_t self) {
+                std::size_t job;
+                while (true) {
+                    while (take(ranges[self], job)) {
+                        try {
+                            work(self, job);
+                        } catch (...) {
+                            std::lock_guard<std::mutex> guard(error_lock);
+                            if (!error) {
+                                error = std::current_exception();
+                            }
+                        }
+                    }
+                    bool stolen = false;
+                    for (std::size_t i = 1; i < threads && !stolen; ++i) {
+                        stolen = steal(ranges[(self + i) % threads], ranges[self]);
+                    }
+                    if (!stolen) {
+                        // every run is empty, jobs still running need no help
+                        return;
+                    }
+                }
+            };
+
+            helper_threads &helpers = helper_threads::get();
+            if (threads == 1) {
+                worker(0);
+            } else if (!helpers._busy.exchange(true)) {
+                try {
+                    helpers.run(threads, worker);
+                } catch (...) {
+                    helpers._busy.store(false);
+                    throw;
+                }
+                helpers._busy.store(false);
+            } else {
+                std::vector<std::thread> pool;
+                for (std::size_t w = 1; w < threads; ++w) {
+                    pool.emplace_back(worker, w);
+                }
+                worker(0);
+                for (auto &t : pool) {
+                    t.join();
+                }
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // growing job queue
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // For jobs that find more jobs, e.g. modules naming the modules they
+    // import. Jobs are taken in the order they were pushed, and a worker
+    // with nothing to do waits while any job is still running, as that one
+    // may push more. Jobs are meant to be coarse (a file each), so one lock
+    // is enough.
+    struct job_queue {
+    private:
+        std::mutex _lock;
+        std::condition_variable _changed;
+        std::deque<std::size_t> _jobs;
+        std::size_t _running = 0;
+
+    public:
+        // from any thread, jobs included
+        void push(std::size_t job) {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _jobs.push_back(job);
+            }
+            _changed.notify_one();
+        }
+
+        // Run work(worker, job) for every job pushed before or during the
+        // run on `threads` threads (0 for one per core), the calling thread
+        // being worker 0. Returns when the queue is empty and no job is
+        // running, the first exception thrown by a job is rethrown then.
+        template <typename Work>
+        void run(std::size_t threads, Work &&work) {
+            if (threads == 0) {
+                threads = std::max(1U, std::thread::hardware_concurrency());
+            }
+
+            std::exception_ptr error;
+            auto worker = [&](std::size_t self) {
+                std::unique_lock<std::mutex> guard(_lock);
+                while (true) {
+                    _changed.wait(guard, [this]() { return !_jobs.empty() || _running == 0; });
+                    if (_jobs.empty()) {
+                        return;
+                    }
+                    std::size_t job = _jobs.front();
+                    _jobs.pop_front();
+                    ++_running;
+                    guard.unlock();
+                    try {
+                        work(self, job);
+                    } catch (...) {
+                        guard.lock();
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                        guard.unlock();
+                    }
+                    guard.lock();
+                    if (--_running == 0 && _jobs.empty()) {
+                        // wake the waiting workers to leave
+                        _changed.notify_all();
+                    }
+                }
+            };
+
+            std::vector<std::thread> pool;
+            for (std::size_t w = 1; w < threads; ++w) {
+                pool.emplace_back(worker, w);
+            }
+            worker(0);
+            for (auto &t : pool) {
+                t.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+}
@@ -0,0 +1,228 @@
+//
+// Created by kiva on 2020/3/10.
+//
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace cs_impl {
+    enum class token_type : std::uint8_t {
+        UNDEFINED,
+        ID_OR_KW,
+        INT_LITERAL,
+        FLOATING_LITERAL,
+        STRING_LITERAL,
+        CHAR_LITERAL,
+        PREPROCESSOR,
+        OPERATOR,
+        CUSTOM_LITERAL,
+    };
+
+    enum class operator_type : std::uint8_t {
+        UNDEFINED,             //
+        OPERATOR_ADD,          // +
+        OPERATOR_SUB,          // -
+        OPERATOR_MUL,          // *
+        OPERATOR_DIV,          // /
+        OPERATOR_MOD,          // *
+        OPERATOR_ASSIGN,       // =
+        OPERATOR_ADD_ASSIGN,   // +=
+        OPERATOR_SUB_ASSIGN,   // -=
+        OPERATOR_MUL_ASSIGN,   // *=
+        OPERATOR_DIV_ASSIGN,   // /=
+        OPERATOR_MOD_ASSIGN,   // %=
+        OPERATOR_AND_ASSIGN,   // &=
+        OPERATOR_OR_ASSIGN,    // |=
+        OPERATOR_XOR_ASSIGN,   // ^=
+        OPERATOR_EQ,           // ==
+        OPERATOR_NE,           // !=
+        OPERATOR_GT,           // >
+        OPERATOR_GE,           // >=
+        OPERATOR_LT,           // <
+        OPERATOR_LE,           // <=
+        OPERATOR_COLON,        // :
+        OPERATOR_COMMA,        // ,
+        OPERATOR_QUESTION,     // ?
+        OPERATOR_INC,          // ++
+        OPERATOR_DEC,          // --
+        OPERATOR_ARROW,        // ->
+        OPERATOR_DOT,          // .
+        OPERATOR_AND,          // &&
+        OPERATOR_OR,           // ||
+        OPERATOR_NOT,          // !
+        OPERATOR_BITAND,       // &
+        OPERATOR_BITOR,        // |
+        OPERATOR_BITXOR,       // ^
+        OPERATOR_BITNOT,       // ~
+        OPERATOR_VARARG,       // ...
+        OPERATOR_LPAREN,       // (
+        OPERATOR_RPAREN,       // )
+        OPERATOR_LBRACKET,     // [
+        OPERATOR_RBRACKET,     // ]
+        OPERATOR_LBRACE,       // {
+        OPERATOR_RBRACE,       // }
+
+        OPERATOR_SEMI,
+    };
+
+    enum class keyword_type : std::uint8_t {
+        UNDEFINED,
+        KEYWORD_IMPORT,     // import
+        KEYWORD_PACKAGE,    // package
+        KEYWORD_USING,      // using
+        KEYWORD_NAMESPACE,  // namespace
+        KEYWORD_STRUCT,     // struct
+        KEYWORD_CLASS,      // class
+        KEYWORD_EXTENDS,    // extends
+        KEYWORD_FUNCTION,   // function
+        KEYWORD_RETURN,     // return
+        KEYWORD_VAR,        // var
+        KEYWORD_CONST,      // const
+        KEYWORD_IF,         // if
+        KEYWORD_ELSE,       // else
+        KEYWORD_SWITCH,     // switch
+        KEYWORD_CASE,       // case
+        KEYWORD_DEFAULT,    // default
+        KEYWORD_WHILE,      // while
+        KEYWORD_UNTIL,      // until
+        KEYWORD_LOOP,       // loop
+        KEYWORD_FOR,        // for
+        KEYWORD_IN,         // in
+        KEYWORD_BREAK,      // break
+        KEYWORD_CONTINUE,   // continue
+        KEYWORD_TRY,        // try
+        KEYWORD_CATCH,      // catch
+        KEYWORD_THROW,      // throw
+        KEYWORD_BLOCK,      // block
+        KEYWORD_END,        // end
+        KEYWORD_AND,        // and
+        KEYWORD_OR,         // or
+        KEYWORD_NOT,        // not
+        KEYWORD_TYPEID,     // typeid
+        KEYWORD_NEW,        // new
+        KEYWORD_GCNEW,      // gcnew
+        KEYWORD_LOCAL,      // local
+        KEYWORD_GLOBAL,     // global
+        KEYWORD_OVERRIDE,   // override
+        KEYWORD_TRUE,       // true
+        KEYWORD_FALSE,      // false
+        KEYWORD_NULL,       // null
+        KEYWORD_DO,         // do
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // tokens
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct token {
+        std::size_t _line;
+        std::size_t _column;
+        std::string _token_text;
+        token_type _type;
+
+        explicit token(std::size_t line, std::size_t column,
+                       std::string text, token_type type)
+            : _line(line), _column(column),
+              _token_text(std::move(text)), _type(type) {}
+
+        virtual ~token() = default;
+    };
+
+    struct token_operator : public token {
+        std::string _value;
+        operator_type _op_type;
+
+        explicit token_operator(std::size_t line, std::size_t column,
+                                std::string text, std::string value,
+                                operator_type type)
+            : token(line, column, std::move(text), token_type::OPERATOR),
+              _value(std::move(value)), _op_type(type) {}
+
+        ~token_operator() override = default;
+    };
+
+    struct token_preprocessor : public token {
+        std::string _value;
+
+        explicit token_preprocessor(std::size_t line, std::size_t column,
+                                    std::string text, std::string value)
+            : token(line, column, std::move(text), token_type::PREPROCESSOR),
+              _value(std::move(value)) {}
+
+        ~token_preprocessor() override = default;
+    };
+
+    struct token_id_or_kw : public token {
+        std::string _value;
+        keyword_type _keyword;
+
+        explicit token_id_or_kw(std::size_t line, std::size_t column,
+                                std::string text, std::string value,
+                                keyword_type keyword = keyword_type::UNDEFINED)
+            : token(line, column, std::move(text), token_type::ID_OR_KW),
+              _value(std::move(value)), _keyword(keyword) {}
+
+        ~token_id_or_kw() override = default;
+    };
+
+    struct token_int_literal : public token {
+        int64_t _value;
+
+        explicit token_int_literal(std::size_t line, std::size_t column,
+                                   std::string text, int64_t value)
+            : token(line, column, std::move(text), token_type::INT_LITERAL),
+              _value(value) {}
+
+        ~token_int_literal() override = default;
+    };
+
+    struct token_float_literal : public token {
+        double _value;
+
+        explicit token_float_literal(std::size_t line, std::size_t column,
+                                     std::string text, double value)
+            : token(line, column, std::move(text), token_type::FLOATING_LITERAL),
+              _value(value) {}
+
+        ~token_float_literal() override = default;
+    };
+
+    struct token_string_literal : public token {
+        std::string _value;
+
+        explicit token_string_literal(std::size_t line, std::size_t column,
+                                      std::string text, std::string value)
+            : token(line, column, std::move(text), token_type::STRING_LITERAL),
+              _value(std::move(value)) {}
+
+        ~token_string_literal() override = default;
+    };
+
+    struct token_char_literal : public token {
+        char32_t _value;
+
+        explicit token_char_literal(std::size_t line, std::size_t column,
+                                    std::string text, char32_t value)
+            : token(line, column, std::move(text), token_type::CHAR_LITERAL),
+              _value(value) {}
+
+        ~token_char_literal() override = default;
+    };
+
+    struct token_custom_literal : public token {
+        std::unique_ptr<token> _literal;
+        std::string _suffix;
+
+        explicit token_custom_literal(std::size_t line, std::size_t column,
+                                      std::string text, std::unique_ptr<token> literal,
+                                      std::string value)
+            : token(line, column, std::move(text), token_type::CUSTOM_LITERAL),
+              _literal(std::move(literal)),
+              _suffix(std::move(value)) {}
+
+        ~token_custom_literal() override = default;
+    };
+}
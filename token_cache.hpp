@@ -0,0 +1,602 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "operator_table.hpp"
+#include "source_file.hpp"
+#include "symbol_table.hpp"
+#include "token_stream.hpp"
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // content hash
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // two independent 64-bit lanes over the same bytes, the first one
+    // names the cache file and the second one double checks it
+    struct content_hash {
+        std::uint64_t _a = 0x243F6A8885A308D3ULL;
+        std::uint64_t _b = 0x13198A2E03707344ULL;
+
+        static std::uint64_t rotl(std::uint64_t x, unsigned r) {
+            return (x << r) | (x >> (64U - r));
+        }
+
+        // splitmix64 finalizer
+        static std::uint64_t finish(std::uint64_t h) {
+            h ^= h >> 30U;
+            h *= 0xBF58476D1CE4E5B9ULL;
+            h ^= h >> 27U;
+            h *= 0x94D049BB133111EBULL;
+            return h ^ (h >> 31U);
+        }
+
+        void fold(std::uint64_t word) {
+            _a = (rotl(_a, 29) ^ word) * 0x9E3779B97F4A7C15ULL;
+            _b = (rotl(_b, 31) + word) * 0xC2B2AE3D27D4EB4FULL;
+        }
+
+        void update(const void *data, std::size_t length) {
+            auto *p = static_cast<const unsigned char *>(data);
+            const unsigned char *end = p + length;
+            for (; end - p >= 8; p += 8) {
+                std::uint64_t word;
+                std::memcpy(&word, p, 8);
+                fold(word);
+            }
+            std::uint64_t tail = 0;
+            std::memcpy(&tail, p, static_cast<std::size_t>(end - p));
+            fold(tail);
+            fold(length);
+        }
+
+        void update(const std::string &text) {
+            update(text.data(), text.size());
+        }
+
+        std::uint64_t key() const {
+            return finish(_a);
+        }
+
+        std::uint64_t check() const {
+            return finish(_a ^ _b);
+        }
+    };
+
+    // operators change how the same text is lexed, so they are part of the key.
+    // the trie keeps operators in the order they were added, which for an
+    // unordered_map is not the same in every process.
+    inline std::uint64_t operator_fingerprint(const operator_trie &ops) {
+        auto entries = ops.entries();
+        std::sort(entries.begin(), entries.end());
+        content_hash h;
+        for (const auto &e : entries) {
+            h.update(e.first);
+            h.fold(static_cast<std::uint64_t>(e.second));
+        }
+        return h.key();
+    }
+
+    inline std::uint64_t operator_fingerprint(const default_operator_set &) {
+        content_hash h;
+        for (const auto &def : default_operators) {
+            h.update(def._text, std::strlen(def._text));
+            h.fold(static_cast<std::uint64_t>(def._type));
+        }
+        return h.key();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // token cache files
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct token_cache_key {
+        std::uint64_t _key;
+        std::uint64_t _check;
+        std::uint64_t _source_length;
+    };
+
+    // A cache file is the header and then, each 8-byte aligned:
+    //   token_record[_records]   payloads index the tables below
+    //   std::int64_t[_ints]
+    //   double[_floats]
+    //   token_record[_customs]   literals wrapped by CUSTOM_LITERAL tokens
+    //   std::uint32_t[_names]    name lengths of symbols after the keywords
+    //   char[_name_bytes]        the names back to back
+    //   std::uint32_t[_strings]  lengths of decoded string literals, in units
+    //   char[_string_bytes]      their units back to back
+    // A STRING_LITERAL payload is 0 for a literal without escapes and
+    // 1 + the index of its value in the decoded ones otherwise.
+    // Everything is in the byte order of the machine that wrote it,
+    // the key covers that.
+    struct token_cache_header {
+        char _magic[8];
+        std::uint32_t _version;
+        std::uint32_t _reserved;
+        std::uint64_t _key;
+        std::uint64_t _check;
+        std::uint64_t _source_length;
+        std::uint32_t _records;
+        std::uint32_t _ints;
+        std::uint32_t _floats;
+        std::uint32_t _customs;
+        std::uint32_t _names;
+        std::uint32_t _name_bytes;
+        std::uint32_t _strings;
+        std::uint32_t _string_bytes;
+    };
+
+    constexpr char token_cache_magic[8] = {'C', 'S', 'T', 'O', 'K', 'E', 'N', 'S'};
+    // bump when the file layout or what the lexer produces changes
+    constexpr std::uint32_t token_cache_version = 3;
+
+    // Tokens of unchanged sources kept on disk, so a restarted process
+    // does not lex them again. Files are named after the key, written to
+    // a temporary file first and renamed into place, so several processes
+    // can share a directory: readers see a whole file or none. The least
+    // recently used files are removed when the directory grows over the cap.
+    // The directory is scanned once and then only when the bytes written
+    // since push it over the cap, or every few stores to see what other
+    // writers did. One object is meant for one thread.
+    struct token_cache {
+    private:
+        std::string _directory;
+        std::uint64_t _max_bytes;
+        std::size_t _hits = 0;
+        std::size_t _misses = 0;
+        // size of the directory as of the last scan plus what was stored since
+        std::uint64_t _bytes = 0;
+        bool _scanned = false;
+        std::size_t _stores_since_scan = 0;
+
+        static constexpr const char *suffix = ".tokens";
+        static constexpr const char *temp_suffix = ".tmp";
+        // temporary files left by a writer that died are removed after this
+        static constexpr std::time_t temp_lifetime = 600;
+        // stores between two scans when the cap is not reached
+        static constexpr std::size_t rescan_interval = 256;
+
+        static std::size_t align8(std::size_t n) {
+            return (n + 7U) & ~static_cast<std::size_t>(7U);
+        }
+
+        static bool ends_with(const std::string &s, const char *tail) {
+            std::size_t n = std::strlen(tail);
+            return s.size() >= n && s.compare(s.size() - n, n, tail) == 0;
+        }
+
+        std::string path(std::uint64_t key) const {
+            char name[17];
+            std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+            return _directory + "/" + name + suffix;
+        }
+
+        template <typename T>
+        static void put(std::string &out, const T *data, std::size_t n) {
+            out.append(reinterpret_cast<const char *>(data), n * sizeof(T));
+            out.resize(align8(out.size()), '\0');
+        }
+
+        static bool literal(const token_record &r) {
+            return r._type == token_type::INT_LITERAL || r._type == token_type::FLOATING_LITERAL
+                   || r._type == token_type::STRING_LITERAL || r._type == token_type::CHAR_LITERAL;
+        }
+
+        static std::string encode(const token_cache_key &key, const token_stream &tokens,
+                                  const symbol_table &symbols) {
+            std::vector<token_record> records;
+            std::vector<std::int64_t> ints;
+            std::vector<double> floats;
+            std::vector<token_record> customs;
+            // symbols are numbered again, keywords keep theirs
+            symbol_table names;
+            std::vector<symbol_t> renamed(symbols.size(), 0);
+            // values of literals with escapes, numbered from 1, by pool index
+            const source_buffer &source = *tokens.source();
+            std::size_t unit = source.encoding() == source_encoding::WIDE ? sizeof(char32_t) : 1;
+            std::vector<std::uint32_t> string_lengths;
+            std::string string_units;
+            std::vector<std::uint32_t> strings(tokens.strings().size(), 0);
+
+            auto move = [&](token_record r) {
+                switch (r._type) {
+                    case token_type::ID_OR_KW:
+                        if (renamed[r._payload] == 0) {
+                            std::string name = symbols.name(r._payload);
+                            renamed[r._payload] = names.intern(name.data(), name.size());
+                        }
+                        r._payload = renamed[r._payload];
+                        break;
+                    case token_type::INT_LITERAL:
+                        ints.push_back(tokens.int_value(r));
+                        r._payload = static_cast<std::uint32_t>(ints.size() - 1);
+                        break;
+                    case token_type::FLOATING_LITERAL:
+                        floats.push_back(tokens.float_value(r));
+                        r._payload = static_cast<std::uint32_t>(floats.size() - 1);
+                        break;
+                    case token_type::STRING_LITERAL: {
+                        const string_pool &pool = tokens.strings();
+                        string_index index = tokens.string_constant(r);
+                        // see string_pool::copy(), a body as long as the value has no escapes
+                        if (pool.length(index) == r._length - 2) {
+                            r._payload = 0;
+                            break;
+                        }
+                        if (strings[index] == 0) {
+                            std::uint32_t length = pool.length(index);
+                            const char *units = source.encoding() == source_encoding::WIDE
+                                ? reinterpret_cast<const char *>(pool.data<char32_t>(source, index))
+                                : reinterpret_cast<const char *>(pool.data<unsigned char>(source, index));
+                            string_lengths.push_back(length);
+                            string_units.append(units, length * unit);
+                            strings[index] = static_cast<std::uint32_t>(string_lengths.size());
+                        }
+                        r._payload = strings[index];
+                        break;
+                    }
+                    default:
+                        break;
+                }
+                return r;
+            };
+
+            records.reserve(tokens.size());
+            for (const auto &r : tokens) {
+                if (r._type == token_type::CUSTOM_LITERAL) {
+                    customs.push_back(move(tokens.custom_literal(r)));
+                    token_record custom = r;
+                    custom._payload = static_cast<std::uint32_t>(customs.size() - 1);
+                    records.push_back(custom);
+                } else {
+                    records.push_back(move(r));
+                }
+            }
+
+            std::vector<std::uint32_t> lengths;
+            std::string chars;
+            for (auto symbol = static_cast<symbol_t>(keyword_count + 1); symbol < names.size(); ++symbol) {
+                std::string name = names.name(symbol);
+                lengths.push_back(static_cast<std::uint32_t>(name.size()));
+                chars += name;
+            }
+
+            token_cache_header header{};
+            std::memcpy(header._magic, token_cache_magic, sizeof(header._magic));
+            header._version = token_cache_version;
+            header._key = key._key;
+            header._check = key._check;
+            header._source_length = key._source_length;
+            header._records = static_cast<std::uint32_t>(records.size());
+            header._ints = static_cast<std::uint32_t>(ints.size());
+            header._floats = static_cast<std::uint32_t>(floats.size());
+            header._customs = static_cast<std::uint32_t>(customs.size());
+            header._names = static_cast<std::uint32_t>(lengths.size());
+            header._name_bytes = static_cast<std::uint32_t>(chars.size());
+            header._strings = static_cast<std::uint32_t>(string_lengths.size());
+            header._string_bytes = static_cast<std::uint32_t>(string_units.size());
+
+            std::string out;
+            put(out, &header, 1);
+            put(out, records.data(), records.size());
+            put(out, ints.data(), ints.size());
+            put(out, floats.data(), floats.size());
+            put(out, customs.data(), customs.size());
+            put(out, lengths.data(), lengths.size());
+            put(out, chars.data(), chars.size());
+            put(out, string_lengths.data(), string_lengths.size());
+            put(out, string_units.data(), string_units.size());
+            return out;
+        }
+
+        // false when the file is not for this key or does not hold together,
+        // nothing is added to tokens or symbols then
+        static bool decode(const token_cache_key &key, const mapped_file &file,
+                           symbol_table &symbols, token_stream &tokens) {
+            token_cache_header header{};
+            if (file.length() < sizeof(header) || !tokens.source()) {
+                return false;
+            }
+            std::memcpy(&header, file.data(), sizeof(header));
+            if (std::memcmp(header._magic, token_cache_magic, sizeof(header._magic)) != 0
+                || header._version != token_cache_version
+                || header._key != key._key || header._check != key._check
+                || header._source_length != key._source_length) {
+                return false;
+            }
+
+            // sizes come from the file, so they are checked before any pointer is made
+            std::size_t sizes[] = {
+                header._records * sizeof(token_record),
+                header._ints * sizeof(std::int64_t),
+                header._floats * sizeof(double),
+                header._customs * sizeof(token_record),
+                header._names * sizeof(std::uint32_t),
+                header._name_bytes,
+                header._strings * sizeof(std::uint32_t),
+                header._string_bytes,
+            };
+            std::size_t starts[8];
+            std::size_t at = align8(sizeof(header));
+            for (std::size_t i = 0; i < 8; ++i) {
+                starts[i] = at;
+                at += align8(sizes[i]);
+            }
+            if (at != file.length()) {
+                return false;
+            }
+            auto records = reinterpret_cast<const token_record *>(file.data() + starts[0]);
+            auto ints = reinterpret_cast<const std::int64_t *>(file.data() + starts[1]);
+            auto floats = reinterpret_cast<const double *>(file.data() + starts[2]);
+            auto customs = reinterpret_cast<const token_record *>(file.data() + starts[3]);
+            auto lengths = reinterpret_cast<const std::uint32_t *>(file.data() + starts[4]);
+            const char *chars = file.data() + starts[5];
+            auto string_lengths = reinterpret_cast<const std::uint32_t *>(file.data() + starts[6]);
+            const char *string_units = file.data() + starts[7];
+
+            // check everything before anything is added
+            std::size_t name_bytes = 0;
+            for (std::uint32_t i = 0; i < header._names; ++i) {
+                name_bytes += lengths[i];
+            }
+            if (name_bytes != header._name_bytes) {
+                return false;
+            }
+            const source_buffer &source = *tokens.source();
+            bool wide = source.encoding() == source_encoding::WIDE;
+            std::size_t unit = wide ? sizeof(char32_t) : 1;
+            std::vector<std::size_t> string_starts(header._strings);
+            std::size_t string_bytes = 0;
+            for (std::uint32_t i = 0; i < header._strings; ++i) {
+                string_starts[i] = string_bytes;
+                string_bytes += static_cast<std::size_t>(string_lengths[i]) * unit;
+            }
+            if (string_bytes != header._string_bytes) {
+                return false;
+            }
+            std::size_t symbol_count = keyword_count + 1 + header._names;
+            auto valid = [&](const token_record &r) {
+                if (static_cast<std::uint64_t>(r._offset) + r._length > key._source_length) {
+                    return false;
+                }
+                switch (r._type) {
+                    case token_type::ID_OR_KW:
+                        return r._payload != 0 && r._payload < symbol_count;
+                    case token_type::INT_LITERAL:
+                        return r._payload < header._ints;
+                    case token_type::FLOATING_LITERAL:
+                        return r._payload < header._floats;
+                    case token_type::STRING_LITERAL:
+                        return r._length >= 2 && r._payload <= header._strings;
+                    case token_type::CHAR_LITERAL:
+                    case token_type::PREPROCESSOR:
+                    case token_type::OPERATOR:
+                        return true;
+                    case token_type::CUSTOM_LITERAL:
+                        return r._payload < header._customs && literal(customs[r._payload]);
+                    default:
+                        return false;
+                }
+            };
+            for (std::uint32_t i = 0; i < header._customs; ++i) {
+                if (!valid(customs[i])) {
+                    return false;
+                }
+            }
+            for (std::uint32_t i = 0; i < header._records; ++i) {
+                if (!valid(records[i])) {
+                    return false;
+                }
+            }
+
+            std::vector<symbol_t> renamed(symbol_count);
+            for (symbol_t symbol = 1; symbol <= keyword_count; ++symbol) {
+                renamed[symbol] = symbol;
+            }
+            for (std::uint32_t i = 0; i < header._names; ++i) {
+                renamed[keyword_count + 1 + i] = symbols.intern(chars, lengths[i]);
+                chars += lengths[i];
+            }
+
+            auto push = [&](const token_record &r) {
+                switch (r._type) {
+                    case token_type::ID_OR_KW:
+                        tokens.push_id_or_kw(r, renamed[r._payload]);
+                        break;
+                    case token_type::INT_LITERAL:
+                        tokens.push_int_literal(r, ints[r._payload]);
+                        break;
+                    case token_type::FLOATING_LITERAL:
+                        tokens.push_float_literal(r, floats[r._payload]);
+                        break;
+                    case token_type::STRING_LITERAL:
+                        if (r._payload == 0) {
+                            tokens.push_string_literal(r);
+                        } else if (wide) {
+                            // 8-byte aligned in the file, so the units are too
+                            tokens.push_string_literal(r, reinterpret_cast<const char32_t *>(
+                                string_units + string_starts[r._payload - 1]), string_lengths[r._payload - 1]);
+                        } else {
+                            tokens.push_string_literal(r, reinterpret_cast<const unsigned char *>(
+                                string_units + string_starts[r._payload - 1]), string_lengths[r._payload - 1]);
+                        }
+                        break;
+                    case token_type::CHAR_LITERAL:
+                        tokens.push_char_literal(r, static_cast<char32_t>(r._payload));
+                        break;
+                    case token_type::PREPROCESSOR:
+                        tokens.push_preprocessor(r);
+                        break;
+                    default:
+                        tokens.push_operator(r, r._op_type);
+                        break;
+                }
+            };
+
+            tokens.reserve(tokens.size() + header._records);
+            for (std::uint32_t i = 0; i < header._records; ++i) {
+                const token_record &r = records[i];
+                if (r._type == token_type::CUSTOM_LITERAL) {
+                    push(customs[r._payload]);
+                    tokens.attach_literal_suffix(r);
+                } else {
+                    push(r);
+                }
+            }
+            return true;
+        }
+
+        // scan the directory and remove files over the cap, _bytes is what is left
+        void evict() {
+#ifndef _WIN32
+            _scanned = true;
+            _stores_since_scan = 0;
+            _bytes = 0;
+            DIR *dir = ::opendir(_directory.c_str());
+            if (dir == nullptr) {
+                return;
+            }
+            struct cached_file {
+                std::string _path;
+                std::uint64_t _size;
+                std::time_t _used;
+            };
+            std::vector<cached_file> files;
+            std::uint64_t total = 0;
+            std::time_t now = std::time(nullptr);
+            while (dirent *entry = ::readdir(dir)) {
+                std::string name = entry->d_name;
+                bool temp = ends_with(name, temp_suffix);
+                if (!temp && !ends_with(name, suffix)) {
+                    continue;
+                }
+                std::string file = _directory + "/" + name;
+                struct stat st{};
+                if (::stat(file.c_str(), &st) != 0) {
+                    // removed by another process meanwhile
+                    continue;
+                }
+                if (temp) {
+                    if (now - st.st_mtime > temp_lifetime) {
+                        ::unlink(file.c_str());
+                    }
+                    continue;
+                }
+                files.push_back(cached_file{file, static_cast<std::uint64_t>(st.st_size), st.st_mtime});
+                total += static_cast<std::uint64_t>(st.st_size);
+            }
+            ::closedir(dir);
+
+            _bytes = total;
+            if (total <= _max_bytes) {
+                return;
+            }
+            std::sort(files.begin(), files.end(), [](const cached_file &a, const cached_file &b) {
+                return a._used < b._used;
+            });
+            for (const auto &f : files) {
+                if (total <= _max_bytes) {
+                    break;
+                }
+                // another process may have removed it first, it is gone either way
+                ::unlink(f._path.c_str());
+                total -= f._size;
+            }
+            _bytes = total;
+#endif
+        }
+
+    public:
+        // files are kept in directory, which is made when missing
+        explicit token_cache(std::string directory, std::uint64_t max_bytes = 256ULL * 1024 * 1024)
+            : _directory(std::move(directory)), _max_bytes(max_bytes) {}
+
+        const std::string &directory() const {
+            return _directory;
+        }
+
+        std::size_t hits() const {
+            return _hits;
+        }
+
+        std::size_t misses() const {
+            return _misses;
+        }
+
+        // key of a source lexed by an engine with the given charset and
+        // operators, `units` are the source code units as the engine sees
+        // them. names and string values are cached in the charset's local
+        // encoding, so lexers with different charsets never share entries.
+        static token_cache_key make_key(const void *units, std::size_t bytes, std::size_t length,
+                                        std::uint64_t engine, const std::string &charset,
+                                        std::uint64_t operators) {
+            content_hash h;
+            h.fold(token_cache_version);
+            // differs between little and big endian machines
+            const std::uint32_t order = 0x01020304U;
+            h.update(&order, sizeof(order));
+            h.fold(engine);
+            h.update(charset);
+            h.fold(operators);
+            h.update(units, bytes);
+            return token_cache_key{h.key(), h.check(), length};
+        }
+
+        // append the cached tokens of key, interning their names into symbols.
+        // a file that does not hold together is removed.
+        bool load(const token_cache_key &key, symbol_table &symbols, token_stream &tokens) {
+#ifndef _WIN32
+            std::string file_path = path(key._key);
+            std::shared_ptr<mapped_file> file;
+            try {
+                file = mapped_file::open(file_path);
+            } catch (const std::runtime_error &) {
+                // not cached
+            }
+            if (file && decode(key, *file, symbols, tokens)) {
+                // most recently used, evicted last
+                ::utimensat(AT_FDCWD, file_path.c_str(), nullptr, 0);
+                ++_hits;
+                return true;
+            }
+            if (file) {
+                ::unlink(file_path.c_str());
+            }
+#endif
+            ++_misses;
+            return false;
+        }
+
+        // failing to write is not an error, the tokens are just not cached
+        void store(const token_cache_key &key, const token_stream &tokens, const symbol_table &symbols) {
+#ifndef _WIN32
+            ::mkdir(_directory.c_str(), 0755);
+
+            std::string data = encode(key, tokens, symbols);
+            if (data.size() > _max_bytes || !replace_file(path(key._key), data)) {
+                return;
+            }
+            // a replaced file is counted twice, that only brings the next scan closer
+            _bytes += data.size();
+            if (!_scanned || _bytes > _max_bytes || ++_stores_since_scan >= rescan_interval) {
+                evict();
+            }
+#else
+            (void) key;
+            (void) tokens;
+            (void) symbols;
+#endif
+        }
+    };
+}
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include "source.hpp"
+#include "string_pool.hpp"
+#include "symbol_table.hpp"
+#include "token.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // token records
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // fixed-size token, the meaning of _payload depends on _type:
+    //   INT_LITERAL: index into int table
+    //   FLOATING_LITERAL: index into float table
+    //   STRING_LITERAL: index into string pool
+    //   CHAR_LITERAL: the char itself
+    //   CUSTOM_LITERAL: index into custom literal table
+    //   ID_OR_KW: symbol in the lexer's symbol table
+    // OPERATOR and PREPROCESSOR have no payload,
+    // their values are spans of the source text.
+    // lines and columns are looked up from _offset by the source.
+    struct token_record {
+        token_type _type;
+        operator_type _op_type;
+        std::uint32_t _offset;
+        std::uint32_t _length;
+        std::uint32_t _payload;
+    };
+
+    // how tokens move when the text before them is edited
+    struct token_shift {
+        std::int64_t _offset = 0;
+
+        token_record apply(token_record r) const {
+            r._offset = static_cast<std::uint32_t>(r._offset + _offset);
+            return r;
+        }
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // token stream
+    ////////////////////////////////////////////////////////////////////////////////
+
+    struct token_stream {
+    private:
+        std::shared_ptr<const source_buffer> _source;
+        std::vector<token_record> _records;
+        std::vector<int64_t> _ints;
+        std::vector<double> _floats;
+        std::vector<token_record> _customs;
+        string_pool _strings;
+
+        void push(token_record record, token_type type, std::uint32_t payload) {
+            record._type = type;
+            record._payload = payload;
+            _records.push_back(record);
+        }
+
+        std::unique_ptr<token> make_token(const token_record &r) const {
+            std::string token_text = text(r);
+            source_location at = location(r);
+            switch (r._type) {
+                case token_type::ID_OR_KW:
+                    return std::unique_ptr<token>(new token_id_or_kw{
+                        at._line, at._column, token_text, token_text, keyword(r)});
+                case token_type::INT_LITERAL:
+                    return std::unique_ptr<token>(new token_int_literal{
+                        at._line, at._column, std::move(token_text), int_value(r)});
+                case token_type::FLOATING_LITERAL:
+                    return std::unique_ptr<token>(new token_float_literal{
+                        at._line, at._column, std::move(token_text), float_value(r)});
+                case token_type::STRING_LITERAL:
+                    return std::unique_ptr<token>(new token_string_literal{
+                        at._line, at._column, std::move(token_text), string_value(r)});
+                case token_type::CHAR_LITERAL:
+                    return std::unique_ptr<token>(new token_char_literal{
+                        at._line, at._column, std::move(token_text), char_value(r)});
+                case token_type::PREPROCESSOR:
+                    return std::unique_ptr<token>(new token_preprocessor{
+                        at._line, at._column, token_text, token_text});
+                case token_type::OPERATOR:
+                    return std::unique_ptr<token>(new token_operator{
+                        at._line, at._column, token_text, token_text, r._op_type});
+                case token_type::CUSTOM_LITERAL: {
+                    std::string suffix = token_text;
+                    return std::unique_ptr<token>(new token_custom_literal{
+                        at._line, at._column, std::move(token_text),
+                        make_token(custom_literal(r)), std::move(suffix)});
+                }
+                default:
+                    return std::unique_ptr<token>(new token{
+                        at._line, at._column, std::move(token_text), r._type});
+            }
+        }
+
+    public:
+        void source(std::shared_ptr<const source_buffer> source) {
+            _source = std::move(source);
+        }
+
+        const std::shared_ptr<const source_buffer> &source() const {
+            return _source;
+        }
+
+        void push_preprocessor(const token_record &pos) {
+            push(pos, token_type::PREPROCESSOR, 0);
+        }
+
+        void push_id_or_kw(const token_record &pos, symbol_t symbol) {
+            push(pos, token_type::ID_OR_KW, symbol);
+        }
+
+        void push_operator(const token_record &pos, operator_type type) {
+            push(pos, token_type::OPERATOR, 0);
+            _records.back()._op_type = type;
+        }
+
+        void push_int_literal(const token_record &pos, int64_t value) {
+            _ints.push_back(value);
+            push(pos, token_type::INT_LITERAL, static_cast<std::uint32_t>(_ints.size() - 1));
+        }
+
+        void push_float_literal(const token_record &pos, double value) {
+            _floats.push_back(value);
+            push(pos, token_type::FLOATING_LITERAL, static_cast<std::uint32_t>(_floats.size() - 1));
+        }
+
+        // a literal without escapes, its value is the text between the quotes
+        void push_string_literal(const token_record &pos) {
+            push(pos, token_type::STRING_LITERAL, _strings.intern_span(*_source, pos._offset + 1, pos._length - 2));
+        }
+
+        // a literal with escapes, value is decoded in units of the source's encoding
+        template <typename UnitT>
+        void push_string_literal(const token_record &pos, const UnitT *value, std::size_t length) {
+            push(pos, token_type::STRING_LITERAL, _strings.intern(*_source, value, length));
+        }
+
+        void push_char_literal(const token_record &pos, char32_t value) {
+            push(pos, token_type::CHAR_LITERAL, static_cast<std::uint32_t>(value));
+        }
+
+        // wrap the last token (which must be a literal) into a custom literal,
+        // pos is the span of the suffix.
+        void attach_literal_suffix(const token_record &pos) {
+            _customs.push_back(_records.back());
+            _records.back() = pos;
+            _records.back()._type = token_type::CUSTOM_LITERAL;
+            _records.back()._op_type = operator_type::UNDEFINED;
+            _records.back()._payload = static_cast<std::uint32_t>(_customs.size() - 1);
+        }
+
+        void clear() {
+            _records.clear();
+            _ints.clear();
+            _floats.clear();
+            _customs.clear();
+            _strings.clear();
+        }
+
+        // append tokens [first, last) of another stream over the same
+        // source or an edited copy of it, moved by shift. symbols maps
+        // the other stream's symbols when it used another symbol table.
+        void append(const token_stream &other, std::size_t first, std::size_t last,
+                    const token_shift &shift = {}, const std::vector<symbol_t> *symbols = nullptr) {
+            auto move = [&](token_record r) {
+                r = shift.apply(r);
+                switch (r._type) {
+                    case token_type::ID_OR_KW:
+                        if (symbols != nullptr) {
+                            r._payload = (*symbols)[r._payload];
+                        }
+                        break;
+                    case token_type::INT_LITERAL:
+                        _ints.push_back(other._ints[r._payload]);
+                        r._payload = static_cast<std::uint32_t>(_ints.size() - 1);
+                        break;
+                    case token_type::FLOATING_LITERAL:
+                        _floats.push_back(other._floats[r._payload]);
+                        r._payload = static_cast<std::uint32_t>(_floats.size() - 1);
+                        break;
+                    case token_type::STRING_LITERAL:
+                        r._payload = _strings.copy(*_source, r._offset + 1, r._length - 2, other._strings,
+                                                   *other._source, r._payload);
+                        break;
+                    default:
+                        break;
+                }
+                return r;
+            };
+
+            _records.reserve(_records.size() + (last - first));
+            for (std::size_t i = first; i < last; ++i) {
+                const token_record &r = other._records[i];
+                if (r._type == token_type::CUSTOM_LITERAL) {
+                    _customs.push_back(move(other._customs[r._payload]));
+                    token_record custom = shift.apply(r);
+                    custom._payload = static_cast<std::uint32_t>(_customs.size() - 1);
+                    _records.push_back(custom);
+                } else {
+                    _records.push_back(move(r));
+                }
+            }
+        }
+
+        // drop the first n tokens, side tables are compacted for the rest
+        // and the string pool only keeps their values.
+        void erase_front(std::size_t n) {
+            std::size_t ints = 0;
+            std::size_t floats = 0;
+            std::size_t customs = 0;
+            string_pool strings;
+
+            // payloads are handed out in token order, so moving
+            // every table entry forward never overwrites a live one
+            auto keep = [&](token_record &r) {
+                switch (r._type) {
+                    case token_type::INT_LITERAL:
+                        _ints[ints] = _ints[r._payload];
+                        r._payload = static_cast<std::uint32_t>(ints++);
+                        break;
+                    case token_type::FLOATING_LITERAL:
+                        _floats[floats] = _floats[r._payload];
+                        r._payload = static_cast<std::uint32_t>(floats++);
+                        break;
+                    case token_type::STRING_LITERAL:
+                        r._payload = strings.copy(*_source, r._offset + 1, r._length - 2, _strings, *_source,
+                                                  r._payload);
+                        break;
+                    default:
+                        break;
+                }
+            };
+
+            for (std::size_t i = n; i < _records.size(); ++i) {
+                token_record r = _records[i];
+                if (r._type == token_type::CUSTOM_LITERAL) {
+                    token_record literal = _customs[r._payload];
+                    keep(literal);
+                    _customs[customs] = literal;
+                    r._payload = static_cast<std::uint32_t>(customs++);
+                } else {
+                    keep(r);
+                }
+                _records[i - n] = r;
+            }
+
+            _records.resize(_records.size() - n);
+            _ints.resize(ints);
+            _floats.resize(floats);
+            _customs.resize(customs);
+            _strings = std::move(strings);
+        }
+
+        // move every token by shift, e.g. after the text before them was
+        // dropped and source was set to what is left
+        void rebase(const token_shift &shift) {
+            for (auto &r : _records) {
+                r = shift.apply(r);
+            }
+            for (auto &r : _customs) {
+                r = shift.apply(r);
+            }
+            _strings.rebase(shift._offset);
+        }
+
+        void reserve(std::size_t n) {
+            _records.reserve(n);
+        }
+
+        bool empty() const {
+            return _records.empty();
+        }
+
+        std::size_t size() const {
+            return _records.size();
+        }
+
+        const token_record &operator[](std::size_t index) const {
+            return _records[index];
+        }
+
+        const token_record &back() const {
+            return _records.back();
+        }
+
+        const token_record *begin() const {
+            return _records.data();
+        }
+
+        const token_record *end() const {
+            return _records.data() + _records.size();
+        }
+
+        // local-encoded token text, made on every call
+        std::string text(const token_record &r) const {
+            return _source->local(r._offset, r._length);
+        }
+
+        // same, into a buffer the caller reuses
+        void text(const token_record &r, std::string &out) const {
+            out.clear();
+            _source->local(r._offset, r._length, out);
+        }
+
+        // value of ID_OR_KW, OPERATOR, PREPROCESSOR and STRING_LITERAL tokens,
+        // made on every call, escapes of string literals are decoded
+        std::string string_value(const token_record &r) const {
+            std::string value;
+            string_value(r, value);
+            return value;
+        }
+
+        // same, into a buffer the caller reuses
+        void string_value(const token_record &r, std::string &out) const {
+            out.clear();
+            if (r._type == token_type::STRING_LITERAL) {
+                _strings.value(*_source, r._payload, out);
+            } else {
+                _source->local(r._offset, r._length, out);
+            }
+        }
+
+        // equal string literals have the same index
+        string_index string_constant(const token_record &r) const {
+            return r._payload;
+        }
+
+        // values of the string literals
+        const string_pool &strings() const {
+            return _strings;
+        }
+
+        int64_t int_value(const token_record &r) const {
+            return _ints[r._payload];
+        }
+
+        double float_value(const token_record &r) const {
+            return _floats[r._payload];
+        }
+
+        char32_t char_value(const token_record &r) const {
+            return static_cast<char32_t>(r._payload);
+        }
+
+        // names of symbols are kept by the lexer's symbol table
+        symbol_t symbol(const token_record &r) const {
+            return r._payload;
+        }
+
+        keyword_type keyword(const token_record &r) const {
+            return symbol_table::keyword(r._payload);
+        }
+
+        // the literal wrapped by a CUSTOM_LITERAL token
+        const token_record &custom_literal(const token_record &r) const {
+            return _customs[r._payload];
+        }
+
+        std::string suffix(const token_record &r) const {
+            return text(r);
+        }
+
+        source_location location(const token_record &r) const {
+            return _source->location(r._offset);
+        }
+
+        // build the token hierarchy for consumers of the old API
+        void to_tokens(std::deque<std::unique_ptr<token>> &tokens) const {
+            for (const auto &r : _records) {
+                tokens.push_back(make_token(r));
+            }
+        }
+    };
+}
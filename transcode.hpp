@@ -0,0 +1,424 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <mozart++/codecvt>
+#include "lexer_simd.hpp"
+
+namespace cs_impl {
+    ////////////////////////////////////////////////////////////////////////////////
+    // ASCII kernels
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Copy the ASCII run at the start of the input to the output, widened
+    // or narrowed, and return where the run ends. The output has room for
+    // the whole input.
+    namespace simd {
+        inline const unsigned char *scalar_widen(const unsigned char *p, const unsigned char *end,
+                                                 char32_t *&out) {
+            while (p < end && *p < 0x80) {
+                *out++ = *p++;
+            }
+            return p;
+        }
+
+        inline const char32_t *scalar_narrow(const char32_t *p, const char32_t *end, char *&out) {
+            while (p < end && *p < 0x80) {
+                *out++ = static_cast<char>(*p++);
+            }
+            return p;
+        }
+
+#ifdef COVSCRIPT_LEXER_SIMD_X86
+        inline const unsigned char *sse2_widen(const unsigned char *p, const unsigned char *end,
+                                               char32_t *&out) {
+            const __m128i zero = _mm_setzero_si128();
+            while (end - p >= 16) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+                if (_mm_movemask_epi8(v) != 0) {
+                    break;
+                }
+                __m128i lo = _mm_unpacklo_epi8(v, zero);
+                __m128i hi = _mm_unpackhi_epi8(v, zero);
+                auto *o = reinterpret_cast<__m128i *>(out);
+                _mm_storeu_si128(o, _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(hi, zero));
+                p += 16;
+                out += 16;
+            }
+            return scalar_widen(p, end, out);
+        }
+
+        inline const char32_t *sse2_narrow_ascii(const char32_t *p, const char32_t *end, char *&out) {
+            const __m128i high = _mm_set1_epi32(~0x7F);
+            while (end - p >= 16) {
+                auto *v = reinterpret_cast<const __m128i *>(p);
+                __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+                                           _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, high), _mm_setzero_si128())) != 0xFFFF) {
+                    break;
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out), sse2_narrow(p));
+                p += 16;
+                out += 16;
+            }
+            return scalar_narrow(p, end, out);
+        }
+
+        __attribute__((target("avx2")))
+        inline const unsigned char *avx2_widen(const unsigned char *p, const unsigned char *end,
+                                               char32_t *&out) {
+            while (end - p >= 32) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+                if (_mm256_movemask_epi8(v) != 0) {
+                    break;
+                }
+                auto *o = reinterpret_cast<__m256i *>(out);
+                for (int i = 0; i < 4; ++i) {
+                    __m128i eight = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + 8 * i));
+                    _mm256_storeu_si256(o + i, _mm256_cvtepu8_epi32(eight));
+                }
+                p += 32;
+                out += 32;
+            }
+            return sse2_widen(p, end, out);
+        }
+
+        __attribute__((target("avx2")))
+        inline const char32_t *avx2_narrow_ascii(const char32_t *p, const char32_t *end, char *&out) {
+            const __m256i high = _mm256_set1_epi32(~0x7F);
+            while (end - p >= 32) {
+                auto *v = reinterpret_cast<const __m256i *>(p);
+                __m256i any = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1)),
+                    _mm256_or_si256(_mm256_loadu_si256(v + 2), _mm256_loadu_si256(v + 3)));
+                if (!_mm256_testz_si256(any, high)) {
+                    break;
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), avx2_narrow(p));
+                p += 32;
+                out += 32;
+            }
+            return sse2_narrow_ascii(p, end, out);
+        }
+#endif
+
+        struct ascii_kernels {
+            const unsigned char *(*_widen)(const unsigned char *, const unsigned char *, char32_t *&);
+            const char32_t *(*_narrow)(const char32_t *, const char32_t *, char *&);
+
+            static ascii_kernels detect() {
+#ifdef COVSCRIPT_LEXER_SIMD_X86
+                if (__builtin_cpu_supports("avx2")) {
+                    return ascii_kernels{&avx2_widen, &avx2_narrow_ascii};
+                }
+                return ascii_kernels{&sse2_widen, &sse2_narrow_ascii};
+#else
+                return ascii_kernels{&scalar_widen, &scalar_narrow};
+#endif
+            }
+
+            static const ascii_kernels &get() {
+                static const ascii_kernels k = detect();
+                return k;
+            }
+        };
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // GBK table
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Two-byte GBK chars both ways, read once from the gbk charset itself so
+    // the table always agrees with it. Lead bytes are 0x81-0xFE, trail bytes
+    // 0x40-0xFE; a pair the charset does not map to one char, or a char it
+    // does not encode as one pair, is 0.
+    struct gbk_table {
+        static constexpr unsigned lead_first = 0x81;
+        static constexpr unsigned trail_first = 0x40;
+        static constexpr std::size_t leads = 0xFE - lead_first + 1;
+        static constexpr std::size_t trails = 0xFE - trail_first + 1;
+
+        std::vector<char32_t> _to_wide;
+        // indexed by BMP char, the lead byte high
+        std::vector<std::uint16_t> _to_gbk;
+
+        explicit gbk_table(mpp::codecvt::charset &gbk) : _to_wide(leads * trails, 0), _to_gbk(0x10000, 0) {
+            // every pair on a line of its own, converted in one call
+            std::string pairs;
+            pairs.reserve(leads * trails * 3);
+            for (unsigned lead = lead_first; lead <= 0xFE; ++lead) {
+                for (unsigned trail = trail_first; trail <= 0xFE; ++trail) {
+                    pairs.push_back(static_cast<char>(lead));
+                    pairs.push_back(static_cast<char>(trail));
+                    pairs.push_back('\n');
+                }
+            }
+            std::vector<std::u32string> wide = split_lines<std::u32string>(
+                [&]() { return gbk.local2wide(pairs); },
+                [&](std::size_t i) { return gbk.local2wide(pairs.substr(i * 3, 2)); },
+                leads * trails);
+
+            // and back, so chars with more than one pair get the one the charset picks
+            std::u32string chars;
+            for (std::size_t i = 0; i < wide.size(); ++i) {
+                // a replacement char or an ASCII one is not a mapping
+                char32_t c = wide[i].size() == 1 ? wide[i][0] : 0;
+                if (c >= 0x80 && c != 0xFFFD) {
+                    _to_wide[i] = c;
+                    chars.push_back(c);
+                    chars.push_back(U'\n');
+                }
+            }
+            std::vector<std::string> local = split_lines<std::string>(
+                [&]() { return gbk.wide2local(chars); },
+                [&](std::size_t i) { return gbk.wide2local(chars.substr(i * 2, 1)); },
+                chars.size() / 2);
+            for (std::size_t i = 0; i < local.size(); ++i) {
+                char32_t c = chars[i * 2];
+                if (local[i].size() == 2 && c < 0x10000) {
+                    _to_gbk[c] = static_cast<std::uint16_t>((static_cast<unsigned char>(local[i][0]) << 8U)
+                                                            | static_cast<unsigned char>(local[i][1]));
+                }
+            }
+        }
+
+        // the n lines of what convert_all gives, or what convert_one gives
+        // for each when that does not split into n lines
+        template <typename String, typename All, typename One>
+        static std::vector<String> split_lines(All &&convert_all, One &&convert_one, std::size_t n) {
+            std::vector<String> lines;
+            try {
+                String all = convert_all();
+                std::size_t start = 0;
+                for (std::size_t newline; (newline = all.find('\n', start)) != String::npos; start = newline + 1) {
+                    lines.push_back(all.substr(start, newline - start));
+                }
+            } catch (...) {
+                // e.g. a charset that refuses bad pairs
+            }
+            if (lines.size() != n) {
+                lines.assign(n, String{});
+                for (std::size_t i = 0; i < n; ++i) {
+                    try {
+                        lines[i] = convert_one(i);
+                    } catch (...) {
+                    }
+                }
+            }
+            return lines;
+        }
+
+        char32_t to_wide(unsigned char lead, unsigned char trail) const {
+            if (lead < lead_first || lead == 0xFF || trail < trail_first || trail == 0xFF) {
+                return 0;
+            }
+            return _to_wide[(lead - lead_first) * trails + (trail - trail_first)];
+        }
+
+        std::uint16_t to_gbk(char32_t c) const {
+            return c < 0x10000 ? _to_gbk[c] : 0;
+        }
+
+        // built on first use from the first gbk charset asked for
+        static const gbk_table &get(mpp::codecvt::charset &gbk) {
+            static const gbk_table table(gbk);
+            return table;
+        }
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // transcoder
+    ////////////////////////////////////////////////////////////////////////////////
+
+    // Converts between local-encoded bytes and chars for a charset, appending
+    // to a buffer the caller keeps, so converting many small texts costs no
+    // allocation. UTF-8 and GBK are converted here: ASCII runs by the vector
+    // kernels and other chars by table. Anything these do not handle (bad
+    // sequences, chars GBK can not encode, other charsets) is left to the
+    // charset from there on, so results always match the charset's. With
+    // Charset being mpp::codecvt::utf8 the UTF-8 path is picked at compile
+    // time, any other Charset is looked at once at run time.
+    template <typename Charset>
+    struct basic_transcoder {
+    private:
+        enum class kind {
+            UTF8,
+            GBK,
+            OTHER,
+        };
+
+        static constexpr bool static_utf8 = std::is_same<Charset, mpp::codecvt::utf8>::value;
+
+        std::shared_ptr<Charset> _charset;
+        kind _kind = kind::OTHER;
+        const gbk_table *_gbk = nullptr;
+
+        kind current() const {
+            return static_utf8 ? kind::UTF8 : _kind;
+        }
+
+        static bool continuation(unsigned char c) {
+            return (c & 0xC0U) == 0x80;
+        }
+
+        // one UTF-8 char, 0 when p is not at a valid, shortest sequence
+        static std::size_t decode_utf8(const unsigned char *p, const unsigned char *end, char32_t &c) {
+            unsigned char lead = *p;
+            auto left = static_cast<std::size_t>(end - p);
+            if (lead >= 0xC2 && lead <= 0xDF) {
+                if (left < 2 || !continuation(p[1])) {
+                    return 0;
+                }
+                c = (char32_t(lead & 0x1FU) << 6U) | (p[1] & 0x3FU);
+                return 2;
+            }
+            if (lead >= 0xE0 && lead <= 0xEF) {
+                if (left < 3 || !continuation(p[1]) || !continuation(p[2])) {
+                    return 0;
+                }
+                c = (char32_t(lead & 0x0FU) << 12U) | (char32_t(p[1] & 0x3FU) << 6U) | (p[2] & 0x3FU);
+                return c >= 0x800 && (c < 0xD800 || c > 0xDFFF) ? 3 : 0;
+            }
+            if (lead >= 0xF0 && lead <= 0xF4) {
+                if (left < 4 || !continuation(p[1]) || !continuation(p[2]) || !continuation(p[3])) {
+                    return 0;
+                }
+                c = (char32_t(lead & 0x07U) << 18U) | (char32_t(p[1] & 0x3FU) << 12U)
+                    | (char32_t(p[2] & 0x3FU) << 6U) | (p[3] & 0x3FU);
+                return c >= 0x10000 && c <= 0x10FFFF ? 4 : 0;
+            }
+            return 0;
+        }
+
+        // 0 when c can not be encoded
+        static std::size_t encode_utf8(char32_t c, char *out) {
+            if (c < 0x800) {
+                out[0] = static_cast<char>(0xC0U | (c >> 6U));
+                out[1] = static_cast<char>(0x80U | (c & 0x3FU));
+                return 2;
+            }
+            if (c < 0x10000) {
+                if (c >= 0xD800 && c <= 0xDFFF) {
+                    return 0;
+                }
+                out[0] = static_cast<char>(0xE0U | (c >> 12U));
+                out[1] = static_cast<char>(0x80U | ((c >> 6U) & 0x3FU));
+                out[2] = static_cast<char>(0x80U | (c & 0x3FU));
+                return 3;
+            }
+            if (c <= 0x10FFFF) {
+                out[0] = static_cast<char>(0xF0U | (c >> 18U));
+                out[1] = static_cast<char>(0x80U | ((c >> 12U) & 0x3FU));
+                out[2] = static_cast<char>(0x80U | ((c >> 6U) & 0x3FU));
+                out[3] = static_cast<char>(0x80U | (c & 0x3FU));
+                return 4;
+            }
+            return 0;
+        }
+
+    public:
+        explicit basic_transcoder(std::shared_ptr<Charset> charset)
+            : _charset(std::move(charset)) {
+            if (static_utf8 || dynamic_cast<mpp::codecvt::utf8 *>(_charset.get()) != nullptr) {
+                _kind = kind::UTF8;
+            } else if (dynamic_cast<mpp::codecvt::gbk *>(_charset.get()) != nullptr) {
+                _kind = kind::GBK;
+                _gbk = &gbk_table::get(*_charset);
+            }
+        }
+
+        // append the chars of local-encoded bytes to out
+        void decode(const char *data, std::size_t length, std::u32string &out) const {
+            kind k = current();
+            if (k == kind::OTHER) {
+                out.append(_charset->local2wide(std::string{data, length}));
+                return;
+            }
+            // never more chars than bytes
+            std::size_t old_size = out.size();
+            out.resize(old_size + length);
+            char32_t *o = &out[0] + old_size;
+
+            auto widen = simd::ascii_kernels::get()._widen;
+            auto *p = reinterpret_cast<const unsigned char *>(data);
+            auto *end = p + length;
+            while ((p = widen(p, end, o)) < end) {
+                char32_t c = 0;
+                std::size_t n = 0;
+                if (k == kind::UTF8) {
+                    n = decode_utf8(p, end, c);
+                } else if (end - p >= 2 && (c = _gbk->to_wide(p[0], p[1])) != 0) {
+                    n = 2;
+                }
+                if (n == 0) {
+                    break;
+                }
+                *o++ = c;
+                p += n;
+            }
+            out.resize(static_cast<std::size_t>(o - out.data()));
+            if (p < end) {
+                out.append(_charset->local2wide(std::string{reinterpret_cast<const char *>(p),
+                                                            static_cast<std::size_t>(end - p)}));
+            }
+        }
+
+        // append the local encoding of chars to out
+        void encode(const char32_t *data, std::size_t length, std::string &out) const {
+            kind k = current();
+            if (k == kind::OTHER) {
+                out.append(_charset->wide2local({data, length}));
+                return;
+            }
+            // never more than 4 bytes a char in UTF-8, 2 in GBK
+            std::size_t old_size = out.size();
+            out.resize(old_size + length * (k == kind::UTF8 ? 4 : 2));
+            char *o = &out[0] + old_size;
+
+            auto narrow = simd::ascii_kernels::get()._narrow;
+            const char32_t *p = data;
+            const char32_t *end = data + length;
+            while ((p = narrow(p, end, o)) < end) {
+                std::size_t n = 0;
+                if (k == kind::UTF8) {
+                    n = encode_utf8(*p, o);
+                } else if (std::uint16_t pair = _gbk->to_gbk(*p)) {
+                    o[0] = static_cast<char>(pair >> 8U);
+                    o[1] = static_cast<char>(pair & 0xFFU);
+                    n = 2;
+                }
+                if (n == 0) {
+                    break;
+                }
+                o += n;
+                ++p;
+            }
+            out.resize(static_cast<std::size_t>(o - out.data()));
+            if (p < end) {
+                out.append(_charset->wide2local({p, static_cast<std::size_t>(end - p)}));
+            }
+        }
+
+        std::u32string decode(const std::string &local) const {
+            std::u32string out;
+            decode(local.data(), local.size(), out);
+            return out;
+        }
+
+        std::string encode(const char32_t *data, std::size_t length) const {
+            std::string out;
+            encode(data, length, out);
+            return out;
+        }
+    };
+
+    using transcoder = basic_transcoder<mpp::codecvt::charset>;
+}